@@ -5,6 +5,7 @@
 #include "audio_codec.h"
 #include "mqtt_protocol.h"
 #include "websocket_protocol.h"
+#include "loopback_protocol.h"
 #include "assets/lang_config.h"
 #include "mcp_server.h"
 #include "assets.h"
@@ -74,9 +75,23 @@ void Application::Initialize() {
     audio_service_.Initialize(codec);
     audio_service_.Start();
 
+    // Queue the common earcons for the sound bank, the other sounds are cached after their first play
+    audio_service_.PreloadSound(Lang::Sounds::OGG_POPUP);
+    audio_service_.PreloadSound(Lang::Sounds::OGG_SUCCESS);
+    audio_service_.PreloadSound(Lang::Sounds::OGG_EXCLAMATION);
+    audio_service_.PreloadSound(Lang::Sounds::OGG_VIBRATION);
+
+    // Start the uplink sender task
+    xTaskCreate([](void* arg) {
+        ((Application*)arg)->AudioSenderTask();
+        vTaskDelete(NULL);
+    }, "audio_sender", 2048 * 4, this, AUDIO_SENDER_TASK_PRIORITY, &audio_sender_task_handle_);
+
     AudioServiceCallbacks callbacks;
     callbacks.on_send_queue_available = [this]() {
-        xEventGroupSetBits(event_group_, MAIN_EVENT_SEND_AUDIO);
+        if (audio_sender_task_handle_ != nullptr) {
+            xTaskNotifyGive(audio_sender_task_handle_);
+        }
     };
     callbacks.on_wake_word_detected = [this](const std::string& wake_word) {
         xEventGroupSetBits(event_group_, MAIN_EVENT_WAKE_WORD_DETECTED);
@@ -169,7 +184,7 @@ void Application::Run() {
 
     const EventBits_t ALL_EVENTS = 
         MAIN_EVENT_SCHEDULE |
-        MAIN_EVENT_SEND_AUDIO |
+        MAIN_EVENT_AUDIO_SEND_FAILED |
         MAIN_EVENT_WAKE_WORD_DETECTED |
         MAIN_EVENT_VAD_CHANGE |
         MAIN_EVENT_CLOCK_TICK |
@@ -218,12 +233,8 @@ void Application::Run() {
             HandleStopListeningEvent();
         }
 
-        if (bits & MAIN_EVENT_SEND_AUDIO) {
-            while (auto packet = audio_service_.PopPacketFromSendQueue()) {
-                if (protocol_ && !protocol_->SendAudio(std::move(packet))) {
-                    break;
-                }
-            }
+        if (bits & MAIN_EVENT_AUDIO_SEND_FAILED) {
+            HandleAudioSendFailedEvent();
         }
 
         if (bits & MAIN_EVENT_WAKE_WORD_DETECTED) {
@@ -255,7 +266,92 @@ void Application::Run() {
             // Print debug info every 10 seconds
             if (clock_ticks_ % 10 == 0) {
                 SystemInfo::PrintHeapStats();
+                uint32_t batches = send_statistics_.batches.exchange(0);
+                if (batches > 0) {
+                    ESP_LOGI(TAG, "Audio send: %lu messages, %lu failed, avg %lu us, max %lu us", batches,
+                        send_statistics_.failures.exchange(0), send_statistics_.total_us.exchange(0) / batches,
+                        send_statistics_.max_us.exchange(0));
+                }
+                audio_service_.latency_tracer().Log();
+                audio_service_.LogPoolMisses();
+            }
+        }
+    }
+}
+
+void Application::AudioSenderTask() {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        SendQueuedAudio();
+    }
+}
+
+void Application::SendQueuedAudio() {
+    std::lock_guard<std::mutex> lock(protocol_send_mutex_);
+    // In multi-frame mode, wait for a batch worth the latency budget, unless listening already stopped
+    int batch_ms = protocol_ && protocol_->multi_frame() ? CONFIG_AUDIO_FRAME_AGGREGATION_MS : 0;
+    bool flush = !audio_service_.IsAudioProcessorRunning();
+    while (audio_service_.PopPacketsFromSendQueue(send_batch_, batch_ms, flush)) {
+        int64_t start_time = esp_timer_get_time();
+        bool sent = protocol_ && protocol_->SendAudioFrames(send_batch_);
+        int64_t sent_time = esp_timer_get_time();
+        int batch_duration_ms = 0;
+        for (auto& packet : send_batch_) {
+            if (sent) {
+                audio_service_.latency_tracer().Record(kLatencyUplinkSent, packet->trace_time_us, sent_time);
+            }
+            batch_duration_ms += packet->frame_duration;
+            audio_service_.ReleasePacket(std::move(packet));
+        }
+        send_batch_.clear();
+        if (!protocol_) {
+            continue;
+        }
+
+        uint32_t elapsed_us = sent_time - start_time;
+        audio_service_.OnAudioSent(batch_duration_ms, elapsed_us, sent);
+        send_statistics_.batches++;
+        send_statistics_.total_us += elapsed_us;
+        /* The main task takes the maximum with exchange(0), so it is raised with a compare-exchange */
+        uint32_t max_us = send_statistics_.max_us.load();
+        while (elapsed_us > max_us && !send_statistics_.max_us.compare_exchange_weak(max_us, elapsed_us)) {
+        }
+        if (!sent) {
+            send_statistics_.failures++;
+            xEventGroupSetBits(event_group_, MAIN_EVENT_AUDIO_SEND_FAILED);
+            break;
+        }
+    }
+}
+
+void Application::SendWakeWordAudio() {
+    std::lock_guard<std::mutex> lock(protocol_send_mutex_);
+    int batch_ms = protocol_->multi_frame() ? CONFIG_AUDIO_FRAME_AGGREGATION_MS : 0;
+    int queued_ms = 0;
+    // Local batch, this may run outside the main task (WakeWordInvoke)
+    std::vector<std::unique_ptr<AudioStreamPacket>> batch;
+    int packets = 0;
+    while (true) {
+        auto packet = audio_service_.PopWakeWordPacket();
+        if (packet) {
+            queued_ms += packet->frame_duration;
+            batch.push_back(std::move(packet));
+        }
+        if (!batch.empty() && (packet == nullptr || queued_ms >= batch_ms)) {
+            protocol_->SendAudioFrames(batch);
+            if (packets == 0) {
+                ESP_LOGI(TAG, "Wake word audio: first packet sent %ld ms after the detection",
+                    (long)((esp_timer_get_time() - audio_service_.wake_word_detected_time_us()) / 1000));
+            }
+            packets += batch.size();
+            for (auto& queued : batch) {
+                audio_service_.ReleasePacket(std::move(queued));
             }
+            batch.clear();
+            queued_ms = 0;
+        }
+        if (packet == nullptr) {
+            break;
         }
     }
 }
@@ -498,6 +594,10 @@ void Application::InitializeProtocol() {
 
     display->SetStatus(Lang::Strings::LOADING_PROTOCOL);
 
+    std::unique_lock<std::mutex> send_lock(protocol_send_mutex_);
+#if CONFIG_USE_LOOPBACK_PROTOCOL
+    protocol_ = std::make_unique<LoopbackProtocol>();
+#else
     if (ota_->HasMqttConfig()) {
         protocol_ = std::make_unique<MqttProtocol>();
     } else if (ota_->HasWebsocketConfig()) {
@@ -506,6 +606,8 @@ void Application::InitializeProtocol() {
         ESP_LOGW(TAG, "No protocol specified in the OTA config, using MQTT");
         protocol_ = std::make_unique<MqttProtocol>();
     }
+#endif
+    send_lock.unlock();
 
     protocol_->OnConnected([this]() {
         DismissAlert();
@@ -516,15 +618,27 @@ void Application::InitializeProtocol() {
         xEventGroupSetBits(event_group_, MAIN_EVENT_ERROR);
     });
     
+    protocol_->OnAllocateAudioPacket([this]() {
+        return audio_service_.AcquirePacket();
+    });
+
+    protocol_->OnReleaseAudioPacket([this](std::unique_ptr<AudioStreamPacket> packet) {
+        audio_service_.ReleasePacket(std::move(packet));
+    });
+
     protocol_->OnIncomingAudio([this](std::unique_ptr<AudioStreamPacket> packet) {
         if (GetDeviceState() == kDeviceStateSpeaking) {
+            packet->trace_time_us = esp_timer_get_time();
             audio_service_.PushPacketToDecodeQueue(std::move(packet));
+        } else {
+            audio_service_.ReleasePacket(std::move(packet));
         }
     });
     
     protocol_->OnAudioChannelOpened([this, codec, &board]() {
         board.SetPowerSaveLevel(PowerSaveLevel::PERFORMANCE);
-        if (protocol_->server_sample_rate() != codec->output_sample_rate()) {
+        /* The Opus decoder outputs the codec rate itself when it is one of the Opus rates */
+        if (!IS_OPUS_SAMPLE_RATE(codec->output_sample_rate())) {
             ESP_LOGW(TAG, "Server sample rate %d does not match device output sample rate %d, resampling may cause distortion",
                 protocol_->server_sample_rate(), codec->output_sample_rate());
         }
@@ -626,7 +740,8 @@ void Application::InitializeProtocol() {
             ESP_LOGW(TAG, "Unknown message type: %s", type->valuestring);
         }
     });
-    
+
+    protocol_->SetOutputSampleRates(audio_service_.GetOutputSampleRates());
     protocol_->Start();
 }
 
@@ -776,6 +891,14 @@ void Application::HandleStopListeningEvent() {
     }
 }
 
+void Application::HandleAudioSendFailedEvent() {
+    // Network errors are reported by the protocol itself, only stop listening into a channel that is gone
+    if (GetDeviceState() == kDeviceStateListening && protocol_ && !protocol_->IsAudioChannelOpened()) {
+        ESP_LOGW(TAG, "Audio channel lost while listening");
+        SetDeviceState(kDeviceStateIdle);
+    }
+}
+
 void Application::HandleWakeWordDetectedEvent() {
     if (!protocol_) {
         return;
@@ -798,15 +921,12 @@ void Application::HandleWakeWordDetectedEvent() {
         ESP_LOGI(TAG, "Wake word detected: %s", wake_word.c_str());
 #if CONFIG_SEND_WAKE_WORD_DATA
         // Encode and send the wake word data to the server
-        while (auto packet = audio_service_.PopWakeWordPacket()) {
-            protocol_->SendAudio(std::move(packet));
-        }
+        SendWakeWordAudio();
         // Set the chat state to wake word detected
         protocol_->SendWakeWordDetected(wake_word);
         SetListeningMode(aec_mode_ == kAecOff ? kListeningModeAutoStop : kListeningModeRealtime);
 #else
         // Set flag to play popup sound after state changes to listening
-        // (PlaySound here would be cleared by ResetDecoder in EnableVoiceProcessing)
         play_popup_on_listening_ = true;
         SetListeningMode(aec_mode_ == kAecOff ? kListeningModeAutoStop : kListeningModeRealtime);
 #endif
@@ -858,7 +978,7 @@ void Application::HandleStateChangedEvent() {
                 audio_service_.EnableWakeWordDetection(false);
             }
 
-            // Play popup sound after ResetDecoder (in EnableVoiceProcessing) has been called
+            // Play popup sound once the audio processor is running
             if (play_popup_on_listening_) {
                 play_popup_on_listening_ = false;
                 audio_service_.PlaySound(Lang::Sounds::OGG_POPUP);
@@ -911,7 +1031,10 @@ void Application::Reboot() {
     if (protocol_ && protocol_->IsAudioChannelOpened()) {
         protocol_->CloseAudioChannel();
     }
-    protocol_.reset();
+    {
+        std::lock_guard<std::mutex> lock(protocol_send_mutex_);
+        protocol_.reset();
+    }
     audio_service_.Stop();
 
     vTaskDelay(pdMS_TO_TICKS(1000));
@@ -991,15 +1114,12 @@ void Application::WakeWordInvoke(const std::string& wake_word) {
         ESP_LOGI(TAG, "Wake word detected: %s", wake_word.c_str());
 #if CONFIG_USE_AFE_WAKE_WORD || CONFIG_USE_CUSTOM_WAKE_WORD
         // Encode and send the wake word data to the server
-        while (auto packet = audio_service_.PopWakeWordPacket()) {
-            protocol_->SendAudio(std::move(packet));
-        }
+        SendWakeWordAudio();
         // Set the chat state to wake word detected
         protocol_->SendWakeWordDetected(wake_word);
         SetListeningMode(aec_mode_ == kAecOff ? kListeningModeAutoStop : kListeningModeRealtime);
 #else
         // Set flag to play popup sound after state changes to listening
-        // (PlaySound here would be cleared by ResetDecoder in EnableVoiceProcessing)
         play_popup_on_listening_ = true;
         SetListeningMode(aec_mode_ == kAecOff ? kListeningModeAutoStop : kListeningModeRealtime);
 #endif
@@ -1069,6 +1189,19 @@ void Application::SetAecMode(AecMode mode) {
     });
 }
 
+bool Application::SetFrameDuration(int frame_duration_ms) {
+    if (!audio_service_.SetFrameDuration(frame_duration_ms)) {
+        return false;
+    }
+    Schedule([this]() {
+        // The frame duration is negotiated in the hello message, so start a new session
+        if (protocol_ && protocol_->IsAudioChannelOpened()) {
+            protocol_->CloseAudioChannel();
+        }
+    });
+    return true;
+}
+
 void Application::PlaySound(const std::string_view& sound) {
     audio_service_.PlaySound(sound);
 }
@@ -1079,7 +1212,8 @@ void Application::ResetProtocol() {
         if (protocol_ && protocol_->IsAudioChannelOpened()) {
             protocol_->CloseAudioChannel();
         }
-        // Reset protocol
+        // Reset protocol, once the sender task is done with it
+        std::lock_guard<std::mutex> lock(protocol_send_mutex_);
         protocol_.reset();
     });
 }
@@ -10,6 +10,7 @@
 #include <mutex>
 #include <deque>
 #include <memory>
+#include <atomic>
 
 #include "protocol.h"
 #include "ota.h"
@@ -19,7 +20,7 @@
 
 // Main event bits
 #define MAIN_EVENT_SCHEDULE             (1 << 0)
-#define MAIN_EVENT_SEND_AUDIO           (1 << 1)
+#define MAIN_EVENT_AUDIO_SEND_FAILED    (1 << 1)
 #define MAIN_EVENT_WAKE_WORD_DETECTED   (1 << 2)
 #define MAIN_EVENT_VAD_CHANGE           (1 << 3)
 #define MAIN_EVENT_ERROR                (1 << 4)
@@ -32,6 +33,16 @@
 #define MAIN_EVENT_STOP_LISTENING       (1 << 11)
 #define MAIN_EVENT_STATE_CHANGED        (1 << 12)
 
+// Above the main task (10), so a busy main loop never holds back the uplink
+#define AUDIO_SENDER_TASK_PRIORITY 11
+
+struct AudioSendStatistics {
+    std::atomic<uint32_t> batches = 0;
+    std::atomic<uint32_t> failures = 0;
+    std::atomic<uint32_t> total_us = 0;
+    std::atomic<uint32_t> max_us = 0;
+};
+
 
 enum AecMode {
     kAecOff,
@@ -110,6 +121,7 @@ public:
     void SendMcpMessage(const std::string& payload);
     void SetAecMode(AecMode mode);
     AecMode GetAecMode() const { return aec_mode_; }
+    bool SetFrameDuration(int frame_duration_ms);
     void PlaySound(const std::string_view& sound);
     AudioService& GetAudioService() { return audio_service_; }
     
@@ -148,6 +160,12 @@ private:
     int last_low_battery_check_tick_ = 0;
     int last_low_battery_reminder_tick_ = -kLowBatteryReminderIntervalSeconds;
     TaskHandle_t activation_task_handle_ = nullptr;
+    // The sender task owns the send side of the protocol, protocol_send_mutex_ keeps protocol_ alive meanwhile
+    TaskHandle_t audio_sender_task_handle_ = nullptr;
+    std::mutex protocol_send_mutex_;
+    // Packets popped from the send queue for one message, only used by the sender task
+    std::vector<std::unique_ptr<AudioStreamPacket>> send_batch_;
+    AudioSendStatistics send_statistics_;
 
 
     // Event handlers
@@ -159,6 +177,10 @@ private:
     void HandleNetworkDisconnectedEvent();
     void HandleActivationDoneEvent();
     void HandleWakeWordDetectedEvent();
+    void HandleAudioSendFailedEvent();
+
+    // Uplink audio sender task
+    void AudioSenderTask();
 
     // Activation task (runs in background)
     void ActivationTask();
@@ -170,6 +192,8 @@ private:
     void ShowActivationCode(const std::string& code, const std::string& message);
     void SetListeningMode(ListeningMode mode);
     void MaybeRemindLowBattery();
+    void SendQueuedAudio();
+    void SendWakeWordAudio();
     
     // State change handler called by state machine
     void OnStateChanged(DeviceState old_state, DeviceState new_state);
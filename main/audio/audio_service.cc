@@ -1,26 +1,10 @@
 #include "audio_service.h"
 #include <esp_log.h>
 #include <cstring>
+#include <algorithm>
 
-#define RATE_CVT_CFG(_src_rate, _dest_rate, _channel)        \
-    (esp_ae_rate_cvt_cfg_t)                                  \
-    {                                                        \
-        .src_rate        = (uint32_t)(_src_rate),            \
-        .dest_rate       = (uint32_t)(_dest_rate),           \
-        .channel         = (uint8_t)(_channel),              \
-        .bits_per_sample = ESP_AUDIO_BIT16,                  \
-        .complexity      = 2,                                \
-        .perf_type       = ESP_AE_RATE_CVT_PERF_TYPE_SPEED,  \
-    }
-
-#define OPUS_DEC_CFG(_sample_rate, _frame_duration_ms)                                                    \
-    (esp_opus_dec_cfg_t)                                                                                  \
-    {                                                                                                     \
-        .sample_rate    = (uint32_t)(_sample_rate),                                                       \
-        .channel        = ESP_AUDIO_MONO,                                                                 \
-        .frame_duration = (esp_opus_dec_frame_duration_t)AS_OPUS_GET_FRAME_DRU_ENUM(_frame_duration_ms),  \
-        .self_delimited = false,                                                                          \
-    }
+#include "settings.h"
+#include "sample_kernels.h"
 
 #if CONFIG_USE_AUDIO_PROCESSOR
 #include "processors/afe_audio_processor.h"
@@ -48,40 +32,43 @@ AudioService::~AudioService() {
     if (opus_encoder_ != nullptr) {
         esp_opus_enc_close(opus_encoder_);
     }
-    if (opus_decoder_ != nullptr) {
-        esp_opus_dec_close(opus_decoder_);
-    }
     if (input_resampler_ != nullptr) {
         esp_ae_rate_cvt_close(input_resampler_);
     }
-    if (output_resampler_ != nullptr) {
-        esp_ae_rate_cvt_close(output_resampler_);
-    }
 }
 
 void AudioService::Initialize(AudioCodec* codec) {
     codec_ = codec;
     codec_->Start();
 
-    esp_opus_dec_cfg_t opus_dec_cfg = OPUS_DEC_CFG(codec->output_sample_rate(), OPUS_FRAME_DURATION_MS);
-    auto ret = esp_opus_dec_open(&opus_dec_cfg, sizeof(esp_opus_dec_cfg_t), &opus_decoder_);
-    if (opus_decoder_ == nullptr) {
-        ESP_LOGE(TAG, "Failed to create audio decoder, error code: %d", ret);
-    } else {
-        decoder_sample_rate_ = codec->output_sample_rate();
-        decoder_duration_ms_ = OPUS_FRAME_DURATION_MS;
-        decoder_frame_size_ = decoder_sample_rate_ / 1000 * OPUS_FRAME_DURATION_MS;
-    }
-    esp_opus_enc_config_t opus_enc_cfg = AS_OPUS_ENC_CONFIG();
-    ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &opus_encoder_);
-    if (opus_encoder_ == nullptr) {
-        ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", ret);
+    decoder_cache_ = std::make_unique<OpusDecoderCache>(DECODER_CACHE_SIZE, codec->output_sample_rate());
+    SetDecodeSampleRate(codec->output_sample_rate(), OPUS_FRAME_DURATION_MS);
+    audio_decode_queue_.SetLimit(AUDIO_QUEUE_MAX_DURATION_MS / OPUS_FRAME_DURATION_MS);
+
+    /* Open the encoder with the saved frame duration, this also sizes the send queue and the packet pool */
+    Settings settings("audio", false);
+    int frame_duration = settings.GetInt("frame_duration", OPUS_FRAME_DURATION_MS);
+    if (IS_VALID_FRAME_DURATION(frame_duration)) {
+        frame_duration_ms_ = frame_duration;
     } else {
-        encoder_sample_rate_ = 16000;
-        encoder_duration_ms_ = OPUS_FRAME_DURATION_MS;
-        esp_opus_enc_get_frame_size(opus_encoder_, &encoder_frame_size_, &encoder_outbuf_size_);
-        encoder_frame_size_ = encoder_frame_size_ / sizeof(int16_t);
+        ESP_LOGW(TAG, "Invalid frame duration %d ms, using %d ms", frame_duration, OPUS_FRAME_DURATION_MS);
     }
+    ApplyFrameDuration();
+
+    /* Allocate the pooled tasks once, their buffers are recycled afterwards */
+    size_t pcm_reserve = std::max<size_t>(encoder_frame_size_, codec->output_sample_rate() / 1000 * OPUS_FRAME_DURATION_MS);
+    audio_task_pool_.Fill([pcm_reserve](AudioTask& task) {
+        task.pcm.reserve(pcm_reserve);
+    });
+    decode_output_buffer_.reserve(decoder_frame_size_);
+    sound_bank_ = std::make_unique<SoundBank>(codec->output_sample_rate(), SOUND_BANK_CAPACITY_BYTES);
+    playback_mixer_.SetDucking(kPlaybackStreamCue, PLAYBACK_CUE_DUCKING_GAIN);
+
+    /* Size the input buffers for the longest frame, so the input task runs without allocations */
+    size_t input_samples = 16000 / 1000 * OPUS_FRAME_DURATION_MS;
+    input_buffer_.reserve(input_samples * codec->input_channels());
+    input_mono_buffer_.reserve(input_samples);
+    input_capture_buffer_.reserve(codec->input_sample_rate() / 1000 * OPUS_FRAME_DURATION_MS * codec->input_channels());
 
     if (codec->input_sample_rate() != 16000) {
         esp_ae_rate_cvt_cfg_t input_resampler_cfg = RATE_CVT_CFG(
@@ -98,8 +85,14 @@ void AudioService::Initialize(AudioCodec* codec) {
     audio_processor_ = std::make_unique<NoAudioProcessor>();
 #endif
 
-    audio_processor_->OnOutput([this](std::vector<int16_t>&& data) {
-        PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, std::move(data));
+    audio_processor_->OnOutput([this](const std::vector<int16_t>& data) {
+        /* The last sample of the frame was captured at */
+        processor_output_samples_ += data.size();
+        /* The pre-roll ended before a gap in the capture, its samples keep the origin they were fed with */
+        int64_t origin_us = processor_output_samples_ <= processor_preroll_end_samples_ ?
+            processor_preroll_origin_us_.load() : processor_time_origin_us_.load();
+        int64_t capture_time_us = origin_us + (int64_t)(processor_output_samples_ * 1000 / 16);
+        PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, data, capture_time_us);
     });
 
     audio_processor_->OnVadStateChange([this](bool speaking) {
@@ -133,6 +126,7 @@ void AudioService::Start() {
     xTaskCreatePinnedToCore([](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
         audio_service->AudioInputTask();
+        audio_service->audio_input_task_handle_ = nullptr;
         vTaskDelete(NULL);
     }, "audio_input", 2048 * 3, this, 8, &audio_input_task_handle_, 0);
 
@@ -140,6 +134,7 @@ void AudioService::Start() {
     xTaskCreate([](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
         audio_service->AudioOutputTask();
+        audio_service->audio_output_task_handle_ = nullptr;
         vTaskDelete(NULL);
     }, "audio_output", 2048 * 2, this, 4, &audio_output_task_handle_);
 #else
@@ -147,6 +142,7 @@ void AudioService::Start() {
     xTaskCreate([](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
         audio_service->AudioInputTask();
+        audio_service->audio_input_task_handle_ = nullptr;
         vTaskDelete(NULL);
     }, "audio_input", 2048 * 2, this, 8, &audio_input_task_handle_);
 
@@ -154,16 +150,27 @@ void AudioService::Start() {
     xTaskCreate([](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
         audio_service->AudioOutputTask();
+        audio_service->audio_output_task_handle_ = nullptr;
         vTaskDelete(NULL);
     }, "audio_output", 2048, this, 4, &audio_output_task_handle_);
 #endif
 
-    /* Start the opus codec task */
-    xTaskCreate([](void* arg) {
+    /* Start the opus encoder and decoder tasks, so that uplink and downlink never wait for each other */
+    xTaskCreatePinnedToCore([](void* arg) {
+        AudioService* audio_service = (AudioService*)arg;
+        audio_service->OpusEncodeTask();
+        audio_service->opus_encode_task_handle_ = nullptr;
+        vTaskDelete(NULL);
+    }, "opus_encode", 2048 * 12, this, CONFIG_AUDIO_ENCODE_TASK_PRIORITY, &opus_encode_task_handle_,
+        AS_TASK_CORE(CONFIG_AUDIO_ENCODE_TASK_CORE));
+
+    xTaskCreatePinnedToCore([](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
-        audio_service->OpusCodecTask();
+        audio_service->OpusDecodeTask();
+        audio_service->opus_decode_task_handle_ = nullptr;
         vTaskDelete(NULL);
-    }, "opus_codec", 2048 * 12, this, 2, &opus_codec_task_handle_);
+    }, "opus_decode", 2048 * 8, this, CONFIG_AUDIO_DECODE_TASK_PRIORITY, &opus_decode_task_handle_,
+        AS_TASK_CORE(CONFIG_AUDIO_DECODE_TASK_CORE));
 }
 
 void AudioService::Stop() {
@@ -171,14 +178,46 @@ void AudioService::Stop() {
     service_stopped_ = true;
     xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING |
         AS_EVENT_WAKE_WORD_RUNNING |
-        AS_EVENT_AUDIO_PROCESSOR_RUNNING);
+        AS_EVENT_AUDIO_PROCESSOR_RUNNING |
+        AS_EVENT_ENCODE_QUEUE_POPPED |
+        AS_EVENT_DECODE_QUEUE_POPPED |
+        AS_EVENT_PLAYBACK_QUEUE_POPPED |
+        AS_EVENT_SOUND_FINISHED);
+
+    audio_encode_queue_.Clear();
+    audio_decode_queue_.Clear();
+    audio_playback_queue_.Clear();
+    audio_cue_queue_.Clear();
+    audio_testing_queue_.Clear();
+    sound_queue_.Clear();
+    NotifyTask(audio_output_task_handle_);
+    NotifyTask(opus_encode_task_handle_);
+    NotifyTask(opus_decode_task_handle_);
+}
 
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    audio_encode_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+void AudioService::NotifyTask(TaskHandle_t task) {
+    if (task != nullptr) {
+        xTaskNotifyGive(task);
+    }
+}
+
+template <typename T>
+bool AudioService::PushToQueue(SpscRingBuffer<T>& queue, T&& item, EventBits_t popped_bit, bool wait) {
+    if (queue.Push(std::move(item))) {
+        return true;
+    }
+    if (!wait) {
+        return false;
+    }
+    while (!service_stopped_) {
+        /* Clear the bit before retrying, so a pop between the retry and the wait is not missed */
+        xEventGroupClearBits(event_group_, popped_bit);
+        if (queue.Push(std::move(item))) {
+            return true;
+        }
+        xEventGroupWaitBits(event_group_, popped_bit, pdFALSE, pdFALSE, portMAX_DELAY);
+    }
+    return false;
 }
 
 bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples) {
@@ -189,21 +228,24 @@ bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, in
     }
 
     if (codec_->input_sample_rate() != sample_rate) {
-        data.resize(samples * codec_->input_sample_rate() / sample_rate * codec_->input_channels());
-        if (!codec_->InputData(data)) {
+        /* Capture into the scratch buffer at the codec rate, then resample straight into data */
+        std::lock_guard<std::mutex> lock(input_resampler_mutex_);
+        auto& capture = input_capture_buffer_;
+        capture.resize(samples * codec_->input_sample_rate() / sample_rate * codec_->input_channels());
+        if (!codec_->InputData(capture)) {
             return false;
         }
         if (input_resampler_ != nullptr) {
-            std::lock_guard<std::mutex> lock(input_resampler_mutex_);
-            uint32_t in_sample_num = data.size() / codec_->input_channels();
+            uint32_t in_sample_num = capture.size() / codec_->input_channels();
             uint32_t output_samples = 0;
             esp_ae_rate_cvt_get_max_out_sample_num(input_resampler_, in_sample_num, &output_samples);
-            auto resampled = std::vector<int16_t>(output_samples * codec_->input_channels());
+            data.resize(output_samples * codec_->input_channels());
             uint32_t actual_output = output_samples;
-            esp_ae_rate_cvt_process(input_resampler_, (esp_ae_sample_t)data.data(), in_sample_num,
-                                   (esp_ae_sample_t)resampled.data(), &actual_output);
-            resampled.resize(actual_output * codec_->input_channels());
-            data = std::move(resampled);
+            esp_ae_rate_cvt_process(input_resampler_, (esp_ae_sample_t)capture.data(), in_sample_num,
+                                   (esp_ae_sample_t)data.data(), &actual_output);
+            data.resize(actual_output * codec_->input_channels());
+        } else {
+            data.assign(capture.begin(), capture.end());
         }
     } else {
         data.resize(samples * codec_->input_channels());
@@ -213,6 +255,7 @@ bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, in
     }
 
     /* Update the last input time */
+    input_capture_time_us_ = esp_timer_get_time();
     last_input_time_ = std::chrono::steady_clock::now();
     debug_statistics_.input_count++;
 
@@ -238,40 +281,46 @@ void AudioService::AudioInputTask() {
         }
         if (audio_input_need_warmup_) {
             audio_input_need_warmup_ = false;
-            vTaskDelay(pdMS_TO_TICKS(120));
+            /* A fresh pre-roll means the input is running already, it is fed instead of waiting */
+            if (preroll_buffer_ != nullptr && preroll_buffer_->frames() > 0 &&
+                esp_timer_get_time() - preroll_buffer_->end_time_us() < PREROLL_MAX_AGE_MS * 1000) {
+                preroll_pending_ = true;
+            } else {
+                vTaskDelay(pdMS_TO_TICKS(120));
+            }
             continue;
         }
 
         /* Used for audio testing in NetworkConfiguring mode by clicking the BOOT button */
         if (bits & AS_EVENT_AUDIO_TESTING_RUNNING) {
-            if (audio_testing_queue_.size() >= AUDIO_TESTING_MAX_DURATION_MS / OPUS_FRAME_DURATION_MS) {
+            if (audio_testing_queue_.Full()) {
                 ESP_LOGW(TAG, "Audio testing queue is full, stopping audio testing");
                 EnableAudioTesting(false);
                 continue;
             }
-            std::vector<int16_t> data;
-            int samples = OPUS_FRAME_DURATION_MS * 16000 / 1000;
-            if (ReadAudioData(data, 16000, samples)) {
+            int samples = encoder_duration_ms_ * 16000 / 1000;
+            if (ReadAudioData(input_buffer_, 16000, samples)) {
                 // If input channels is 2, we need to fetch the left channel data
+                auto pcm = &input_buffer_;
                 if (codec_->input_channels() == 2) {
-                    auto mono_data = std::vector<int16_t>(data.size() / 2);
-                    for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-                        mono_data[i] = data[j];
-                    }
-                    data = std::move(mono_data);
+                    input_mono_buffer_.resize(input_buffer_.size() / 2);
+                    ExtractChannel(input_buffer_.data(), input_mono_buffer_.data(), input_mono_buffer_.size(), 2, 0);
+                    pcm = &input_mono_buffer_;
                 }
-                PushTaskToEncodeQueue(kAudioTaskTypeEncodeToTestingQueue, std::move(data));
+                PushTaskToEncodeQueue(kAudioTaskTypeEncodeToTestingQueue, *pcm, 0);
                 continue;
             }
         }
 
         /* Feed the wake word */
         if (bits & AS_EVENT_WAKE_WORD_RUNNING) {
-            std::vector<int16_t> data;
             int samples = wake_word_->GetFeedSize();
             if (samples > 0) {
-                if (ReadAudioData(data, 16000, samples)) {
-                    wake_word_->Feed(data);
+                if (ReadAudioData(input_buffer_, 16000, samples)) {
+                    if (preroll_buffer_ != nullptr) {
+                        preroll_buffer_->Write(input_buffer_, input_capture_time_us_);
+                    }
+                    wake_word_->Feed(input_buffer_);
                     continue;
                 }
             }
@@ -279,11 +328,17 @@ void AudioService::AudioInputTask() {
 
         /* Feed the audio processor */
         if (bits & AS_EVENT_AUDIO_PROCESSOR_RUNNING) {
-            std::vector<int16_t> data;
             int samples = audio_processor_->GetFeedSize();
             if (samples > 0) {
-                if (ReadAudioData(data, 16000, samples)) {
-                    audio_processor_->Feed(std::move(data));
+                if (preroll_pending_) {
+                    preroll_pending_ = false;
+                    FeedPreroll();
+                }
+                if (ReadAudioData(input_buffer_, 16000, samples)) {
+                    /* Every live sample fed so far was captured by now, the pre-roll before them has its own origin */
+                    processor_input_samples_ += input_buffer_.size() / codec_->input_channels();
+                    processor_time_origin_us_ = esp_timer_get_time() - (int64_t)(processor_input_samples_ * 1000 / 16);
+                    audio_processor_->Feed(input_buffer_);
                     continue;
                 }
             }
@@ -296,149 +351,404 @@ void AudioService::AudioInputTask() {
     ESP_LOGW(TAG, "Audio input task stopped");
 }
 
+void AudioService::FeedPreroll() {
+    /* Not the wake word, nor the echo of the last playback, and only if the live input follows it closely */
+    int64_t end_time = preroll_buffer_->end_time_us();
+    int64_t now = esp_timer_get_time();
+    if (now - end_time > PREROLL_MAX_AGE_MS * 1000) {
+        return;
+    }
+    auto output_elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - last_output_time_.load()).count();
+    int64_t start_time = std::max<int64_t>({end_time - CONFIG_AUDIO_PREROLL_MS * 1000LL, wake_word_detected_time_us_.load(),
+        now - output_elapsed + PREROLL_ECHO_TAIL_MS * 1000});
+
+    /* Whole processor feeds, the oldest samples are dropped. Both counts are 16 kHz samples per channel */
+    size_t feed_samples = audio_processor_->GetFeedSize();
+    size_t preroll_samples = end_time > start_time ? (end_time - start_time) * 16 / 1000 : 0;
+    preroll_samples = std::min(preroll_samples, preroll_buffer_->frames()) / feed_samples * feed_samples;
+    if (preroll_samples == 0) {
+        return;
+    }
+    preroll_buffer_->CopyTail(preroll_feed_buffer_, preroll_samples);
+
+    /* The last pre-roll sample was captured at end_time, not now: the live input starts after a gap */
+    processor_input_samples_ += preroll_samples;
+    processor_preroll_origin_us_ = end_time - (int64_t)(processor_input_samples_ * 1000 / 16);
+    processor_preroll_end_samples_ = processor_input_samples_;
+    int channels = codec_->input_channels();
+    for (size_t offset = 0; offset < preroll_samples; offset += feed_samples) {
+        input_buffer_.assign(preroll_feed_buffer_.begin() + offset * channels,
+            preroll_feed_buffer_.begin() + (offset + feed_samples) * channels);
+        audio_processor_->Feed(input_buffer_);
+    }
+    ESP_LOGD(TAG, "Fed %u ms of pre-roll", preroll_samples / 16);
+}
+
 void AudioService::AudioOutputTask() {
+    SpscRingBuffer<std::unique_ptr<AudioTask>>* queues[kPlaybackStreamCount] = { &audio_playback_queue_, &audio_cue_queue_ };
+    /* The task being mixed in every stream, and the next sample to mix */
+    std::unique_ptr<AudioTask> tasks[kPlaybackStreamCount];
+    size_t offsets[kPlaybackStreamCount] = {};
+    auto release_task = [this](std::unique_ptr<AudioTask>&& task) { audio_task_pool_.Release(std::move(task)); };
     while (true) {
-        std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() { return !audio_playback_queue_.empty() || service_stopped_; });
         if (service_stopped_) {
             break;
         }
 
-        auto task = std::move(audio_playback_queue_.front());
-        audio_playback_queue_.pop_front();
-        audio_queue_cv_.notify_all();
-        lock.unlock();
+        /* Release the tasks discarded by ResetDecoder() */
+        bool popped = false;
+        uint32_t active_streams = 0;
+        for (int i = 0; i < kPlaybackStreamCount; i++) {
+            popped |= queues[i]->DropDiscarded(release_task) > 0;
+            if (tasks[i] != nullptr || !queues[i]->Empty()) {
+                active_streams |= 1u << i;
+            }
+        }
+        if (active_streams == 0) {
+            if (playback_active_.exchange(false) || popped) {
+                /* Wake up the decoder task and WaitForPlaybackQueueEmpty() */
+                NotifyTask(opus_decode_task_handle_);
+                xEventGroupSetBits(event_group_, AS_EVENT_PLAYBACK_QUEUE_POPPED);
+            }
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        playback_active_ = true;
+
+        /* Mix one DMA period, a stream that runs dry is silent for the rest of it */
+        playback_mixer_.Begin(active_streams);
+        for (int i = 0; i < kPlaybackStreamCount; i++) {
+            if (active_streams & (1u << i)) {
+                popped |= MixPlaybackStream((PlaybackStream)i, *queues[i], tasks[i], offsets[i]);
+            }
+        }
+        if (popped) {
+            /* Wake up the decoder task which may be waiting for room in the queues */
+            NotifyTask(opus_decode_task_handle_);
+            xEventGroupSetBits(event_group_, AS_EVENT_PLAYBACK_QUEUE_POPPED);
+        }
 
         if (!codec_->output_enabled()) {
             esp_timer_stop(audio_power_timer_);
             esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
             codec_->EnableOutput(true);
         }
-        codec_->OutputData(task->pcm);
+        codec_->OutputData(playback_mixer_.End());
 
         /* Update the last output time */
         last_output_time_ = std::chrono::steady_clock::now();
-        debug_statistics_.playback_count++;
+    }
+
+    for (auto& task : tasks) {
+        audio_task_pool_.Release(std::move(task));
+    }
+    ESP_LOGW(TAG, "Audio output task stopped");
+}
 
+bool AudioService::MixPlaybackStream(PlaybackStream stream, SpscRingBuffer<std::unique_ptr<AudioTask>>& queue,
+        std::unique_ptr<AudioTask>& task, size_t& offset) {
+    bool popped = false;
+    size_t period = playback_mixer_.period_samples();
+    size_t mixed = 0;
+    while (mixed < period) {
+        if (task == nullptr) {
+            if (!queue.Pop(task)) {
+                break;
+            }
+            popped = true;
+            offset = 0;
+            latency_tracer_.Record(kLatencyDownlinkPlayed, task->trace_time_us, esp_timer_get_time());
+            debug_statistics_.playback_count++;
 #if CONFIG_USE_SERVER_AEC
-        /* Record the timestamp for server AEC */
-        if (task->timestamp > 0) {
-            lock.lock();
-            timestamp_queue_.push_back(task->timestamp);
-        }
+            /* Record the timestamp for server AEC */
+            if (task->timestamp > 0) {
+                std::lock_guard<std::mutex> lock(timestamp_mutex_);
+                timestamp_queue_.push_back(task->timestamp);
+            }
 #endif
+        }
+
+        size_t samples = std::min(period - mixed, task->pcm.size() - offset);
+        playback_mixer_.Mix(stream, task->pcm.data() + offset, mixed, samples);
+        mixed += samples;
+        offset += samples;
+        if (offset >= task->pcm.size()) {
+            audio_task_pool_.Release(std::move(task));
+        }
     }
+    return popped;
+}
 
-    ESP_LOGW(TAG, "Audio output task stopped");
+void AudioService::FinishSounds(int count) {
+    if (count > 0) {
+        pending_sounds_ -= count;
+        xEventGroupSetBits(event_group_, AS_EVENT_SOUND_FINISHED);
+    }
 }
 
-void AudioService::OpusCodecTask() {
+void AudioService::OpusDecodeTask() {
+    auto release_packet = [this](std::unique_ptr<AudioStreamPacket>&& packet) { audio_packet_pool_.Release(std::move(packet)); };
+    /* The sound being played, whether it went to the decoder, and the generation it was started in */
+    std::shared_ptr<OggPlayer> sound;
+    bool sound_decoding = false;
+    uint32_t sound_generation = 0;
     while (true) {
-        std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() {
-            return service_stopped_ ||
-                (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) ||
-                (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE);
-        });
         if (service_stopped_) {
             break;
         }
 
-        /* Decode the audio from decode queue */
-        if (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE) {
-            auto packet = std::move(audio_decode_queue_.front());
-            audio_decode_queue_.pop_front();
-            audio_queue_cv_.notify_all();
-            lock.unlock();
-
-            auto task = std::make_unique<AudioTask>();
-            task->type = kAudioTaskTypeDecodeToPlaybackQueue;
-            task->timestamp = packet->timestamp;
-
-            SetDecodeSampleRate(packet->sample_rate, packet->frame_duration);
-            if (opus_decoder_ != nullptr) {
-                task->pcm.resize(decoder_frame_size_);
-                esp_audio_dec_in_raw_t raw = {
-                    .buffer = (uint8_t *)(packet->payload.data()),
-                    .len = (uint32_t)(packet->payload.size()),
-                    .consumed = 0,
-                    .frame_recover = ESP_AUDIO_DEC_RECOVERY_NONE,
-                };
-                esp_audio_dec_out_frame_t out_frame = {
-                    .buffer = (uint8_t *)(task->pcm.data()),
-                    .len = (uint32_t)(task->pcm.size() * sizeof(int16_t)),
-                    .decoded_size = 0,
-                };
-                esp_audio_dec_info_t dec_info = {};
-                std::unique_lock<std::mutex> decoder_lock(decoder_mutex_);
-                auto ret = esp_opus_dec_decode(opus_decoder_, &raw, &out_frame, &dec_info);
-                decoder_lock.unlock();
-                if (ret == ESP_AUDIO_ERR_OK) {
-                    task->pcm.resize(out_frame.decoded_size / sizeof(int16_t));
-                    if (decoder_sample_rate_ != codec_->output_sample_rate() && output_resampler_ != nullptr) {
-                        uint32_t target_size = 0;
-                        esp_ae_rate_cvt_get_max_out_sample_num(output_resampler_, task->pcm.size(), &target_size);
-                        std::vector<int16_t> resampled(target_size);
-                        uint32_t actual_output = target_size;
-                        esp_ae_rate_cvt_process(output_resampler_, (esp_ae_sample_t)task->pcm.data(), task->pcm.size(),
-                                                (esp_ae_sample_t)resampled.data(), &actual_output);
-                        resampled.resize(actual_output);
-                        task->pcm = std::move(resampled);
-                    }
-                    lock.lock();
-                    audio_playback_queue_.push_back(std::move(task));
-                    audio_queue_cv_.notify_all();
-                    debug_statistics_.decode_count++;
-                } else {
-                    ESP_LOGE(TAG, "Failed to decode audio after resize, error code: %d", ret);
-                    lock.lock();
+        /* Release the packets discarded by ResetDecoder(), and the sounds discarded by Stop() */
+        bool popped = audio_decode_queue_.DropDiscarded(release_packet) + audio_testing_queue_.DropDiscarded(release_packet) > 0;
+        if (jitter_buffer_reset_.exchange(false)) {
+            jitter_buffer_.Reset(release_packet);
+            popped = true;
+        }
+        int stopped_sounds = sound_queue_.DropDiscarded();
+        if (sound_decoding && sound_generation != sound_generation_) {
+            sound.reset();
+            sound_decoding = false;
+            stopped_sounds++;
+        }
+        FinishSounds(stopped_sounds);
+
+        /* Move the received packets into the jitter buffer, the rest stays queued to keep the backpressure */
+        int64_t now = esp_timer_get_time();
+        std::unique_ptr<AudioStreamPacket> packet;
+        while (!jitter_buffer_.full() && (audio_decode_queue_.Pop(packet) ||
+                (audio_testing_playback_ && audio_testing_queue_.Pop(packet)))) {
+            popped = true;
+            if (!jitter_buffer_.Push(std::move(packet), now)) {
+                audio_packet_pool_.Release(std::move(packet));
+            }
+        }
+
+        /*
+         * A cached sound goes to the cue queue at once, mixed over the decoded stream. The others need the
+         * decoder: they start once the decoded stream is drained, and then play to the end
+         */
+        if (sound == nullptr) {
+            sound_queue_.Pop(sound);
+        }
+        if (sound != nullptr && !sound->cached() && !sound_decoding && jitter_buffer_.empty() && audio_decode_queue_.Empty()) {
+            sound_decoding = true;
+            /* Read once decoding, so a ResetDecoder() that came before does not stop the sound */
+            sound_generation = sound_generation_;
+        }
+
+        /* Play a sound frame, and decode, conceal or wait, as decided by the jitter buffer */
+        int wait_ms = -1;
+        auto action = JitterBuffer::kJitterWait;
+        bool sound_played = false;
+        if (sound != nullptr && (sound_decoding ? !audio_playback_queue_.Full() : sound->cached() && !audio_cue_queue_.Full())) {
+            sound_played = true;
+            if (!PlaySoundFrame(*sound)) {
+                /* Queue a streamed clip for the sound bank, a cancelled one may never be played again */
+                if (!sound->cached() && !sound->cancelled()) {
+                    sound_bank_->Request(sound->clip());
                 }
-            } else {
-                ESP_LOGE(TAG, "Audio decoder is not configured");
-                lock.lock();
+                sound.reset();
+                sound_decoding = false;
+                FinishSounds(1);
             }
-            debug_statistics_.decode_count++;
         }
+        if (!sound_decoding && !audio_playback_queue_.Full()) {
+            action = jitter_buffer_.Next(now, wait_ms);
+        }
+        switch (action) {
+        case JitterBuffer::kJitterDecode:
+            packet = jitter_buffer_.Pop();
+            DecodePacket(*packet, ESP_AUDIO_DEC_RECOVERY_NONE);
+            audio_packet_pool_.Release(std::move(packet));
+            popped = true;
+            break;
+        case JitterBuffer::kJitterConceal:
+            DecodePacket(*jitter_buffer_.Peek(), ESP_AUDIO_DEC_RECOVERY_PLC);
+            break;
+        case JitterBuffer::kJitterRecover:
+            DecodePacket(*jitter_buffer_.Peek(), ESP_AUDIO_DEC_RECOVERY_FEC);
+            break;
+        default:
+            break;
+        }
+
+        jitter_buffer_size_ = jitter_buffer_.size();
+        if (popped) {
+            xEventGroupSetBits(event_group_, AS_EVENT_DECODE_QUEUE_POPPED);
+        }
+        if (action == JitterBuffer::kJitterWait && !sound_played) {
+            /* Nothing to play: fill the sound bank one frame per tick, any new packet or sound wakes the task */
+            bool filling = wait_ms < 0 && sound == nullptr && jitter_buffer_.empty() && audio_decode_queue_.Empty() &&
+                sound_bank_->Fill();
+            ulTaskNotifyTake(pdTRUE, filling ? 1 : wait_ms < 0 ? portMAX_DELAY : std::max<TickType_t>(pdMS_TO_TICKS(wait_ms), 1));
+        }
+    }
+
+    /* The sound being played is dropped, the queued ones are released by the next DropDiscarded() */
+    FinishSounds(sound != nullptr ? 1 : 0);
+    ESP_LOGW(TAG, "Opus decode task stopped");
+}
+
+bool AudioService::PlaySoundFrame(OggPlayer& sound) {
+    /* A cached frame goes straight to the cue queue */
+    if (sound.cached()) {
+        auto task = audio_task_pool_.Acquire();
+        if (!sound.ReadPcm(task->pcm)) {
+            audio_task_pool_.Release(std::move(task));
+            return false;
+        }
+        task->type = kAudioTaskTypeDecodeToPlaybackQueue;
+        task->timestamp = 0;
+        task->trace_time_us = 0;
+        audio_cue_queue_.Push(std::move(task));
+        NotifyTask(audio_output_task_handle_);
+        return true;
+    }
+
+    auto packet = audio_packet_pool_.Acquire();
+    bool read = sound.ReadPacket(*packet);
+    if (read) {
+        DecodePacket(*packet, ESP_AUDIO_DEC_RECOVERY_NONE);
+    }
+    audio_packet_pool_.Release(std::move(packet));
+    return read;
+}
+
+void AudioService::DecodePacket(const AudioStreamPacket& packet, esp_audio_dec_recovery_t recover) {
+#if CONFIG_AUDIO_CODEC_TIMING_TRACE
+    int64_t start_time = esp_timer_get_time();
+#endif
+    SetDecodeSampleRate(packet.sample_rate, packet.frame_duration);
+    if (opus_decoder_ == nullptr) {
+        ESP_LOGE(TAG, "Audio decoder is not configured");
+        return;
+    }
+
+    auto task = audio_task_pool_.Acquire();
+    task->type = kAudioTaskTypeDecodeToPlaybackQueue;
+    /* A concealed frame was never played by the server, so it has no timestamp for server AEC */
+    task->timestamp = recover == ESP_AUDIO_DEC_RECOVERY_NONE ? packet.timestamp : 0;
+    task->trace_time_us = recover == ESP_AUDIO_DEC_RECOVERY_NONE ? packet.trace_time_us : 0;
+
+    /* Decode straight into the task unless the output needs resampling */
+    bool resample = decoder_sample_rate_ != codec_->output_sample_rate() && output_resampler_ != nullptr;
+    auto& pcm = resample ? decode_output_buffer_ : task->pcm;
+    pcm.resize(decoder_frame_size_);
+    esp_audio_dec_in_raw_t raw = {
+        .buffer = (uint8_t *)(packet.payload()),
+        .len = (uint32_t)(packet.payload_size()),
+        .consumed = 0,
+        .frame_recover = recover,
+    };
+    esp_audio_dec_out_frame_t out_frame = {
+        .buffer = (uint8_t *)(pcm.data()),
+        .len = (uint32_t)(pcm.size() * sizeof(int16_t)),
+        .decoded_size = 0,
+    };
+    esp_audio_dec_info_t dec_info = {};
+    std::unique_lock<std::mutex> decoder_lock(decoder_mutex_);
+    auto ret = esp_opus_dec_decode(opus_decoder_, &raw, &out_frame, &dec_info);
+    decoder_lock.unlock();
+    if (ret != ESP_AUDIO_ERR_OK) {
+        ESP_LOGE(TAG, "Failed to decode audio (recover %d), error code: %d", recover, ret);
+        audio_task_pool_.Release(std::move(task));
+        return;
+    }
+
+    pcm.resize(out_frame.decoded_size / sizeof(int16_t));
+    if (resample) {
+        uint32_t target_size = 0;
+        esp_ae_rate_cvt_get_max_out_sample_num(output_resampler_, pcm.size(), &target_size);
+        task->pcm.resize(target_size);
+        uint32_t actual_output = target_size;
+        esp_ae_rate_cvt_process(output_resampler_, (esp_ae_sample_t)pcm.data(), pcm.size(),
+                                (esp_ae_sample_t)task->pcm.data(), &actual_output);
+        task->pcm.resize(actual_output);
+    }
+    latency_tracer_.Record(kLatencyDownlinkDecoded, task->trace_time_us, esp_timer_get_time());
+    audio_playback_queue_.Push(std::move(task));
+    NotifyTask(audio_output_task_handle_);
+    debug_statistics_.decode_count++;
+#if CONFIG_AUDIO_CODEC_TIMING_TRACE
+    ESP_LOGI(TAG, "decode #%lu: %d -> %d Hz, core %d, start %lld us, took %lld us", debug_statistics_.decode_count,
+        decoder_sample_rate_, codec_->output_sample_rate(), xPortGetCoreID(), start_time, esp_timer_get_time() - start_time);
+#endif
+}
+
+void AudioService::OpusEncodeTask() {
+    while (true) {
+        if (service_stopped_) {
+            break;
+        }
+
+        /* Release the tasks discarded by Stop() */
+        auto release_task = [this](std::unique_ptr<AudioTask>&& task) { audio_task_pool_.Release(std::move(task)); };
+        if (audio_encode_queue_.DropDiscarded(release_task) > 0) {
+            xEventGroupSetBits(event_group_, AS_EVENT_ENCODE_QUEUE_POPPED);
+        }
+
         /* Encode the audio to send queue */
-        if (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) {
-            auto task = std::move(audio_encode_queue_.front());
-            audio_encode_queue_.pop_front();
-            audio_queue_cv_.notify_all();
-            lock.unlock();
-
-            auto packet = std::make_unique<AudioStreamPacket>();
-            packet->frame_duration = OPUS_FRAME_DURATION_MS;
+        std::unique_ptr<AudioTask> task;
+        if (!audio_send_queue_.Full() && audio_encode_queue_.Pop(task)) {
+            xEventGroupSetBits(event_group_, AS_EVENT_ENCODE_QUEUE_POPPED);
+#if CONFIG_AUDIO_CODEC_TIMING_TRACE
+            int64_t start_time = esp_timer_get_time();
+#endif
+
+            auto packet = audio_packet_pool_.Acquire();
             packet->sample_rate = 16000;
             packet->timestamp = task->timestamp;
+            packet->lost_frames = 0;
+            packet->trace_time_us = task->trace_time_us;
 
+            std::unique_lock<std::mutex> encoder_lock(encoder_mutex_);
+#if CONFIG_AUDIO_ADAPTIVE_BITRATE
+            ApplyEncoderSettings();
+#endif
+            packet->frame_duration = encoder_duration_ms_;
             if (opus_encoder_ != nullptr && task->pcm.size() == encoder_frame_size_) {
-                std::vector<uint8_t> buf(encoder_outbuf_size_);
+                /* Encode straight behind the packet headroom */
+                packet->ResizePayload(encoder_outbuf_size_);
                 esp_audio_enc_in_frame_t in = {
                     .buffer = (uint8_t *)(task->pcm.data()),
                     .len = (uint32_t)(encoder_frame_size_ * sizeof(int16_t)),
                 };
                 esp_audio_enc_out_frame_t out = {
-                    .buffer = buf.data(),
-                    .len = (uint32_t)encoder_outbuf_size_,
+                    .buffer = packet->payload(),
+                    .len = (uint32_t)packet->payload_size(),
                     .encoded_bytes = 0,
                 };
+                int64_t encode_start_time = esp_timer_get_time();
                 auto ret = esp_opus_enc_process(opus_encoder_, &in, &out);
                 if (ret == ESP_AUDIO_ERR_OK) {
-                    packet->payload.assign(buf.data(), buf.data() + out.encoded_bytes);
+                    packet->ResizePayload(out.encoded_bytes);
+                    encoder_lock.unlock();
 
                     if (task->type == kAudioTaskTypeEncodeToSendQueue) {
-                        {
-                            std::lock_guard<std::mutex> lock2(audio_queue_mutex_);
-                            audio_send_queue_.push_back(std::move(packet));
-                        }
+                        int64_t now = esp_timer_get_time();
+                        int frame_duration = packet->frame_duration;
+                        latency_tracer_.Record(kLatencyUplinkEncoded, task->trace_time_us, now);
+                        audio_send_queue_.Push(std::move(packet));
                         if (callbacks_.on_send_queue_available) {
                             callbacks_.on_send_queue_available();
                         }
+#if CONFIG_AUDIO_ADAPTIVE_BITRATE
+                        bitrate_controller_.OnEncoded(now, frame_duration, now - encode_start_time,
+                            audio_send_queue_.Size() * frame_duration);
+#else
+                        (void)encode_start_time;
+                        (void)frame_duration;
+#endif
                     } else if (task->type == kAudioTaskTypeEncodeToTestingQueue) {
-                        std::lock_guard<std::mutex> lock2(audio_queue_mutex_);
-                        audio_testing_queue_.push_back(std::move(packet));
+                        if (!audio_testing_queue_.Push(std::move(packet))) {
+                            ESP_LOGW(TAG, "Audio testing queue is full, dropping packet");
+                        }
                     }
                     debug_statistics_.encode_count++;
+#if CONFIG_AUDIO_CODEC_TIMING_TRACE
+                    ESP_LOGI(TAG, "encode #%lu: core %d, start %lld us, took %lld us", debug_statistics_.encode_count,
+                        xPortGetCoreID(), start_time, esp_timer_get_time() - start_time);
+#endif
                 } else {
                     ESP_LOGE(TAG, "Failed to encode audio, error code: %d", ret);
                 }
@@ -446,94 +756,218 @@ void AudioService::OpusCodecTask() {
                 ESP_LOGE(TAG, "Failed to encode audio: encoder not configured or invalid frame size (got %u, expected %u)",
                          task->pcm.size(), encoder_frame_size_);
             }
-            lock.lock();
+            audio_packet_pool_.Release(std::move(packet));
+            audio_task_pool_.Release(std::move(task));
+        } else {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
         }
     }
 
-    ESP_LOGW(TAG, "Opus codec task stopped");
+    ESP_LOGW(TAG, "Opus encode task stopped");
+}
+
+void AudioService::ApplyEncoderSettings() {
+#if CONFIG_AUDIO_ADAPTIVE_BITRATE
+    /*
+     * Only the bitrate is changed in place. Reopening the encoder mid-stream would drop its state and
+     * glitch, so the complexity and FEC wait for ApplyFrameDuration() at the next session.
+     */
+    next_encoder_settings_ = bitrate_controller_.settings();
+    if (opus_encoder_ == nullptr || next_encoder_settings_.bitrate == encoder_settings_.bitrate) {
+        return;
+    }
+    /* Back to the automatic bitrate at the next session, the maximum until then */
+    int bitrate = next_encoder_settings_.bitrate > 0 ? next_encoder_settings_.bitrate : CONFIG_AUDIO_BITRATE_MAX;
+    if (bitrate != encoder_settings_.bitrate) {
+        esp_opus_enc_set_bitrate(opus_encoder_, bitrate);
+        encoder_settings_.bitrate = bitrate;
+    }
+#endif
+}
+
+void AudioService::LogPoolMisses() {
+    /* The pools are sized for the steady state, a miss means a queue bound or a pool size is off */
+    uint32_t task_misses = audio_task_pool_.TakeMisses();
+    uint32_t packet_misses = audio_packet_pool_.TakeMisses();
+    if (task_misses > 0 || packet_misses > 0) {
+        ESP_LOGW(TAG, "Pool misses: %lu tasks, %lu packets allocated from the heap", task_misses, packet_misses);
+    }
+}
+
+void AudioService::OnAudioSent(int audio_ms, uint32_t send_us, bool sent) {
+#if CONFIG_AUDIO_ADAPTIVE_BITRATE
+    bitrate_controller_.OnSent(audio_ms, send_us, sent);
+#endif
 }
 
 void AudioService::SetDecodeSampleRate(int sample_rate, int frame_duration) {
+    /* Opus decodes a stream at any of its rates, only a codec at another rate needs the resampler */
+    if (IS_OPUS_SAMPLE_RATE(codec_->output_sample_rate())) {
+        sample_rate = codec_->output_sample_rate();
+    }
     if (decoder_sample_rate_ == sample_rate && decoder_duration_ms_ == frame_duration) {
         return;
     }
+    /* Switch to the cached decoder of the stream, the current one stays open for the next switch back */
     std::unique_lock<std::mutex> decoder_lock(decoder_mutex_);
-    if (opus_decoder_ != nullptr) {
-        esp_opus_dec_close(opus_decoder_);
+    auto entry = decoder_cache_->Get(sample_rate, frame_duration);
+    if (entry == nullptr) {
+        /* Never decode the stream with the decoder of another one, its packets are dropped until a retry succeeds */
+        ESP_LOGE(TAG, "No decoder for %d Hz, %d ms frames", sample_rate, frame_duration);
         opus_decoder_ = nullptr;
-    }
-    decoder_lock.unlock();
-    esp_opus_dec_cfg_t opus_dec_cfg = OPUS_DEC_CFG(sample_rate, frame_duration);
-    auto ret = esp_opus_dec_open(&opus_dec_cfg, sizeof(esp_opus_dec_cfg_t), &opus_decoder_);
-    if (opus_decoder_ == nullptr) {
-        ESP_LOGE(TAG, "Failed to create audio decoder, error code: %d", ret);
+        output_resampler_ = nullptr;
+        decoder_sample_rate_ = 0;
         return;
     }
+    opus_decoder_ = entry->decoder;
+    output_resampler_ = entry->resampler;
     decoder_sample_rate_ = sample_rate;
     decoder_duration_ms_ = frame_duration;
     decoder_frame_size_ = decoder_sample_rate_ / 1000 * frame_duration;
+    decoder_lock.unlock();
+    if (frame_duration > 0) {
+        audio_decode_queue_.SetLimit(AUDIO_QUEUE_MAX_DURATION_MS / frame_duration);
+    }
+}
 
-    auto codec = Board::GetInstance().GetAudioCodec();
-    if (decoder_sample_rate_ != codec->output_sample_rate()) {
-        ESP_LOGI(TAG, "Resampling audio from %d to %d", decoder_sample_rate_, codec->output_sample_rate());
-        if (output_resampler_ != nullptr) {
-            esp_ae_rate_cvt_close(output_resampler_);
-            output_resampler_ = nullptr;
-        }
-        esp_ae_rate_cvt_cfg_t output_resampler_cfg = RATE_CVT_CFG(
-            decoder_sample_rate_, codec->output_sample_rate(), ESP_AUDIO_MONO);
-        auto resampler_ret = esp_ae_rate_cvt_open(&output_resampler_cfg, &output_resampler_);
-        if (output_resampler_ == nullptr) {
-            ESP_LOGE(TAG, "Failed to create output resampler, error code: %d", resampler_ret);
+std::vector<int> AudioService::GetOutputSampleRates() const {
+    /* A higher rate than the codec's only costs bandwidth, a lower one also loses quality */
+    int output_rate = codec_->output_sample_rate();
+    std::vector<int> rates = { 8000, 12000, 16000, 24000, 48000 };
+    std::stable_sort(rates.begin(), rates.end(), [output_rate](int a, int b) {
+        if ((a >= output_rate) != (b >= output_rate)) {
+            return a >= output_rate;
         }
+        return a >= output_rate ? a < b : a > b;
+    });
+    return rates;
+}
+
+bool AudioService::SetFrameDuration(int frame_duration_ms) {
+    if (!IS_VALID_FRAME_DURATION(frame_duration_ms)) {
+        ESP_LOGE(TAG, "Unsupported frame duration: %d ms", frame_duration_ms);
+        return false;
     }
+    frame_duration_ms_ = frame_duration_ms;
+    Settings settings("audio", true);
+    settings.SetInt("frame_duration", frame_duration_ms);
+    return true;
 }
 
-void AudioService::PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm) {
-    auto task = std::make_unique<AudioTask>();
+void AudioService::ApplyFrameDuration() {
+    int frame_duration = frame_duration_ms_;
+    std::unique_lock<std::mutex> encoder_lock(encoder_mutex_);
+    bool reopen = opus_encoder_ == nullptr || encoder_duration_ms_ != frame_duration;
+#if CONFIG_AUDIO_ADAPTIVE_BITRATE
+    /* Between sessions the encoder is also reopened for the settings it can not change in place */
+    reopen = reopen || next_encoder_settings_ != encoder_settings_;
+#endif
+    if (!reopen) {
+        return;
+    }
+
+    if (opus_encoder_ != nullptr) {
+        esp_opus_enc_close(opus_encoder_);
+        opus_encoder_ = nullptr;
+    }
+    esp_opus_enc_config_t opus_enc_cfg = AS_OPUS_ENC_CONFIG();
+    opus_enc_cfg.frame_duration = (esp_opus_enc_frame_duration_t)AS_OPUS_GET_FRAME_DRU_ENUM(frame_duration);
+#if CONFIG_AUDIO_ADAPTIVE_BITRATE
+    encoder_settings_ = next_encoder_settings_;
+    if (encoder_settings_.bitrate > 0) {
+        opus_enc_cfg.bitrate = encoder_settings_.bitrate;
+    }
+    opus_enc_cfg.complexity = encoder_settings_.complexity;
+    opus_enc_cfg.enable_fec = encoder_settings_.fec;
+#endif
+    auto ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &opus_encoder_);
+    if (opus_encoder_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", ret);
+        return;
+    }
+    encoder_sample_rate_ = 16000;
+    encoder_duration_ms_ = frame_duration;
+    esp_opus_enc_get_frame_size(opus_encoder_, &encoder_frame_size_, &encoder_outbuf_size_);
+    encoder_frame_size_ = encoder_frame_size_ / sizeof(int16_t);
+    encoder_lock.unlock();
+
+    /* Keep the uplink queues bounded in milliseconds rather than in packets */
+    audio_send_queue_.SetLimit(AUDIO_QUEUE_MAX_DURATION_MS / frame_duration);
+    audio_testing_queue_.SetLimit(AUDIO_TESTING_MAX_DURATION_MS / frame_duration);
+    audio_packet_pool_.SetCapacity(AUDIO_PACKET_POOL_SIZE(frame_duration));
+    audio_packet_pool_.Fill([frame_duration](AudioStreamPacket& packet) {
+        packet.ReservePayload(AUDIO_PACKET_PAYLOAD_RESERVE * frame_duration / OPUS_FRAME_DURATION_MS);
+    });
+
+    if (audio_processor_initialized_) {
+        audio_processor_->SetFrameDuration(frame_duration);
+    }
+    ESP_LOGI(TAG, "Opus frame duration: %d ms", frame_duration);
+}
+
+void AudioService::PushTaskToEncodeQueue(AudioTaskType type, const std::vector<int16_t>& pcm, int64_t capture_time_us) {
+    auto task = audio_task_pool_.Acquire();
     task->type = type;
-    task->pcm = std::move(pcm);
-    /* Push the task to the encode queue */
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
+    task->timestamp = 0;
+    task->trace_time_us = 0;
+    task->pcm.assign(pcm.begin(), pcm.end());
 
     /* If the task is to send queue, we need to set the timestamp */
-    if (type == kAudioTaskTypeEncodeToSendQueue && !timestamp_queue_.empty()) {
-        if (timestamp_queue_.size() <= MAX_TIMESTAMPS_IN_QUEUE) {
-            task->timestamp = timestamp_queue_.front();
-        } else {
-            ESP_LOGW(TAG, "Timestamp queue (%u) is full, dropping timestamp", timestamp_queue_.size());
+    if (type == kAudioTaskTypeEncodeToSendQueue) {
+        task->trace_time_us = capture_time_us;
+        latency_tracer_.Record(kLatencyUplinkProcessed, capture_time_us, esp_timer_get_time());
+        std::lock_guard<std::mutex> lock(timestamp_mutex_);
+        if (!timestamp_queue_.empty()) {
+            if (timestamp_queue_.size() <= MAX_TIMESTAMPS_IN_QUEUE) {
+                task->timestamp = timestamp_queue_.front();
+            } else {
+                ESP_LOGW(TAG, "Timestamp queue (%u) is full, dropping timestamp", timestamp_queue_.size());
+            }
+            timestamp_queue_.pop_front();
         }
-        timestamp_queue_.pop_front();
     }
 
-    audio_queue_cv_.wait(lock, [this]() { return audio_encode_queue_.size() < MAX_ENCODE_TASKS_IN_QUEUE; });
-    audio_encode_queue_.push_back(std::move(task));
-    audio_queue_cv_.notify_all();
+    /* Push the task to the encode queue, there is only one producer (input task or processor task) at a time */
+    if (PushToQueue(audio_encode_queue_, std::move(task), AS_EVENT_ENCODE_QUEUE_POPPED, true)) {
+        NotifyTask(opus_encode_task_handle_);
+    } else {
+        audio_task_pool_.Release(std::move(task));
+    }
 }
 
 bool AudioService::PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait) {
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-    if (audio_decode_queue_.size() >= MAX_DECODE_PACKETS_IN_QUEUE) {
-        if (wait) {
-            audio_queue_cv_.wait(lock, [this]() { return audio_decode_queue_.size() < MAX_DECODE_PACKETS_IN_QUEUE; });
-        } else {
-            return false;
-        }
+    std::lock_guard<std::mutex> lock(decode_producer_mutex_);
+    if (!PushToQueue(audio_decode_queue_, std::move(packet), AS_EVENT_DECODE_QUEUE_POPPED, wait)) {
+        audio_packet_pool_.Release(std::move(packet));
+        return false;
     }
-    audio_decode_queue_.push_back(std::move(packet));
-    audio_queue_cv_.notify_all();
+    NotifyTask(opus_decode_task_handle_);
     return true;
 }
 
-std::unique_ptr<AudioStreamPacket> AudioService::PopPacketFromSendQueue() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    if (audio_send_queue_.empty()) {
-        return nullptr;
+bool AudioService::PopPacketsFromSendQueue(std::vector<std::unique_ptr<AudioStreamPacket>>& packets, int duration_ms, bool flush) {
+    if (!flush && (int)audio_send_queue_.Size() * encoder_duration_ms_ < duration_ms) {
+        return false;
+    }
+    int popped_ms = 0;
+    std::unique_ptr<AudioStreamPacket> packet;
+    while ((packets.empty() || popped_ms < duration_ms) && audio_send_queue_.Pop(packet)) {
+        popped_ms += packet->frame_duration;
+        packets.push_back(std::move(packet));
+    }
+    if (packets.empty()) {
+        return false;
     }
-    auto packet = std::move(audio_send_queue_.front());
-    audio_send_queue_.pop_front();
-    audio_queue_cv_.notify_all();
-    return packet;
+    NotifyTask(opus_encode_task_handle_);
+    return true;
+}
+
+std::unique_ptr<AudioStreamPacket> AudioService::AcquirePacket() {
+    return audio_packet_pool_.Acquire();
+}
+
+void AudioService::ReleasePacket(std::unique_ptr<AudioStreamPacket> packet) {
+    audio_packet_pool_.Release(std::move(packet));
 }
 
 void AudioService::EncodeWakeWord() {
@@ -547,10 +981,19 @@ const std::string& AudioService::GetLastWakeWord() const {
 }
 
 std::unique_ptr<AudioStreamPacket> AudioService::PopWakeWordPacket() {
-    auto packet = std::make_unique<AudioStreamPacket>();
-    if (wake_word_->GetWakeWordOpus(packet->payload)) {
+    auto packet = audio_packet_pool_.Acquire();
+    packet->sample_rate = 16000;
+    packet->frame_duration = OPUS_FRAME_DURATION_MS;
+    packet->timestamp = 0;
+    packet->lost_frames = 0;
+    packet->trace_time_us = 0;
+    /* The wake word keeps its own frames, copy the (rare) frame behind the headroom */
+    std::vector<uint8_t> opus;
+    if (wake_word_->GetWakeWordOpus(opus)) {
+        packet->AssignPayload(opus.data(), opus.size());
         return packet;
     }
+    audio_packet_pool_.Release(std::move(packet));
     return nullptr;
 }
 
@@ -587,14 +1030,19 @@ void AudioService::EnableWakeWordDetection(bool enable) {
 void AudioService::EnableVoiceProcessing(bool enable) {
     ESP_LOGD(TAG, "%s voice processing", enable ? "Enabling" : "Disabling");
     if (enable) {
+        /* Apply the frame duration advertised in the hello message, the processor is stopped here */
+        ApplyFrameDuration();
         if (!audio_processor_initialized_) {
-            audio_processor_->Initialize(codec_, OPUS_FRAME_DURATION_MS, models_list_);
+            audio_processor_->Initialize(codec_, encoder_duration_ms_, models_list_);
             audio_processor_initialized_ = true;
         }
 
         /* We should make sure no audio is playing */
         ResetDecoder();
         audio_input_need_warmup_ = true;
+        processor_input_samples_ = 0;
+        processor_output_samples_ = 0;
+        processor_preroll_end_samples_ = 0;
         // Reset input resampler to clear cached data from previous mode (e.g. WakeWord)
         // This prevents buffer overflow when switching between different feed sizes
         {
@@ -608,26 +1056,30 @@ void AudioService::EnableVoiceProcessing(bool enable) {
     } else {
         audio_processor_->Stop();
         xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_PROCESSOR_RUNNING);
+        /* Let the sender flush a partial multi-frame batch, no more frames are coming */
+        if (!audio_send_queue_.Empty() && callbacks_.on_send_queue_available) {
+            callbacks_.on_send_queue_available();
+        }
     }
 }
 
 void AudioService::EnableAudioTesting(bool enable) {
     ESP_LOGI(TAG, "%s audio testing", enable ? "Enabling" : "Disabling");
     if (enable) {
+        audio_testing_playback_ = false;
         xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
     } else {
         xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
-        /* Copy audio_testing_queue_ to audio_decode_queue_ */
-        std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-        audio_decode_queue_ = std::move(audio_testing_queue_);
-        audio_queue_cv_.notify_all();
+        /* Let the decoder task play back audio_testing_queue_ */
+        audio_testing_playback_ = true;
+        NotifyTask(opus_decode_task_handle_);
     }
 }
 
 void AudioService::EnableDeviceAec(bool enable) {
     ESP_LOGI(TAG, "%s device AEC", enable ? "Enabling" : "Disabling");
     if (!audio_processor_initialized_) {
-        audio_processor_->Initialize(codec_, OPUS_FRAME_DURATION_MS, models_list_);
+        audio_processor_->Initialize(codec_, encoder_duration_ms_, models_list_);
         audio_processor_initialized_ = true;
     }
 
@@ -638,133 +1090,97 @@ void AudioService::SetCallbacks(AudioServiceCallbacks& callbacks) {
     callbacks_ = callbacks;
 }
 
-void AudioService::PlaySound(const std::string_view& ogg) {
+std::shared_ptr<OggPlayer> AudioService::PlaySound(const std::string_view& ogg) {
     if (!codec_->output_enabled()) {
         esp_timer_stop(audio_power_timer_);
         esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
         codec_->EnableOutput(true);
     }
 
-    const uint8_t* buf = reinterpret_cast<const uint8_t*>(ogg.data());
-    size_t size = ogg.size();
-    size_t offset = 0;
-
-    auto find_page = [&](size_t start)->size_t {
-        for (size_t i = start; i + 4 <= size; ++i) {
-            if (buf[i] == 'O' && buf[i+1] == 'g' && buf[i+2] == 'g' && buf[i+3] == 'S') return i;
-        }
-        return static_cast<size_t>(-1);
-    };
+    /*
+     * A cached clip is copied to the cue queue, the others are decoded through their packet index.
+     * Nothing is decoded here: the decoder task caches a streamed clip for its next play.
+     */
+    std::shared_ptr<OggPlayer> player;
+    if (auto sound = sound_bank_->Find(ogg)) {
+        player = std::make_shared<OggPlayer>(sound);
+    } else if (auto index = sound_bank_->GetIndex(ogg)) {
+        player = std::make_shared<OggPlayer>(ogg, index);
+    } else {
+        ESP_LOGW(TAG, "Invalid sound clip at %p", ogg.data());
+        return nullptr;
+    }
 
-    bool seen_head = false;
-    bool seen_tags = false;
-    int sample_rate = 16000; // 默认值
+    /* The decoder task feeds the clip frame by frame, so the caller never waits */
+    std::lock_guard<std::mutex> lock(sound_producer_mutex_);
+    pending_sounds_++;
+    if (!sound_queue_.Push(std::shared_ptr<OggPlayer>(player))) {
+        ESP_LOGW(TAG, "Sound queue is full, dropping sound");
+        FinishSounds(1);
+        return nullptr;
+    }
+    NotifyTask(opus_decode_task_handle_);
+    return player;
+}
 
-    while (true) {
-        size_t pos = find_page(offset);
-        if (pos == static_cast<size_t>(-1)) break;
-        offset = pos;
-        if (offset + 27 > size) break;
-
-        const uint8_t* page = buf + offset;
-        uint8_t page_segments = page[26];
-        size_t seg_table_off = offset + 27;
-        if (seg_table_off + page_segments > size) break;
-
-        size_t body_size = 0;
-        for (size_t i = 0; i < page_segments; ++i) body_size += page[27 + i];
-
-        size_t body_off = seg_table_off + page_segments;
-        if (body_off + body_size > size) break;
-
-        // Parse packets using lacing
-        size_t cur = body_off;
-        size_t seg_idx = 0;
-        while (seg_idx < page_segments) {
-            size_t pkt_len = 0;
-            size_t pkt_start = cur;
-            bool continued = false;
-            do {
-                uint8_t l = page[27 + seg_idx++];
-                pkt_len += l;
-                cur += l;
-                continued = (l == 255);
-            } while (continued && seg_idx < page_segments);
-
-            if (pkt_len == 0) continue;
-            const uint8_t* pkt_ptr = buf + pkt_start;
-
-            if (!seen_head) {
-                // 解析OpusHead包
-                if (pkt_len >= 19 && std::memcmp(pkt_ptr, "OpusHead", 8) == 0) {
-                    seen_head = true;
-                    // OpusHead结构：[0-7] "OpusHead", [8] version, [9] channel_count, [10-11] pre_skip
-                    // [12-15] input_sample_rate, [16-17] output_gain, [18] mapping_family
-                    if (pkt_len >= 12) {
-                        uint8_t version = pkt_ptr[8];
-                        uint8_t channel_count = pkt_ptr[9];
-                        if (pkt_len >= 16) {
-                            // 读取输入采样率 (little-endian)
-                            sample_rate = pkt_ptr[12] | (pkt_ptr[13] << 8) |
-                                        (pkt_ptr[14] << 16) | (pkt_ptr[15] << 24);
-                            ESP_LOGI(TAG, "OpusHead: version=%d, channels=%d, sample_rate=%d",
-                                   version, channel_count, sample_rate);
-                        }
-                    }
-                }
-                continue;
-            }
-            if (!seen_tags) {
-                // Expect OpusTags in second packet
-                if (pkt_len >= 8 && std::memcmp(pkt_ptr, "OpusTags", 8) == 0) {
-                    seen_tags = true;
-                }
-                continue;
-            }
+void AudioService::SetPlaybackGain(PlaybackStream stream, float gain) {
+    playback_mixer_.SetGain(stream, gain);
+}
 
-            // Audio packet (Opus)
-            auto packet = std::make_unique<AudioStreamPacket>();
-            packet->sample_rate = sample_rate;
-            packet->frame_duration = 60;
-            packet->payload.resize(pkt_len);
-            std::memcpy(packet->payload.data(), pkt_ptr, pkt_len);
-            PushPacketToDecodeQueue(std::move(packet), true);
-        }
+void AudioService::SetPlaybackDucking(PlaybackStream stream, float gain) {
+    playback_mixer_.SetDucking(stream, gain);
+}
 
-        offset = body_off + body_size;
-    }
+void AudioService::PreloadSound(const std::string_view& ogg) {
+    sound_bank_->Request(ogg);
+    NotifyTask(opus_decode_task_handle_);
 }
 
 bool AudioService::IsIdle() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    return audio_encode_queue_.empty() && audio_decode_queue_.empty() && audio_playback_queue_.empty() && audio_testing_queue_.empty();
+    return audio_encode_queue_.Empty() && audio_decode_queue_.Empty() && jitter_buffer_size_ == 0 &&
+        audio_playback_queue_.Empty() && audio_cue_queue_.Empty() && !playback_active_ &&
+        audio_testing_queue_.Empty() && pending_sounds_ == 0;
 }
 
 void AudioService::WaitForPlaybackQueueEmpty() {
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-    audio_queue_cv_.wait(lock, [this]() { 
-        return service_stopped_ || (audio_decode_queue_.empty() && audio_playback_queue_.empty()); 
-    });
+    const EventBits_t popped_bits = AS_EVENT_DECODE_QUEUE_POPPED | AS_EVENT_PLAYBACK_QUEUE_POPPED | AS_EVENT_SOUND_FINISHED;
+    while (true) {
+        xEventGroupClearBits(event_group_, popped_bits);
+        if (service_stopped_ || (audio_decode_queue_.Empty() && jitter_buffer_size_ == 0 && audio_playback_queue_.Empty() &&
+                audio_cue_queue_.Empty() && !playback_active_ && pending_sounds_ == 0 &&
+                (!audio_testing_playback_ || audio_testing_queue_.Empty()))) {
+            break;
+        }
+        xEventGroupWaitBits(event_group_, popped_bits, pdFALSE, pdFALSE, portMAX_DELAY);
+    }
 }
 
 void AudioService::ResetDecoder() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
     std::unique_lock<std::mutex> decoder_lock(decoder_mutex_);
     if (opus_decoder_ != nullptr) {
         esp_opus_dec_reset(opus_decoder_);
     }
     decoder_lock.unlock();
-    timestamp_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+    {
+        std::lock_guard<std::mutex> lock(timestamp_mutex_);
+        timestamp_queue_.clear();
+    }
+    audio_decode_queue_.Clear();
+    audio_playback_queue_.Clear();
+    audio_testing_queue_.Clear();
+    /* The cues keep playing, only a sound being decoded is stopped with the decoder */
+    sound_generation_++;
+    /* Set after clearing the queues, so that packets pushed right after the reset are not dropped with the jitter buffer */
+    jitter_buffer_reset_ = true;
+    /* The consumers release the discarded items and wake up the blocked producers */
+    NotifyTask(opus_decode_task_handle_);
+    NotifyTask(audio_output_task_handle_);
 }
 
 void AudioService::CheckAndUpdateAudioPowerState() {
     auto now = std::chrono::steady_clock::now();
     auto input_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_input_time_).count();
-    auto output_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_output_time_).count();
+    auto output_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_output_time_.load()).count();
     if (input_elapsed > AUDIO_POWER_TIMEOUT_MS && codec_->input_enabled()) {
         codec_->EnableInput(false);
     }
@@ -797,10 +1213,14 @@ void AudioService::SetModelsList(srmodel_list_t* models_list) {
 
     if (wake_word_) {
         wake_word_->OnWakeWordDetected([this](const std::string& wake_word) {
+            wake_word_detected_time_us_ = esp_timer_get_time();
             if (callbacks_.on_wake_word_detected) {
                 callbacks_.on_wake_word_detected(wake_word);
             }
         });
+        if (CONFIG_AUDIO_PREROLL_MS > 0 && preroll_buffer_ == nullptr) {
+            preroll_buffer_ = std::make_unique<PrerollBuffer>(CONFIG_AUDIO_PREROLL_MS * 16, codec_->input_channels());
+        }
     }
 }
 
@@ -3,9 +3,9 @@
 
 #include <memory>
 #include <deque>
-#include <condition_variable>
 #include <chrono>
 #include <mutex>
+#include <atomic>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
@@ -23,26 +23,104 @@
 #include "processors/audio_debugger.h"
 #include "wake_word.h"
 #include "protocol.h"
+#include "spsc_ring_buffer.h"
+#include "object_pool.h"
+#include "jitter_buffer.h"
+#include "latency_tracer.h"
+#include "bitrate_controller.h"
+#include "sound_bank.h"
+#include "preroll_buffer.h"
+#include "playback_mixer.h"
+#include "opus_decoder_cache.h"
+#include "ogg_player.h"
 
 
 /*
  * There are two types of audio data flow:
  * 1. (MIC) -> [Processors] -> {Encode Queue} -> [Opus Encoder] -> {Send Queue} -> (Server)
- * 2. (Server) -> {Decode Queue} -> [Opus Decoder] -> {Playback Queue} -> (Speaker)
+ * 2. (Server) -> {Decode Queue} -> [Jitter Buffer] -> [Opus Decoder] -> {Playback Queue} -> [Mixer] -> (Speaker)
  *
- * We use one task for MIC / Speaker / Processors, and one task for Opus Encoder / Opus Decoder.
+ * We use one task for MIC / Speaker / Processors, and separate tasks for the Opus Encoder and the Opus Decoder,
+ * so that a slow decode never delays the uplink and vice versa.
  * 
  * Decode Queue and Send Queue are the main queues, because Opus packets are quite smaller than PCM packets.
+ *
+ * Every queue is a lock-free SPSC ring. The consumer task of a queue is woken by a task notification
+ * from the producer, and producers that block on a full queue wait for the queue's POPPED event bit.
+ * The decode and sound queues have several producers, so they are serialized by decode_producer_mutex_
+ * and sound_producer_mutex_; the consumer never takes them.
+ *
+ * AudioTask and AudioStreamPacket objects come from fixed pools filled in Initialize(), and go back
+ * to the pools once consumed, so the PCM and payload buffers are recycled instead of reallocated.
+ *
+ * The jitter buffer belongs to the decoder task. It reorders the packets by timestamp, holds playout
+ * until the measured jitter is covered, and asks for PLC / FEC frames in place of lost packets.
+ *
+ * Sound clips are played by OggPlayer objects, queued to the decoder task in order and fed frame by frame,
+ * so PlaySound() never blocks. Clips held by the sound bank are copied to the cue queue at once, without
+ * the decoder. The other clips share the Opus decoder with the server audio, so they are decoded to the
+ * playback queue once the decoded stream is drained.
+ *
+ * The decoders are kept open per sample rate and frame duration in an OpusDecoderCache, so that switching
+ * between the server audio and a clip at another rate is a lookup instead of a decoder reopen.
+ *
+ * The output task mixes the playback queue (speech) and the cue queue into one buffer per DMA period,
+ * so a cue plays over the speech (ducking it) instead of waiting behind it, see PlaybackMixer.
+ * ResetDecoder() only stops the speech and the clip being decoded.
+ *
+ * While the wake word is detected, the input is also kept in a pre-roll buffer (CONFIG_AUDIO_PREROLL_MS).
+ * When voice processing starts, its tail after the wake word is fed to the processor before the live input,
+ * instead of waiting for the input to warm up, so that the first syllables are not lost.
+ *
+ * With CONFIG_AUDIO_ADAPTIVE_BITRATE, the encoder task retunes the uplink bitrate, complexity and FEC from
+ * the send queue length and the send results reported by the application, see BitrateController.
  * 
  */
 
+// Default uplink frame duration, 20 / 40 / 60 ms can be selected at runtime with SetFrameDuration()
 #define OPUS_FRAME_DURATION_MS 60
+#define OPUS_MIN_FRAME_DURATION_MS 20
+#define IS_VALID_FRAME_DURATION(duration_ms) ((duration_ms) == 20 || (duration_ms) == 40 || (duration_ms) == 60)
+
 #define MAX_ENCODE_TASKS_IN_QUEUE 2
 #define MAX_PLAYBACK_TASKS_IN_QUEUE 2
-#define MAX_DECODE_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
-#define MAX_SEND_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
+#define MAX_CUE_TASKS_IN_QUEUE 2
+// The decode and send queues are bounded in time, their slots are allocated for the shortest frame
+#define AUDIO_QUEUE_MAX_DURATION_MS 2400
+#define MAX_DECODE_PACKETS_IN_QUEUE (AUDIO_QUEUE_MAX_DURATION_MS / OPUS_MIN_FRAME_DURATION_MS)
+#define MAX_SEND_PACKETS_IN_QUEUE (AUDIO_QUEUE_MAX_DURATION_MS / OPUS_MIN_FRAME_DURATION_MS)
 #define AUDIO_TESTING_MAX_DURATION_MS 10000
 #define MAX_TIMESTAMPS_IN_QUEUE 3
+#define MAX_SOUNDS_IN_QUEUE 16
+// Downlink decoders kept open, e.g. the TTS stream, the uncached sound clips and a frame duration change
+#define DECODER_CACHE_SIZE 3
+// PSRAM for the decoded sound clips
+#define SOUND_BANK_CAPACITY_BYTES (512 * 1024)
+// The speech is lowered to this while a cue plays over it
+#define PLAYBACK_CUE_DUCKING_GAIN 0.5f
+
+// The jitter buffer only adds latency when late arrivals were measured
+#define JITTER_BUFFER_MAX_PACKETS 16
+#define JITTER_BUFFER_MIN_DEPTH_MS 0
+#define JITTER_BUFFER_MAX_DEPTH_MS 480
+
+// Every queued task / packet plus the ones being produced or consumed
+#define AUDIO_TASK_POOL_SIZE (MAX_ENCODE_TASKS_IN_QUEUE + MAX_PLAYBACK_TASKS_IN_QUEUE + MAX_CUE_TASKS_IN_QUEUE + 6)
+#define AUDIO_PACKET_POOL_SIZE(duration_ms) (AUDIO_QUEUE_MAX_DURATION_MS / (duration_ms) * 2 + JITTER_BUFFER_MAX_PACKETS + 4)
+#define AUDIO_PACKET_PAYLOAD_RESERVE 256
+
+// A send queue this much longer than the aggregated batch lowers the uplink bitrate
+#define BITRATE_QUEUE_HIGH_MS (CONFIG_AUDIO_FRAME_AGGREGATION_MS + 360)
+#if CONFIG_AUDIO_OPUS_ADAPTIVE_FEC
+#define BITRATE_ENABLE_FEC true
+#else
+#define BITRATE_ENABLE_FEC false
+#endif
+
+// The pre-roll starts this long after the last playback, so that it does not hold the echo of the device
+#define PREROLL_ECHO_TAIL_MS 150
+// An older pre-roll is not used (the microphone was not running just before listening started)
+#define PREROLL_MAX_AGE_MS 200
 
 #define AUDIO_POWER_TIMEOUT_MS 15000
 #define AUDIO_POWER_CHECK_INTERVAL_MS 1000
@@ -51,6 +129,13 @@
 #define AS_EVENT_WAKE_WORD_RUNNING          (1 << 1)
 #define AS_EVENT_AUDIO_PROCESSOR_RUNNING    (1 << 2)
 #define AS_EVENT_PLAYBACK_NOT_EMPTY         (1 << 3)
+#define AS_EVENT_ENCODE_QUEUE_POPPED        (1 << 4)
+#define AS_EVENT_DECODE_QUEUE_POPPED        (1 << 5)
+#define AS_EVENT_PLAYBACK_QUEUE_POPPED      (1 << 6)
+#define AS_EVENT_SOUND_FINISHED             (1 << 7)
+
+// Kconfig uses -1 for "no affinity"
+#define AS_TASK_CORE(core) ((core) < 0 || (core) >= portNUM_PROCESSORS ? tskNO_AFFINITY : (core))
 
 #define AS_OPUS_GET_FRAME_DRU_ENUM(duration_ms)                   \
     ((duration_ms) == 5 ? ESP_OPUS_ENC_FRAME_DURATION_5_MS :      \
@@ -75,6 +160,26 @@
         .enable_vbr         = true,                                                                               \
     }
 
+#define RATE_CVT_CFG(_src_rate, _dest_rate, _channel)        \
+    (esp_ae_rate_cvt_cfg_t)                                  \
+    {                                                        \
+        .src_rate        = (uint32_t)(_src_rate),            \
+        .dest_rate       = (uint32_t)(_dest_rate),           \
+        .channel         = (uint8_t)(_channel),              \
+        .bits_per_sample = ESP_AUDIO_BIT16,                  \
+        .complexity      = 2,                                \
+        .perf_type       = ESP_AE_RATE_CVT_PERF_TYPE_SPEED,  \
+    }
+
+#define OPUS_DEC_CFG(_sample_rate, _frame_duration_ms)                                                    \
+    (esp_opus_dec_cfg_t)                                                                                  \
+    {                                                                                                     \
+        .sample_rate    = (uint32_t)(_sample_rate),                                                       \
+        .channel        = ESP_AUDIO_MONO,                                                                 \
+        .frame_duration = (esp_opus_dec_frame_duration_t)AS_OPUS_GET_FRAME_DRU_ENUM(_frame_duration_ms),  \
+        .self_delimited = false,                                                                          \
+    }
+
 struct AudioServiceCallbacks {
     std::function<void(void)> on_send_queue_available;
     std::function<void(const std::string&)> on_wake_word_detected;
@@ -83,6 +188,13 @@ struct AudioServiceCallbacks {
 };
 
 
+// The streams mixed by the output task
+enum PlaybackStream {
+    kPlaybackStreamSpeech,  // Server audio, and the sound clips decoded after it
+    kPlaybackStreamCue,     // Sound clips held by the sound bank
+    kPlaybackStreamCount,
+};
+
 enum AudioTaskType {
     kAudioTaskTypeEncodeToSendQueue,
     kAudioTaskTypeEncodeToTestingQueue,
@@ -93,6 +205,8 @@ struct AudioTask {
     AudioTaskType type;
     std::vector<int16_t> pcm;
     uint32_t timestamp;
+    // When the frame was captured (uplink) or received (downlink), see LatencyTracer
+    int64_t trace_time_us;
 };
 
 struct DebugStatistics {
@@ -113,6 +227,7 @@ public:
     void EncodeWakeWord();
     std::unique_ptr<AudioStreamPacket> PopWakeWordPacket();
     const std::string& GetLastWakeWord() const;
+    int64_t wake_word_detected_time_us() const { return wake_word_detected_time_us_; }
     bool IsVoiceDetected() const { return voice_detected_; }
     bool IsIdle();
     void WaitForPlaybackQueueEmpty();
@@ -128,11 +243,30 @@ public:
     void SetCallbacks(AudioServiceCallbacks& callbacks);
 
     bool PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait = false);
-    std::unique_ptr<AudioStreamPacket> PopPacketFromSendQueue();
-    void PlaySound(const std::string_view& sound);
+    // Pops packets until they add up to duration_ms (at least one), nothing while less is queued unless flush
+    bool PopPacketsFromSendQueue(std::vector<std::unique_ptr<AudioStreamPacket>>& packets, int duration_ms, bool flush);
+    std::unique_ptr<AudioStreamPacket> AcquirePacket();
+    void ReleasePacket(std::unique_ptr<AudioStreamPacket> packet);
+    // Returns the player, which can cancel or seek the sound, or nullptr if it could not be queued
+    std::shared_ptr<OggPlayer> PlaySound(const std::string_view& sound);
+    // Queues a sound clip for the sound bank ahead of its first PlaySound(), the decoder task decodes it when idle
+    void PreloadSound(const std::string_view& sound);
     bool ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples);
+    // 0 - 1.0, the gain of a stream, and of the other streams while it plays
+    void SetPlaybackGain(PlaybackStream stream, float gain);
+    void SetPlaybackDucking(PlaybackStream stream, float gain);
     void ResetDecoder();
     void SetModelsList(srmodel_list_t* models_list);
+    // Takes effect the next time voice processing is enabled
+    bool SetFrameDuration(int frame_duration_ms);
+    // Downlink sample rates for the hello, the codec output rate first
+    std::vector<int> GetOutputSampleRates() const;
+    int frame_duration() const { return frame_duration_ms_; }
+    LatencyTracer& latency_tracer() { return latency_tracer_; }
+    // Logs the pooled tasks and packets that had to be allocated from the heap since the last call
+    void LogPoolMisses();
+    // Called by the sender task for every message handed to the transport
+    void OnAudioSent(int audio_ms, uint32_t send_us, bool sent);
 
 private:
     AudioCodec* codec_ = nullptr;
@@ -141,7 +275,10 @@ private:
     std::unique_ptr<WakeWord> wake_word_;
     std::unique_ptr<AudioDebugger> audio_debugger_;
     void* opus_encoder_ = nullptr;
+    // The decoder and output resampler of the current downlink stream, owned by decoder_cache_
+    std::unique_ptr<OpusDecoderCache> decoder_cache_;
     void* opus_decoder_ = nullptr;
+    std::mutex encoder_mutex_;
     std::mutex decoder_mutex_;
     std::mutex input_resampler_mutex_;
     esp_ae_rate_cvt_handle_t input_resampler_ = nullptr;
@@ -149,13 +286,24 @@ private:
     
     // Encoder/Decoder state
     int encoder_sample_rate_ = 16000;
-    int encoder_duration_ms_ = OPUS_FRAME_DURATION_MS;
+    // Written under encoder_mutex_, also read by the input and sender tasks
+    std::atomic<int> encoder_duration_ms_ = 0;
+    std::atomic<int> frame_duration_ms_ = OPUS_FRAME_DURATION_MS;
     int encoder_frame_size_ = 0;
     int encoder_outbuf_size_ = 0;
     int decoder_sample_rate_ = 0;
     int decoder_duration_ms_ = OPUS_FRAME_DURATION_MS;
     int decoder_frame_size_ = 0;
     DebugStatistics debug_statistics_;
+    LatencyTracer latency_tracer_;
+#if CONFIG_AUDIO_ADAPTIVE_BITRATE
+    BitrateController bitrate_controller_{CONFIG_AUDIO_BITRATE_MIN, CONFIG_AUDIO_BITRATE_MAX,
+        CONFIG_AUDIO_OPUS_COMPLEXITY_MAX, BITRATE_ENABLE_FEC, BITRATE_QUEUE_HIGH_MS};
+    // What the encoder was set up with, and the controller's settings it takes at the next session,
+    // guarded by encoder_mutex_
+    BitrateController::Settings encoder_settings_ = bitrate_controller_.settings();
+    BitrateController::Settings next_encoder_settings_ = encoder_settings_;
+#endif
     srmodel_list_t* models_list_ = nullptr;
 
     EventGroupHandle_t event_group_;
@@ -163,15 +311,62 @@ private:
     // Audio encode / decode
     TaskHandle_t audio_input_task_handle_ = nullptr;
     TaskHandle_t audio_output_task_handle_ = nullptr;
-    TaskHandle_t opus_codec_task_handle_ = nullptr;
-    std::mutex audio_queue_mutex_;
-    std::condition_variable audio_queue_cv_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_decode_queue_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_send_queue_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_testing_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_encode_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_playback_queue_;
+    TaskHandle_t opus_encode_task_handle_ = nullptr;
+    TaskHandle_t opus_decode_task_handle_ = nullptr;
+    std::mutex decode_producer_mutex_;
+    SpscRingBuffer<std::unique_ptr<AudioStreamPacket>> audio_decode_queue_{MAX_DECODE_PACKETS_IN_QUEUE};
+    SpscRingBuffer<std::unique_ptr<AudioStreamPacket>> audio_send_queue_{MAX_SEND_PACKETS_IN_QUEUE};
+    SpscRingBuffer<std::unique_ptr<AudioStreamPacket>> audio_testing_queue_{AUDIO_TESTING_MAX_DURATION_MS / OPUS_MIN_FRAME_DURATION_MS};
+    SpscRingBuffer<std::unique_ptr<AudioTask>> audio_encode_queue_{MAX_ENCODE_TASKS_IN_QUEUE};
+    SpscRingBuffer<std::unique_ptr<AudioTask>> audio_playback_queue_{MAX_PLAYBACK_TASKS_IN_QUEUE};
+    SpscRingBuffer<std::unique_ptr<AudioTask>> audio_cue_queue_{MAX_CUE_TASKS_IN_QUEUE};
+    // Owned by the output task, one DMA period at a time
+    PlaybackMixer playback_mixer_{kPlaybackStreamCount, AUDIO_CODEC_DMA_FRAME_NUM};
+    // A stream still holds a task being mixed, for IsIdle() and WaitForPlaybackQueueEmpty()
+    std::atomic<bool> playback_active_ = false;
+    ObjectPool<AudioTask> audio_task_pool_{AUDIO_TASK_POOL_SIZE};
+    ObjectPool<AudioStreamPacket> audio_packet_pool_{AUDIO_PACKET_POOL_SIZE(OPUS_FRAME_DURATION_MS)};
+    // Owned by the input task: 16 kHz with the codec channels, and its left channel
+    std::vector<int16_t> input_buffer_;
+    // When input_buffer_ was captured
+    int64_t input_capture_time_us_ = 0;
+    // Filled by the input task while the wake word runs, nullptr without a wake word
+    std::unique_ptr<PrerollBuffer> preroll_buffer_;
+    std::vector<int16_t> preroll_feed_buffer_;
+    // The pre-roll is fed before the next processor input
+    bool preroll_pending_ = false;
+    // The pre-roll never holds the wake word itself
+    std::atomic<int64_t> wake_word_detected_time_us_ = 0;
+    // The capture time of the processor output is found by counting 16 kHz samples in and out of the processor:
+    // a sample counted n was captured at processor_time_origin_us_ + n / 16 kHz
+    std::atomic<int64_t> processor_time_origin_us_ = 0;
+    // The same for the samples counted up to processor_preroll_end_samples_, fed from the pre-roll
+    std::atomic<int64_t> processor_preroll_origin_us_ = 0;
+    std::atomic<uint64_t> processor_preroll_end_samples_ = 0;
+    uint64_t processor_input_samples_ = 0;
+    uint64_t processor_output_samples_ = 0;
+    std::vector<int16_t> input_mono_buffer_;
+    // Capture at the codec rate before resampling, guarded by input_resampler_mutex_
+    std::vector<int16_t> input_capture_buffer_;
+    // Owned by the decoder task
+    std::vector<int16_t> decode_output_buffer_;
+    JitterBuffer jitter_buffer_{JITTER_BUFFER_MAX_PACKETS, JITTER_BUFFER_MIN_DEPTH_MS, JITTER_BUFFER_MAX_DEPTH_MS};
+    // Set by ResetDecoder(), the decoder task then empties the jitter buffer
+    std::atomic<bool> jitter_buffer_reset_ = false;
+    // Packets held by the jitter buffer, for IsIdle() and WaitForPlaybackQueueEmpty()
+    std::atomic<size_t> jitter_buffer_size_ = 0;
+    // Set when audio testing stops, the decoder task then plays back the testing queue
+    std::atomic<bool> audio_testing_playback_ = false;
+    // Sound clips, fed by the decoder task
+    std::unique_ptr<SoundBank> sound_bank_;
+    std::mutex sound_producer_mutex_;
+    SpscRingBuffer<std::shared_ptr<OggPlayer>> sound_queue_{MAX_SOUNDS_IN_QUEUE};
+    // Queued and playing sounds, for IsIdle() and WaitForPlaybackQueueEmpty()
+    std::atomic<int> pending_sounds_ = 0;
+    // Bumped by ResetDecoder() to stop the sound being played
+    std::atomic<uint32_t> sound_generation_ = 0;
     // For server AEC
+    std::mutex timestamp_mutex_;
     std::deque<uint32_t> timestamp_queue_;
 
     bool wake_word_initialized_ = false;
@@ -182,13 +377,28 @@ private:
 
     esp_timer_handle_t audio_power_timer_ = nullptr;
     std::chrono::steady_clock::time_point last_input_time_;
-    std::chrono::steady_clock::time_point last_output_time_;
+    // Written by the output task, read by the input task and the power timer
+    std::atomic<std::chrono::steady_clock::time_point> last_output_time_;
 
     void AudioInputTask();
+    void FeedPreroll();
     void AudioOutputTask();
-    void OpusCodecTask();
-    void PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm);
+    // Mixes a period of the stream, true if a task was popped from the queue
+    bool MixPlaybackStream(PlaybackStream stream, SpscRingBuffer<std::unique_ptr<AudioTask>>& queue,
+        std::unique_ptr<AudioTask>& task, size_t& offset);
+    void OpusEncodeTask();
+    // Takes the settings of the bitrate controller, called by the encoder task with encoder_mutex_ held
+    void ApplyEncoderSettings();
+    void OpusDecodeTask();
+    bool PlaySoundFrame(OggPlayer& sound);
+    void FinishSounds(int count);
+    void PushTaskToEncodeQueue(AudioTaskType type, const std::vector<int16_t>& pcm, int64_t capture_time_us);
+    template <typename T>
+    bool PushToQueue(SpscRingBuffer<T>& queue, T&& item, EventBits_t popped_bit, bool wait);
+    void NotifyTask(TaskHandle_t task);
     void SetDecodeSampleRate(int sample_rate, int frame_duration);
+    void DecodePacket(const AudioStreamPacket& packet, esp_audio_dec_recovery_t recover);
+    void ApplyFrameDuration();
     void CheckAndUpdateAudioPowerState();
 };
 
@@ -0,0 +1,112 @@
+#include "bitrate_controller.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "BitrateController"
+
+// Encoded audio judged at once
+#define BITRATE_WINDOW_MS 1000
+// A longer pause between frames (listening stopped) starts a new window
+#define BITRATE_FRAME_GAP_MS 500
+// Clear windows in a row before the bitrate is raised by a step
+#define BITRATE_CLEAR_WINDOWS 3
+#define BITRATE_STEP 2000
+// Windows FEC stays on after the last send failure
+#define BITRATE_FEC_WINDOWS 5
+// Time the transport took to accept the audio, in percent of its duration
+#define BITRATE_SEND_BUSY_PERCENT 50
+#define BITRATE_SEND_IDLE_PERCENT 20
+// Time the encoder took, in percent of the audio duration
+#define BITRATE_ENCODE_HIGH_PERCENT 50
+#define BITRATE_ENCODE_LOW_PERCENT 25
+
+BitrateController::BitrateController(int min_bitrate, int max_bitrate, int max_complexity, bool enable_fec, int queue_high_ms)
+    : min_bitrate_(std::min(min_bitrate, max_bitrate)), max_bitrate_(max_bitrate), max_complexity_(max_complexity),
+      enable_fec_(enable_fec), queue_high_ms_(queue_high_ms) {
+    settings_ = { .bitrate = 0, .complexity = 0, .fec = false };
+}
+
+void BitrateController::OnSent(int audio_ms, uint32_t send_us, bool sent) {
+    sent_ms_ += audio_ms;
+    send_us_ += send_us;
+    if (!sent) {
+        failures_++;
+    }
+}
+
+void BitrateController::OnEncoded(int64_t now_us, int frame_ms, uint32_t encode_us, int queued_ms) {
+    if (window_start_us_ == 0 || now_us - last_frame_us_ > BITRATE_FRAME_GAP_MS * 1000) {
+        /* What was sent after the last utterance says nothing about this one */
+        sent_ms_ = 0;
+        send_us_ = 0;
+        failures_ = 0;
+        ResetWindow(now_us);
+    }
+    last_frame_us_ = now_us;
+    encoded_ms_ += frame_ms;
+    encode_us_ += encode_us;
+    max_queued_ms_ = std::max(max_queued_ms_, queued_ms);
+    if (encoded_ms_ < BITRATE_WINDOW_MS) {
+        return;
+    }
+
+    Evaluate();
+    ResetWindow(now_us);
+}
+
+void BitrateController::Evaluate() {
+    uint32_t sent_ms = sent_ms_.exchange(0);
+    uint32_t send_us = send_us_.exchange(0);
+    uint32_t failures = failures_.exchange(0);
+    int send_busy = sent_ms > 0 ? send_us / 10 / sent_ms : 0;
+    int encode_load = encode_us_ / 10 / encoded_ms_;
+    Settings settings = settings_;
+
+    bool congested = failures > 0 || max_queued_ms_ >= queue_high_ms_ || send_busy >= BITRATE_SEND_BUSY_PERCENT;
+    if (congested) {
+        clear_windows_ = 0;
+        /* The automatic bitrate is cut as if it were the maximum */
+        int bitrate = settings.bitrate > 0 ? settings.bitrate : max_bitrate_;
+        settings.bitrate = std::max(min_bitrate_, bitrate * 3 / 4);
+    } else if (max_queued_ms_ < queue_high_ms_ / 2 && send_busy < BITRATE_SEND_IDLE_PERCENT) {
+        if (++clear_windows_ >= BITRATE_CLEAR_WINDOWS && settings.bitrate > 0) {
+            clear_windows_ = 0;
+            settings.bitrate += BITRATE_STEP;
+            if (settings.bitrate >= max_bitrate_) {
+                settings.bitrate = 0;
+            }
+        }
+    } else {
+        clear_windows_ = 0;
+    }
+
+    /* The transports only report the losses they see themselves */
+    if (failures > 0 && enable_fec_) {
+        fec_windows_ = BITRATE_FEC_WINDOWS;
+    } else if (fec_windows_ > 0 && !congested) {
+        fec_windows_--;
+    }
+    settings.fec = fec_windows_ > 0;
+
+    if (encode_load >= BITRATE_ENCODE_HIGH_PERCENT && settings.complexity > 0) {
+        settings.complexity--;
+    } else if (encode_load < BITRATE_ENCODE_LOW_PERCENT && !congested && settings.complexity < max_complexity_) {
+        settings.complexity++;
+    }
+
+    if (settings == settings_) {
+        return;
+    }
+    ESP_LOGI(TAG, "Uplink %d bps (0: auto), complexity %d, FEC %s (queued %d ms, send busy %d%%, %lu failures, encode load %d%%)",
+        settings.bitrate, settings.complexity, settings.fec ? "on" : "off", max_queued_ms_, send_busy,
+        (unsigned long)failures, encode_load);
+    settings_ = settings;
+}
+
+void BitrateController::ResetWindow(int64_t now_us) {
+    window_start_us_ = now_us;
+    encoded_ms_ = 0;
+    encode_us_ = 0;
+    max_queued_ms_ = 0;
+}
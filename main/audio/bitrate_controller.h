@@ -0,0 +1,75 @@
+#ifndef BITRATE_CONTROLLER_H
+#define BITRATE_CONTROLLER_H
+
+#include <atomic>
+#include <cstdint>
+
+/*
+ * Picks the uplink Opus bitrate, complexity and FEC from what the uplink looks like.
+ *
+ * Every window (about a second of encoded audio) is judged from three signals: the audio waiting in the
+ * send queue, the messages the transport failed to send, and the time the transport took to accept the
+ * audio (a TCP send blocks for about a round trip once the window is full, the transports measure no RTT).
+ * A congested window cuts the bitrate by a quarter, a few clear windows in a row raise it by a step, so the
+ * send queue drains instead of building a backlog on a weak cellular link. Send failures also turn FEC on
+ * until the link is clear again. The complexity follows the encoder load, so a lower bitrate does not cost
+ * more CPU than the frame duration allows.
+ *
+ * The bitrate starts as the automatic Opus bitrate, as without the controller, and goes back to it once
+ * raised to the maximum. The encoder can only take the complexity and FEC when it is opened, so the audio
+ * service applies them between sessions.
+ *
+ * OnSent() is called by the sender task, the other methods by the encoder task.
+ */
+class BitrateController {
+public:
+    struct Settings {
+        // 0 for the automatic Opus bitrate
+        int bitrate;
+        int complexity;
+        bool fec;
+
+        inline bool operator==(const Settings& other) const {
+            return bitrate == other.bitrate && complexity == other.complexity && fec == other.fec;
+        }
+        inline bool operator!=(const Settings& other) const { return !(*this == other); }
+    };
+
+    // queue_high_ms is the send queue length that counts as a backlog
+    BitrateController(int min_bitrate, int max_bitrate, int max_complexity, bool enable_fec, int queue_high_ms);
+
+    // One message of audio_ms was handed to the transport in send_us
+    void OnSent(int audio_ms, uint32_t send_us, bool sent);
+    // One frame was encoded in encode_us, queued_ms is waiting in the send queue
+    void OnEncoded(int64_t now_us, int frame_ms, uint32_t encode_us, int queued_ms);
+
+    inline const Settings& settings() const { return settings_; }
+
+private:
+    const int min_bitrate_;
+    const int max_bitrate_;
+    const int max_complexity_;
+    const bool enable_fec_;
+    const int queue_high_ms_;
+    Settings settings_;
+
+    // Written by the sender task, taken by the window
+    std::atomic<uint32_t> sent_ms_ = 0;
+    std::atomic<uint32_t> send_us_ = 0;
+    std::atomic<uint32_t> failures_ = 0;
+
+    // The current window, 0 before its first frame
+    int64_t window_start_us_ = 0;
+    int64_t last_frame_us_ = 0;
+    uint32_t encoded_ms_ = 0;
+    uint64_t encode_us_ = 0;
+    int max_queued_ms_ = 0;
+    // Clear windows in a row, and windows left with FEC after a failure
+    int clear_windows_ = 0;
+    int fec_windows_ = 0;
+
+    void Evaluate();
+    void ResetWindow(int64_t now_us);
+};
+
+#endif // BITRATE_CONTROLLER_H
@@ -0,0 +1,223 @@
+#include "file_audio_codec.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/task.h>
+#include <cstring>
+#include <algorithm>
+
+#define TAG "FileAudioCodec"
+
+#define WAV_HEADER_SIZE 44
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+
+// Pacing restarts from the current time after a longer pause (e.g. the input or output was idle)
+#define FILE_CODEC_MAX_PACING_LAG_US 100000
+
+static uint16_t GetLe16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t GetLe32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void PutLe16(uint8_t* p, uint16_t value) {
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static void PutLe32(uint8_t* p, uint32_t value) {
+    PutLe16(p, value & 0xFFFF);
+    PutLe16(p + 2, value >> 16);
+}
+
+FileAudioCodec::FileAudioCodec(const std::string& input_path, const std::string& output_path, int input_sample_rate,
+    int output_sample_rate, int input_channels, bool input_reference, bool realtime, bool loop)
+    : loop_(loop), realtime_(realtime) {
+    duplex_ = true;
+    input_reference_ = input_reference;
+    input_channels_ = input_channels;
+    input_sample_rate_ = input_sample_rate;
+    output_sample_rate_ = output_sample_rate;
+
+    if (!input_path.empty()) {
+        OpenInput(input_path);
+    }
+    if (!output_path.empty()) {
+        OpenOutput(output_path);
+    }
+    ESP_LOGI(TAG, "Input: %s, output: %s, %s", input_file_ != nullptr ? input_path.c_str() : "silence",
+        output_file_ != nullptr ? output_path.c_str() : "none", realtime_ ? "realtime" : "unpaced");
+}
+
+FileAudioCodec::~FileAudioCodec() {
+    if (input_file_ != nullptr) {
+        fclose(input_file_);
+    }
+    if (output_file_ != nullptr) {
+        FinalizeOutput();
+        fclose(output_file_);
+    }
+}
+
+bool FileAudioCodec::OpenInput(const std::string& path) {
+    input_file_ = fopen(path.c_str(), "rb");
+    if (input_file_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to open input file: %s", path.c_str());
+        return false;
+    }
+
+    /* Walk the RIFF chunks up to the data chunk, the fmt chunk must come first */
+    uint8_t header[12];
+    bool format_ok = false;
+    if (fread(header, 1, sizeof(header), input_file_) == sizeof(header) &&
+        memcmp(header, "RIFF", 4) == 0 && memcmp(header + 8, "WAVE", 4) == 0) {
+        uint8_t chunk[8];
+        while (fread(chunk, 1, sizeof(chunk), input_file_) == sizeof(chunk)) {
+            uint32_t size = GetLe32(chunk + 4);
+            if (memcmp(chunk, "fmt ", 4) == 0) {
+                uint8_t fmt[16];
+                if (size < sizeof(fmt) || fread(fmt, 1, sizeof(fmt), input_file_) != sizeof(fmt)) {
+                    break;
+                }
+                int format = GetLe16(fmt);
+                int channels = GetLe16(fmt + 2);
+                int sample_rate = (int)GetLe32(fmt + 4);
+                int bits = GetLe16(fmt + 14);
+                if ((format != WAV_FORMAT_PCM && format != WAV_FORMAT_EXTENSIBLE) || bits != 16 ||
+                    channels != input_channels_ || sample_rate != input_sample_rate_) {
+                    ESP_LOGE(TAG, "%s is %d Hz, %d channels, %d bits (format %d), expected %d Hz, %d channels, 16 bits PCM",
+                        path.c_str(), sample_rate, channels, bits, format, input_sample_rate_, input_channels_);
+                    break;
+                }
+                format_ok = true;
+                fseek(input_file_, size - sizeof(fmt) + (size & 1), SEEK_CUR);
+            } else if (memcmp(chunk, "data", 4) == 0) {
+                if (!format_ok) {
+                    break;
+                }
+                input_data_offset_ = ftell(input_file_);
+                input_data_size_ = size;
+                ESP_LOGI(TAG, "Input file %s: %d ms", path.c_str(),
+                    (int)((uint64_t)size / sizeof(int16_t) / input_channels_ * 1000 / input_sample_rate_));
+                return true;
+            } else {
+                fseek(input_file_, size + (size & 1), SEEK_CUR);
+            }
+        }
+    }
+
+    if (!format_ok) {
+        ESP_LOGE(TAG, "Not a usable WAV file: %s", path.c_str());
+    }
+    fclose(input_file_);
+    input_file_ = nullptr;
+    return false;
+}
+
+bool FileAudioCodec::OpenOutput(const std::string& path) {
+    output_file_ = fopen(path.c_str(), "wb");
+    if (output_file_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to open output file: %s", path.c_str());
+        return false;
+    }
+
+    /* The sizes are filled in by FinalizeOutput() */
+    uint8_t header[WAV_HEADER_SIZE] = {};
+    memcpy(header, "RIFF", 4);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    PutLe32(header + 16, 16);
+    PutLe16(header + 20, WAV_FORMAT_PCM);
+    PutLe16(header + 22, output_channels_);
+    PutLe32(header + 24, output_sample_rate_);
+    PutLe32(header + 28, output_sample_rate_ * output_channels_ * sizeof(int16_t));
+    PutLe16(header + 32, output_channels_ * sizeof(int16_t));
+    PutLe16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    fwrite(header, 1, sizeof(header), output_file_);
+    FinalizeOutput();
+    return true;
+}
+
+void FileAudioCodec::FinalizeOutput() {
+    std::lock_guard<std::mutex> lock(output_mutex_);
+    if (output_file_ == nullptr) {
+        return;
+    }
+    uint8_t size[4];
+    PutLe32(size, WAV_HEADER_SIZE - 8 + output_data_size_);
+    fseek(output_file_, 4, SEEK_SET);
+    fwrite(size, 1, sizeof(size), output_file_);
+    PutLe32(size, output_data_size_);
+    fseek(output_file_, WAV_HEADER_SIZE - 4, SEEK_SET);
+    fwrite(size, 1, sizeof(size), output_file_);
+    fseek(output_file_, 0, SEEK_END);
+    fflush(output_file_);
+}
+
+void FileAudioCodec::Pace(int64_t& deadline_us, int frames, int sample_rate) {
+    /* Block until the frame would have gone through I2S, keeping the average rate exact */
+    int64_t now = esp_timer_get_time();
+    if (deadline_us == 0 || now - deadline_us > FILE_CODEC_MAX_PACING_LAG_US) {
+        deadline_us = now;
+    }
+    deadline_us += (int64_t)frames * 1000000 / sample_rate;
+    int64_t wait_us = deadline_us - now;
+    if (wait_us >= 1000) {
+        vTaskDelay(pdMS_TO_TICKS(wait_us / 1000));
+    }
+}
+
+void FileAudioCodec::EnableOutput(bool enable) {
+    if (!enable) {
+        FinalizeOutput();
+    }
+    AudioCodec::EnableOutput(enable);
+}
+
+int FileAudioCodec::Read(int16_t* dest, int samples) {
+    int read = 0;
+    while (input_file_ != nullptr && read < samples) {
+        uint32_t left = (input_data_size_ - input_data_read_) / sizeof(int16_t);
+        if (left == 0) {
+            if (!loop_ || input_data_size_ == 0) {
+                input_finished_ = true;
+                break;
+            }
+            fseek(input_file_, input_data_offset_, SEEK_SET);
+            input_data_read_ = 0;
+            continue;
+        }
+        size_t count = fread(dest + read, sizeof(int16_t), std::min<uint32_t>(samples - read, left), input_file_);
+        if (count == 0) {
+            /* The data chunk is shorter than its header says */
+            input_data_size_ = input_data_read_;
+            continue;
+        }
+        read += count;
+        input_data_read_ += count * sizeof(int16_t);
+    }
+
+    /* Silence after the end of the file, the audio service expects a continuous input */
+    std::fill(dest + read, dest + samples, 0);
+    if (realtime_) {
+        Pace(input_deadline_us_, samples / input_channels_, input_sample_rate_);
+    }
+    return samples;
+}
+
+int FileAudioCodec::Write(const int16_t* data, int samples) {
+    {
+        std::lock_guard<std::mutex> lock(output_mutex_);
+        if (output_file_ != nullptr) {
+            size_t count = fwrite(data, sizeof(int16_t), samples, output_file_);
+            output_data_size_ += count * sizeof(int16_t);
+        }
+    }
+    if (realtime_) {
+        Pace(output_deadline_us_, samples / output_channels_, output_sample_rate_);
+    }
+    return samples;
+}
@@ -0,0 +1,59 @@
+#ifndef _FILE_AUDIO_CODEC_H
+#define _FILE_AUDIO_CODEC_H
+
+#include "audio_codec.h"
+
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+/*
+ * An audio codec backed by 16-bit PCM WAV files instead of I2S, to drive the audio service, the wake word
+ * and the processors with recorded audio, e.g. under the ESP-IDF linux target or from an SD card.
+ *
+ * The input file is read as the microphone, with input_channels channels at input_sample_rate (a stereo file
+ * is taken as microphone + reference when input_reference is set). Once it is consumed the input is silence,
+ * or the file starts over if loop is set. The output is written to the output file before the volume is
+ * applied, so that it can be compared with a reference. An empty path means silence / no output file.
+ *
+ * Without realtime pacing the codec reads and writes as fast as the audio service asks, which makes
+ * the runs deterministic. With realtime, Read() and Write() block like I2S does, at the sample rates.
+ */
+class FileAudioCodec : public AudioCodec {
+private:
+    FILE* input_file_ = nullptr;
+    FILE* output_file_ = nullptr;
+    long input_data_offset_ = 0;
+    uint32_t input_data_size_ = 0;
+    uint32_t input_data_read_ = 0;
+    uint32_t output_data_size_ = 0;
+    bool loop_ = false;
+    bool realtime_ = false;
+    std::atomic<bool> input_finished_ = false;
+    int64_t input_deadline_us_ = 0;
+    int64_t output_deadline_us_ = 0;
+    std::mutex output_mutex_;
+
+    bool OpenInput(const std::string& path);
+    bool OpenOutput(const std::string& path);
+    // Writes the RIFF / data sizes, so the output file is valid while the codec keeps running
+    void FinalizeOutput();
+    void Pace(int64_t& deadline_us, int frames, int sample_rate);
+
+    virtual int Read(int16_t* dest, int samples) override;
+    virtual int Write(const int16_t* data, int samples) override;
+
+public:
+    FileAudioCodec(const std::string& input_path, const std::string& output_path, int input_sample_rate,
+        int output_sample_rate, int input_channels = 1, bool input_reference = false, bool realtime = false,
+        bool loop = false);
+    virtual ~FileAudioCodec();
+
+    virtual void EnableOutput(bool enable) override;
+
+    // The whole input file was read (never set when looping)
+    inline bool input_finished() const { return input_finished_; }
+};
+
+#endif // _FILE_AUDIO_CODEC_H
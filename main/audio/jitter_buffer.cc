@@ -0,0 +1,199 @@
+#include "jitter_buffer.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "JitterBuffer"
+
+// Frame duration assumed for packets that do not carry one
+#define JITTER_DEFAULT_FRAME_DURATION_MS 60
+
+JitterBuffer::JitterBuffer(size_t capacity, int min_depth_ms, int max_depth_ms)
+    : capacity_(capacity), min_depth_ms_(min_depth_ms), max_depth_ms_(max_depth_ms), target_depth_ms_(min_depth_ms) {
+    packets_.reserve(capacity_);
+}
+
+static inline int FrameDuration(const AudioStreamPacket& packet) {
+    return packet.frame_duration > 0 ? packet.frame_duration : JITTER_DEFAULT_FRAME_DURATION_MS;
+}
+
+bool JitterBuffer::Push(std::unique_ptr<AudioStreamPacket>&& packet, int64_t now_us) {
+    if (full()) {
+        return false;
+    }
+
+    uint32_t timestamp = packet->timestamp;
+    if (timestamp != 0 && has_next_timestamp_) {
+        /* Older than the packet being played: it arrived too late. A larger step back is a new segment */
+        int32_t distance = (int32_t)(timestamp - next_timestamp_);
+        if (distance < 0 && distance >= -max_depth_ms_) {
+            statistics_.late++;
+            return false;
+        }
+    }
+
+    /* Insert by timestamp, searching from the tail since packets mostly arrive in order */
+    size_t index = packets_.size();
+    if (timestamp != 0) {
+        while (index > 0) {
+            const auto& previous = packets_[index - 1];
+            if (previous->timestamp == 0) {
+                break;
+            }
+            int32_t distance = (int32_t)(previous->timestamp - timestamp);
+            if (distance == 0) {
+                statistics_.duplicates++;
+                return false;
+            }
+            /* Only swap within the reorder window, anything further away is a discontinuity */
+            if (distance < 0 || distance > max_depth_ms_) {
+                break;
+            }
+            index--;
+        }
+    }
+
+    /* Never conceal more than the deepest playout, a longer outage is better skipped */
+    packet->lost_frames = std::min<int>(packet->lost_frames, max_depth_ms_ / FrameDuration(*packet));
+    UpdateJitter(*packet, now_us);
+    packets_.insert(packets_.begin() + index, std::move(packet));
+    return true;
+}
+
+void JitterBuffer::UpdateJitter(const AudioStreamPacket& packet, int64_t now_us) {
+    if (last_arrival_us_ != 0) {
+        /* How much later than its media spacing the packet arrived, early (bursty) arrivals count as zero */
+        int64_t media_delta_us = FrameDuration(packet) * 1000LL;
+        if (packet.timestamp != 0 && last_arrival_timestamp_ != 0) {
+            int32_t delta = (int32_t)(packet.timestamp - last_arrival_timestamp_);
+            if (delta > 0 && delta <= max_depth_ms_) {
+                media_delta_us = delta * 1000LL;
+            }
+        }
+        int64_t lateness_us = std::clamp<int64_t>(now_us - last_arrival_us_ - media_delta_us, 0, max_depth_ms_ * 1000LL);
+        /* Same smoothing as the RFC 3550 interarrival jitter */
+        jitter_us_ += (lateness_us - jitter_us_) / 16;
+        target_depth_ms_ = std::clamp((int)(jitter_us_ * 2 / 1000), min_depth_ms_, max_depth_ms_);
+    }
+    last_arrival_us_ = now_us;
+    last_arrival_timestamp_ = packet.timestamp;
+}
+
+int JitterBuffer::BufferedMs() const {
+    int buffered_ms = 0;
+    for (const auto& packet : packets_) {
+        buffered_ms += FrameDuration(*packet);
+    }
+    return buffered_ms;
+}
+
+JitterBuffer::Action JitterBuffer::Next(int64_t now_us, int& wait_ms) {
+    wait_ms = -1;
+    if (packets_.empty()) {
+        if (playing_) {
+            /* Ran dry, rebuild the target depth before playing again */
+            playing_ = false;
+            statistics_.underruns++;
+        }
+        return kJitterWait;
+    }
+
+    if (wait_start_us_ == 0) {
+        wait_start_us_ = now_us;
+    }
+    int waited_ms = (int)((now_us - wait_start_us_) / 1000);
+
+    const auto& head = packets_.front();
+    int frame_duration = FrameDuration(*head);
+    if (!playing_) {
+        /* Start once the target depth is buffered, or once the first packet waited that long (end of stream) */
+        if (!full() && BufferedMs() < target_depth_ms_ && waited_ms < target_depth_ms_) {
+            wait_ms = target_depth_ms_ - waited_ms;
+            return kJitterWait;
+        }
+        playing_ = true;
+    }
+
+    if (head->lost_frames > 0) {
+        /* The transport already waited for the missing packets, the last one may be in the head's FEC data */
+        has_next_timestamp_ = false;
+        if (--head->lost_frames == 0) {
+            statistics_.recovered++;
+            return kJitterRecover;
+        }
+        statistics_.concealed++;
+        return kJitterConceal;
+    }
+
+    int32_t gap = head->timestamp != 0 && has_next_timestamp_ ? (int32_t)(head->timestamp - next_timestamp_) : 0;
+    if (gap <= 0 || gap > max_depth_ms_) {
+        /* In sequence, or a discontinuity that Pop() resynchronizes to */
+        wait_start_us_ = 0;
+        gap_lost_ = false;
+        return kJitterDecode;
+    }
+
+    /*
+     * The next packet is missing, give it a chance to arrive out of order before declaring it lost.
+     * Once declared lost, the other frames of the gap are concealed at once: playback is already starved.
+     */
+    int hold_ms = std::max(target_depth_ms_, frame_duration);
+    if (!gap_lost_ && !full() && BufferedMs() < hold_ms && waited_ms < hold_ms) {
+        wait_ms = hold_ms - waited_ms;
+        return kJitterWait;
+    }
+
+    gap_lost_ = true;
+    next_timestamp_ += frame_duration;
+    if (gap <= frame_duration) {
+        /* Exactly one packet is lost, the head may carry its in-band FEC copy */
+        statistics_.recovered++;
+        return kJitterRecover;
+    }
+    statistics_.concealed++;
+    return kJitterConceal;
+}
+
+std::unique_ptr<AudioStreamPacket> JitterBuffer::Pop() {
+    if (packets_.empty()) {
+        return nullptr;
+    }
+    auto packet = std::move(packets_.front());
+    packets_.erase(packets_.begin());
+
+    if (packet->timestamp != 0) {
+        next_timestamp_ = packet->timestamp + FrameDuration(*packet);
+        has_next_timestamp_ = true;
+    } else {
+        has_next_timestamp_ = false;
+    }
+    statistics_.played++;
+    return packet;
+}
+
+const AudioStreamPacket* JitterBuffer::Peek() const {
+    return packets_.empty() ? nullptr : packets_.front().get();
+}
+
+void JitterBuffer::Reset(std::function<void(std::unique_ptr<AudioStreamPacket>&&)> release) {
+    for (auto& packet : packets_) {
+        release(std::move(packet));
+    }
+    packets_.clear();
+
+    if (statistics_.concealed > 0 || statistics_.recovered > 0 || statistics_.late > 0) {
+        ESP_LOGI(TAG, "played %lu, concealed %lu, recovered %lu, late %lu, duplicates %lu, underruns %lu, jitter %d ms",
+            statistics_.played, statistics_.concealed, statistics_.recovered, statistics_.late,
+            statistics_.duplicates, statistics_.underruns, jitter_ms());
+    }
+    statistics_ = Statistics();
+    playing_ = false;
+    has_next_timestamp_ = false;
+    next_timestamp_ = 0;
+    wait_start_us_ = 0;
+    gap_lost_ = false;
+    last_arrival_us_ = 0;
+    last_arrival_timestamp_ = 0;
+    /* Keep the jitter estimate, the network does not change between two responses */
+    target_depth_ms_ = std::clamp((int)(jitter_us_ * 2 / 1000), min_depth_ms_, max_depth_ms_);
+}
@@ -0,0 +1,81 @@
+#ifndef JITTER_BUFFER_H
+#define JITTER_BUFFER_H
+
+#include <memory>
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+#include "protocol.h"
+
+/*
+ * Reorders the downlink Opus packets by timestamp and decides, whenever the decoder has room in
+ * the playback queue, whether to decode the next packet, to conceal a lost one, or to wait.
+ *
+ * The playout depth adapts to the measured arrival jitter (only late arrivals count, servers send
+ * TTS in bursts). Packets without a timestamp (websocket protocol v1 / v3, local sounds) are played
+ * in arrival order, only the start-up depth applies to them. Losses reported by the transport
+ * (AudioStreamPacket::lost_frames) are concealed without waiting.
+ *
+ * Only the decoder task uses it, so it takes no lock.
+ */
+class JitterBuffer {
+public:
+    enum Action {
+        kJitterWait,        // Nothing to play yet
+        kJitterDecode,      // Decode the packet returned by Pop()
+        kJitterConceal,     // The next packet is lost, decode a PLC frame
+        kJitterRecover,     // The next packet is lost, recover it from the FEC data of Peek()
+    };
+
+    struct Statistics {
+        uint32_t played = 0;
+        uint32_t concealed = 0;
+        uint32_t recovered = 0;
+        uint32_t late = 0;
+        uint32_t duplicates = 0;
+        uint32_t underruns = 0;
+    };
+
+    JitterBuffer(size_t capacity, int min_depth_ms, int max_depth_ms);
+
+    // Moves the packet in only if it is accepted, late and duplicate packets are left to the caller
+    bool Push(std::unique_ptr<AudioStreamPacket>&& packet, int64_t now_us);
+    // wait_ms is set when kJitterWait is returned, -1 means until the next packet arrives
+    Action Next(int64_t now_us, int& wait_ms);
+    std::unique_ptr<AudioStreamPacket> Pop();
+    const AudioStreamPacket* Peek() const;
+    void Reset(std::function<void(std::unique_ptr<AudioStreamPacket>&&)> release);
+
+    inline size_t size() const { return packets_.size(); }
+    inline bool empty() const { return packets_.empty(); }
+    inline bool full() const { return packets_.size() >= capacity_; }
+    inline int jitter_ms() const { return (int)(jitter_us_ / 1000); }
+    inline int target_depth_ms() const { return target_depth_ms_; }
+    inline const Statistics& statistics() const { return statistics_; }
+
+private:
+    const size_t capacity_;
+    const int min_depth_ms_;
+    const int max_depth_ms_;
+    // Sorted by timestamp, the head is the next packet to play
+    std::vector<std::unique_ptr<AudioStreamPacket>> packets_;
+    Statistics statistics_;
+
+    bool playing_ = false;
+    bool has_next_timestamp_ = false;
+    uint32_t next_timestamp_ = 0;
+    // When Next() started waiting for the head, kept across the frames of a gap until a packet is decoded
+    int64_t wait_start_us_ = 0;
+    // The gap before the head was declared lost, its remaining frames are concealed without waiting
+    bool gap_lost_ = false;
+    int64_t last_arrival_us_ = 0;
+    uint32_t last_arrival_timestamp_ = 0;
+    int64_t jitter_us_ = 0;
+    int target_depth_ms_ = 0;
+
+    int BufferedMs() const;
+    void UpdateJitter(const AudioStreamPacket& packet, int64_t now_us);
+};
+
+#endif // JITTER_BUFFER_H
@@ -0,0 +1,116 @@
+#include "latency_tracer.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "LatencyTracer"
+
+const char* LatencyTracer::StageName(LatencyStage stage) {
+    switch (stage) {
+        case kLatencyUplinkProcessed: return "uplink.processed";
+        case kLatencyUplinkEncoded: return "uplink.encoded";
+        case kLatencyUplinkSent: return "uplink.sent";
+        case kLatencyDownlinkDecoded: return "downlink.decoded";
+        case kLatencyDownlinkPlayed: return "downlink.played";
+        default: return "unknown";
+    }
+}
+
+int LatencyTracer::BucketIndex(uint32_t ms) {
+    if (ms < kLinearBuckets) {
+        return ms;
+    }
+    /* 8 sub-buckets per octave: the 3 bits after the leading one */
+    int msb = 31 - __builtin_clz(ms);
+    int octave = msb - 4;
+    if (octave >= kOctaves) {
+        return kBucketCount - 1;
+    }
+    int sub = (ms >> (msb - 3)) & (kSubBuckets - 1);
+    return kLinearBuckets + octave * kSubBuckets + sub;
+}
+
+uint32_t LatencyTracer::BucketUpperBound(int index) {
+    if (index < kLinearBuckets) {
+        return index + 1;
+    }
+    if (index >= kBucketCount - 1) {
+        return UINT32_MAX;
+    }
+    int octave = (index - kLinearBuckets) / kSubBuckets;
+    int sub = (index - kLinearBuckets) % kSubBuckets;
+    return (uint32_t)(kSubBuckets + sub + 1) << (octave + 1);
+}
+
+void LatencyTracer::Record(LatencyStage stage, int64_t trace_time_us, int64_t now_us) {
+    if (trace_time_us <= 0 || now_us < trace_time_us) {
+        return;
+    }
+    uint32_t ms = (uint32_t)std::min<int64_t>((now_us - trace_time_us) / 1000, UINT32_MAX);
+    auto& histogram = histograms_[stage];
+    histogram.buckets[BucketIndex(ms)].fetch_add(1, std::memory_order_relaxed);
+    histogram.count.fetch_add(1, std::memory_order_relaxed);
+    uint32_t max_ms = histogram.max_ms.load(std::memory_order_relaxed);
+    while (ms > max_ms && !histogram.max_ms.compare_exchange_weak(max_ms, ms, std::memory_order_relaxed)) {
+    }
+}
+
+int LatencyTracer::Percentile(LatencyStage stage, int percentile) const {
+    auto& histogram = histograms_[stage];
+    /* Count from the buckets, a frame being recorded may not be in the count yet */
+    uint64_t total = 0;
+    for (auto& bucket : histogram.buckets) {
+        total += bucket.load(std::memory_order_relaxed);
+    }
+    if (total == 0) {
+        return -1;
+    }
+    uint64_t target = std::max<uint64_t>(1, (total * percentile + 99) / 100);
+    uint64_t seen = 0;
+    uint32_t max_ms = histogram.max_ms.load(std::memory_order_relaxed);
+    for (int i = 0; i < kBucketCount; i++) {
+        seen += histogram.buckets[i].load(std::memory_order_relaxed);
+        if (seen >= target) {
+            return (int)std::min(BucketUpperBound(i), max_ms);
+        }
+    }
+    return (int)max_ms;
+}
+
+void LatencyTracer::Reset() {
+    for (auto& histogram : histograms_) {
+        for (auto& bucket : histogram.buckets) {
+            bucket = 0;
+        }
+        histogram.count = 0;
+        histogram.max_ms = 0;
+        histogram.logged_count = 0;
+    }
+}
+
+cJSON* LatencyTracer::ToJson() const {
+    cJSON* json = cJSON_CreateObject();
+    for (int i = 0; i < kLatencyStageCount; i++) {
+        auto stage = (LatencyStage)i;
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "count", count(stage));
+        cJSON_AddNumberToObject(item, "p50", Percentile(stage, 50));
+        cJSON_AddNumberToObject(item, "p90", Percentile(stage, 90));
+        cJSON_AddNumberToObject(item, "p99", Percentile(stage, 99));
+        cJSON_AddNumberToObject(item, "max", histograms_[i].max_ms.load());
+        cJSON_AddItemToObject(json, StageName(stage), item);
+    }
+    return json;
+}
+
+void LatencyTracer::Log() {
+    for (int i = 0; i < kLatencyStageCount; i++) {
+        auto stage = (LatencyStage)i;
+        uint32_t frames = count(stage);
+        if (frames == histograms_[i].logged_count.exchange(frames)) {
+            continue;
+        }
+        ESP_LOGI(TAG, "%s: %lu frames, p50 %d ms, p90 %d ms, p99 %d ms, max %lu ms", StageName(stage), frames,
+            Percentile(stage, 50), Percentile(stage, 90), Percentile(stage, 99), histograms_[i].max_ms.load());
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef LATENCY_TRACER_H
+#define LATENCY_TRACER_H
+
+#include <atomic>
+#include <cstdint>
+
+#include <cJSON.h>
+
+enum LatencyStage {
+    kLatencyUplinkProcessed,    // Out of the audio processor (AEC / NS / VAD)
+    kLatencyUplinkEncoded,      // Encoded into the send queue
+    kLatencyUplinkSent,         // Handed to the transport by the sender task
+    kLatencyDownlinkDecoded,    // Through the jitter buffer and decoded into the playback queue
+    kLatencyDownlinkPlayed,     // Written to the codec
+    kLatencyStageCount,
+};
+
+/*
+ * Latency histograms of the audio frames across the pipeline.
+ *
+ * A frame carries the time it entered the device (AudioTask / AudioStreamPacket::trace_time_us, on the
+ * esp_timer clock): captured by ReadAudioData() on the uplink, received from the protocol on the downlink.
+ * Every stage records the time elapsed since then, so a stage includes the queues in front of it.
+ *
+ * Buckets are 1 ms wide below 16 ms, then 8 per octave up to 4 s, so a percentile is the upper bound of
+ * its bucket (within 12.5%). Record() takes no lock and may be called from any task.
+ */
+class LatencyTracer {
+public:
+    static const char* StageName(LatencyStage stage);
+
+    // Frames without a trace time (sounds, concealed frames, wake word audio) are not recorded
+    void Record(LatencyStage stage, int64_t trace_time_us, int64_t now_us);
+    // In ms, -1 if the stage has no frame
+    int Percentile(LatencyStage stage, int percentile) const;
+    inline uint32_t count(LatencyStage stage) const { return histograms_[stage].count; }
+    void Reset();
+
+    // {"uplink.sent": {"count": 120, "p50": 72, "p90": 80, "p99": 96, "max": 98}, ...}, owned by the caller
+    cJSON* ToJson() const;
+    // Logs the stages that recorded frames since the last call
+    void Log();
+
+private:
+    static constexpr int kLinearBuckets = 16;
+    static constexpr int kSubBuckets = 8;
+    static constexpr int kOctaves = 8;
+    // Plus one for 4 s and more
+    static constexpr int kBucketCount = kLinearBuckets + kSubBuckets * kOctaves + 1;
+
+    struct Histogram {
+        std::atomic<uint32_t> buckets[kBucketCount] = {};
+        std::atomic<uint32_t> count = 0;
+        std::atomic<uint32_t> max_ms = 0;
+        std::atomic<uint32_t> logged_count = 0;
+    };
+    Histogram histograms_[kLatencyStageCount];
+
+    static int BucketIndex(uint32_t ms);
+    static uint32_t BucketUpperBound(int index);
+};
+
+#endif // LATENCY_TRACER_H
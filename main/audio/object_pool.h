@@ -0,0 +1,90 @@
+#ifndef OBJECT_POOL_H
+#define OBJECT_POOL_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Fixed-capacity pool of heap objects handed out as std::unique_ptr.
+ *
+ * Fill() allocates every object up front, so that the buffers inside them (PCM, Opus payload)
+ * are allocated once at boot and only recycled afterwards. Acquire() falls back to the heap when
+ * the pool is drained, and Release() frees the object instead of keeping it when the pool is full,
+ * so a burst can never leak memory into the pool. SetCapacity() resizes the pool, a later Fill()
+ * allocates the missing objects. The objects are returned as they were released:
+ * the caller must overwrite every field it uses.
+ */
+template <typename T>
+class ObjectPool {
+public:
+    explicit ObjectPool(size_t capacity) : capacity_(capacity) {
+    }
+
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    void SetCapacity(size_t capacity) {
+        std::vector<std::unique_ptr<T>> trimmed;
+        std::lock_guard<std::mutex> lock(mutex_);
+        capacity_ = capacity;
+        while (free_.size() > capacity_) {
+            trimmed.push_back(std::move(free_.back()));
+            free_.pop_back();
+        }
+    }
+
+    void Fill(std::function<void(T&)> prepare = nullptr) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.reserve(capacity_);
+        while (free_.size() < capacity_) {
+            auto item = std::make_unique<T>();
+            if (prepare) {
+                prepare(*item);
+            }
+            free_.push_back(std::move(item));
+        }
+    }
+
+    std::unique_ptr<T> Acquire() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!free_.empty()) {
+                auto item = std::move(free_.back());
+                free_.pop_back();
+                return item;
+            }
+            misses_++;
+        }
+        return std::make_unique<T>();
+    }
+
+    void Release(std::unique_ptr<T> item) {
+        if (!item) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_.size() < capacity_) {
+            free_.push_back(std::move(item));
+        }
+    }
+
+    // Number of Acquire() calls that had to allocate from the heap since the last call
+    inline uint32_t TakeMisses() { return misses_.exchange(0); }
+    size_t capacity() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return capacity_;
+    }
+
+private:
+    size_t capacity_;
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<T>> free_;
+    std::atomic<uint32_t> misses_ = 0;
+};
+
+#endif // OBJECT_POOL_H
@@ -0,0 +1,53 @@
+#include "ogg_player.h"
+
+#include <algorithm>
+
+OggPlayer::OggPlayer(const std::string_view& clip, const OggPacketIndex* index)
+    : clip_(clip), index_(index), frames_(index->packets.size()) {
+}
+
+OggPlayer::OggPlayer(const CachedSound* sound)
+    : sound_(sound), frame_size_(sound->sample_rate / 1000 * SOUND_FRAME_DURATION_MS) {
+    frames_ = (sound->samples + frame_size_ - 1) / frame_size_;
+}
+
+void OggPlayer::Seek(int position_ms) {
+    next_frame_ = std::min<uint32_t>(std::max(position_ms, 0) / SOUND_FRAME_DURATION_MS, frames_);
+}
+
+// Claims the next frame; if Seek() moved the position meanwhile, the frame it points to is taken instead
+bool OggPlayer::TakeFrame(uint32_t& frame) {
+    frame = next_frame_.load();
+    while (!cancelled_ && frame < frames_) {
+        if (next_frame_.compare_exchange_weak(frame, frame + 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool OggPlayer::ReadPcm(std::vector<int16_t>& pcm) {
+    uint32_t frame;
+    if (sound_ == nullptr || !TakeFrame(frame)) {
+        return false;
+    }
+    size_t start = frame * frame_size_;
+    size_t end = std::min(start + frame_size_, sound_->samples);
+    pcm.assign(sound_->pcm + start, sound_->pcm + end);
+    return true;
+}
+
+bool OggPlayer::ReadPacket(AudioStreamPacket& packet) {
+    uint32_t frame;
+    if (index_ == nullptr || !TakeFrame(frame)) {
+        return false;
+    }
+    auto& entry = index_->packets[frame];
+    packet.sample_rate = index_->sample_rate;
+    packet.frame_duration = SOUND_FRAME_DURATION_MS;
+    packet.timestamp = 0;
+    packet.lost_frames = 0;
+    packet.trace_time_us = 0;
+    packet.AssignPayload((const uint8_t*)clip_.data() + entry.offset, entry.size);
+    return true;
+}
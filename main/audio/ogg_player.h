@@ -0,0 +1,52 @@
+#ifndef OGG_PLAYER_H
+#define OGG_PLAYER_H
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <string_view>
+
+#include "sound_bank.h"
+#include "protocol.h"
+
+/*
+ * One playback of a sound clip, handed to the decoder task through the sound queue.
+ *
+ * The decoder task pulls one frame at a time, and only while the playback queue has room, so a clip
+ * of any length is fed incrementally and the caller of PlaySound() never waits. A cached clip is
+ * copied from the sound bank, otherwise its Opus packets are read through the clip's packet index.
+ *
+ * Cancel() and Seek() may be called from any task, they take effect at the next frame.
+ */
+class OggPlayer {
+public:
+    OggPlayer(const std::string_view& clip, const OggPacketIndex* index);
+    OggPlayer(const CachedSound* sound);
+
+    void Cancel() { cancelled_ = true; }
+    bool cancelled() const { return cancelled_; }
+    void Seek(int position_ms);
+    int position_ms() const { return next_frame_ * SOUND_FRAME_DURATION_MS; }
+    int duration_ms() const { return frames_ * SOUND_FRAME_DURATION_MS; }
+    bool cached() const { return sound_ != nullptr; }
+    // The Ogg clip of a streamed sound
+    const std::string_view& clip() const { return clip_; }
+
+    // Decoder task, false at the end of the clip or once cancelled
+    bool ReadPcm(std::vector<int16_t>& pcm);
+    bool ReadPacket(AudioStreamPacket& packet);
+
+private:
+    std::string_view clip_;
+    const OggPacketIndex* index_ = nullptr;
+    const CachedSound* sound_ = nullptr;
+    // Samples per frame of the cached PCM
+    size_t frame_size_ = 0;
+    uint32_t frames_ = 0;
+    std::atomic<uint32_t> next_frame_ = 0;
+    std::atomic<bool> cancelled_ = false;
+
+    bool TakeFrame(uint32_t& frame);
+};
+
+#endif // OGG_PLAYER_H
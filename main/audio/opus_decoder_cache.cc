@@ -0,0 +1,84 @@
+#include "opus_decoder_cache.h"
+#include "audio_service.h"
+
+#include <esp_log.h>
+
+#define TAG "OpusDecoderCache"
+
+OpusDecoderCache::OpusDecoderCache(size_t capacity, int output_sample_rate)
+    : capacity_(capacity), output_sample_rate_(output_sample_rate) {
+    entries_.reserve(capacity_);
+}
+
+OpusDecoderCache::~OpusDecoderCache() {
+    for (auto& entry : entries_) {
+        Close(entry);
+    }
+}
+
+const OpusDecoderCache::Entry* OpusDecoderCache::Get(int sample_rate, int frame_duration) {
+    use_count_++;
+    for (auto& entry : entries_) {
+        if (entry.sample_rate == sample_rate && entry.frame_duration == frame_duration) {
+            entry.last_used = use_count_;
+            return &entry;
+        }
+    }
+
+    /* Not cached: take a free slot, or close the least recently used stream */
+    Entry* slot = nullptr;
+    if (entries_.size() < capacity_) {
+        slot = &entries_.emplace_back();
+    } else {
+        slot = &entries_.front();
+        for (auto& entry : entries_) {
+            if (entry.last_used < slot->last_used) {
+                slot = &entry;
+            }
+        }
+        ESP_LOGI(TAG, "Closing the %d Hz / %d ms decoder", slot->sample_rate, slot->frame_duration);
+        Close(*slot);
+    }
+
+    slot->sample_rate = sample_rate;
+    slot->frame_duration = frame_duration;
+    slot->last_used = use_count_;
+    if (!Open(*slot)) {
+        /* Drop the slot, so that it is not found as an open decoder */
+        *slot = entries_.back();
+        entries_.pop_back();
+        return nullptr;
+    }
+    return slot;
+}
+
+bool OpusDecoderCache::Open(Entry& entry) {
+    esp_opus_dec_cfg_t opus_dec_cfg = OPUS_DEC_CFG(entry.sample_rate, entry.frame_duration);
+    auto ret = esp_opus_dec_open(&opus_dec_cfg, sizeof(esp_opus_dec_cfg_t), &entry.decoder);
+    if (entry.decoder == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio decoder, error code: %d", ret);
+        return false;
+    }
+
+    if (entry.sample_rate != output_sample_rate_) {
+        ESP_LOGI(TAG, "Resampling audio from %d to %d", entry.sample_rate, output_sample_rate_);
+        esp_ae_rate_cvt_cfg_t output_resampler_cfg = RATE_CVT_CFG(entry.sample_rate, output_sample_rate_, ESP_AUDIO_MONO);
+        auto resampler_ret = esp_ae_rate_cvt_open(&output_resampler_cfg, &entry.resampler);
+        if (entry.resampler == nullptr) {
+            /* The frames are then played at the decoder rate, as before the cache */
+            ESP_LOGE(TAG, "Failed to create output resampler, error code: %d", resampler_ret);
+        }
+    }
+    return true;
+}
+
+void OpusDecoderCache::Close(Entry& entry) {
+    if (entry.decoder != nullptr) {
+        esp_opus_dec_close(entry.decoder);
+        entry.decoder = nullptr;
+    }
+    if (entry.resampler != nullptr) {
+        esp_ae_rate_cvt_close(entry.resampler);
+        entry.resampler = nullptr;
+    }
+}
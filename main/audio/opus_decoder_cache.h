@@ -0,0 +1,48 @@
+#ifndef OPUS_DECODER_CACHE_H
+#define OPUS_DECODER_CACHE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "esp_ae_rate_cvt.h"
+
+/*
+ * The Opus decoders opened for the downlink streams, with the resampler to the codec output rate of each,
+ * keyed by sample rate and frame duration.
+ *
+ * Sound clips (16 kHz) played between TTS frames (often 24 kHz) used to close and reopen the decoder at
+ * every switch. A cached stream is switched to with a lookup, and keeps its own decoder state. When the
+ * cache is full, the least recently used decoder is closed. Only the decoder task uses it.
+ */
+class OpusDecoderCache {
+public:
+    struct Entry {
+        int sample_rate = 0;
+        int frame_duration = 0;
+        void* decoder = nullptr;
+        // nullptr when the stream is at the codec output rate
+        esp_ae_rate_cvt_handle_t resampler = nullptr;
+        uint32_t last_used = 0;
+    };
+
+    OpusDecoderCache(size_t capacity, int output_sample_rate);
+    ~OpusDecoderCache();
+
+    OpusDecoderCache(const OpusDecoderCache&) = delete;
+    OpusDecoderCache& operator=(const OpusDecoderCache&) = delete;
+
+    // Opens the stream if it is not cached, nullptr if it could not be opened
+    const Entry* Get(int sample_rate, int frame_duration);
+
+private:
+    const size_t capacity_;
+    const int output_sample_rate_;
+    std::vector<Entry> entries_;
+    uint32_t use_count_ = 0;
+
+    bool Open(Entry& entry);
+    void Close(Entry& entry);
+};
+
+#endif // OPUS_DECODER_CACHE_H
@@ -0,0 +1,51 @@
+#include "playback_mixer.h"
+#include "sample_kernels.h"
+
+#include <algorithm>
+#include <cstring>
+
+static inline int32_t GainToQ16(float gain) {
+    return (int32_t)(std::clamp(gain, 0.0f, 1.0f) * 65536.0f + 0.5f);
+}
+
+PlaybackMixer::PlaybackMixer(int streams, size_t period_samples)
+    : stream_count_(streams), period_samples_(period_samples), streams_(new Stream[streams]),
+      accumulator_(period_samples), output_(period_samples) {
+}
+
+void PlaybackMixer::SetGain(int stream, float gain) {
+    streams_[stream].gain_q16 = GainToQ16(gain);
+}
+
+void PlaybackMixer::SetDucking(int stream, float gain) {
+    streams_[stream].ducking_q16 = GainToQ16(gain);
+}
+
+void PlaybackMixer::Begin(uint32_t active_streams) {
+    memset(accumulator_.data(), 0, accumulator_.size() * sizeof(int32_t));
+
+    /* Every stream, playing or not, moves to its gain under the streams playing now */
+    for (int i = 0; i < stream_count_; i++) {
+        auto& stream = streams_[i];
+        int64_t target_q16 = stream.gain_q16;
+        for (int j = 0; j < stream_count_; j++) {
+            if (j != i && (active_streams & (1u << j))) {
+                target_q16 = (target_q16 * streams_[j].ducking_q16) >> 16;
+            }
+        }
+        stream.start_q16 += stream.step_q16 * (int32_t)period_samples_;
+        stream.step_q16 = ((int32_t)target_q16 - stream.start_q16) / (int32_t)period_samples_;
+    }
+}
+
+void PlaybackMixer::Mix(int stream, const int16_t* pcm, size_t offset, size_t samples) {
+    auto& state = streams_[stream];
+    samples = std::min(samples, period_samples_ - offset);
+    MixInt16ToInt32(pcm, accumulator_.data() + offset, samples,
+        state.start_q16 + state.step_q16 * (int32_t)offset, state.step_q16);
+}
+
+std::vector<int16_t>& PlaybackMixer::End() {
+    ShiftInt32ToInt16(accumulator_.data(), output_.data(), period_samples_, 0);
+    return output_;
+}
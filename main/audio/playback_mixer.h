@@ -0,0 +1,52 @@
+#ifndef PLAYBACK_MIXER_H
+#define PLAYBACK_MIXER_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Mixes the playback streams into one buffer per codec DMA period.
+ *
+ * Every stream has a gain, and a ducking gain applied to the other streams while it plays (a cue lowers
+ * the speech under it). Both are Q16 fixed point, at most 1.0, and a gain change is ramped over one period
+ * so that ducking does not click. The streams are summed in 32 bits and saturated once to 16 bits.
+ *
+ * SetGain() and SetDucking() may be called from any task, the other methods only by the output task.
+ */
+class PlaybackMixer {
+public:
+    PlaybackMixer(int streams, size_t period_samples);
+
+    // 0 - 1.0, from the next period
+    void SetGain(int stream, float gain);
+    void SetDucking(int stream, float gain);
+
+    // Starts a period, active_streams has a bit set for every stream with audio in it
+    void Begin(uint32_t active_streams);
+    // Adds samples of the stream from offset in the period
+    void Mix(int stream, const int16_t* pcm, size_t offset, size_t samples);
+    // The mixed period, period_samples() long
+    std::vector<int16_t>& End();
+
+    inline size_t period_samples() const { return period_samples_; }
+
+private:
+    struct Stream {
+        std::atomic<int32_t> gain_q16 = 65536;
+        std::atomic<int32_t> ducking_q16 = 65536;
+        // Gain at the start of the period and its step per sample
+        int32_t start_q16 = 65536;
+        int32_t step_q16 = 0;
+    };
+
+    const int stream_count_;
+    const size_t period_samples_;
+    std::unique_ptr<Stream[]> streams_;
+    std::vector<int32_t> accumulator_;
+    std::vector<int16_t> output_;
+};
+
+#endif // PLAYBACK_MIXER_H
@@ -0,0 +1,57 @@
+#include "preroll_buffer.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <cstring>
+#include <algorithm>
+
+#define TAG "PrerollBuffer"
+
+PrerollBuffer::PrerollBuffer(size_t capacity_frames, int channels)
+    : capacity_frames_(capacity_frames), channels_(channels) {
+    size_t bytes = capacity_frames * channels * sizeof(int16_t);
+    data_ = (int16_t*)heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (data_ == nullptr) {
+        data_ = (int16_t*)heap_caps_malloc(bytes, MALLOC_CAP_8BIT);
+    }
+    if (data_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes", bytes);
+        capacity_frames_ = 0;
+    }
+}
+
+PrerollBuffer::~PrerollBuffer() {
+    heap_caps_free(data_);
+}
+
+void PrerollBuffer::Write(const std::vector<int16_t>& data, int64_t end_time_us) {
+    if (capacity_frames_ == 0) {
+        return;
+    }
+    size_t frames = data.size() / channels_;
+    const int16_t* in = data.data();
+    /* Only the tail of a write longer than the buffer is kept */
+    if (frames > capacity_frames_) {
+        in += (frames - capacity_frames_) * channels_;
+        frames = capacity_frames_;
+    }
+
+    size_t first = std::min(frames, capacity_frames_ - head_);
+    memcpy(data_ + head_ * channels_, in, first * channels_ * sizeof(int16_t));
+    memcpy(data_, in + first * channels_, (frames - first) * channels_ * sizeof(int16_t));
+    head_ = (head_ + frames) % capacity_frames_;
+    frames_ = std::min(frames_ + frames, capacity_frames_);
+    end_time_us_ = end_time_us;
+}
+
+void PrerollBuffer::CopyTail(std::vector<int16_t>& out, size_t frames) const {
+    frames = std::min(frames, frames_);
+    out.resize(frames * channels_);
+    if (frames == 0) {
+        return;
+    }
+    size_t start = (head_ + capacity_frames_ - frames) % capacity_frames_;
+    size_t first = std::min(frames, capacity_frames_ - start);
+    memcpy(out.data(), data_ + start * channels_, first * channels_ * sizeof(int16_t));
+    memcpy(out.data() + first * channels_, data_, (frames - first) * channels_ * sizeof(int16_t));
+}
@@ -0,0 +1,41 @@
+#ifndef PREROLL_BUFFER_H
+#define PREROLL_BUFFER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+/*
+ * The last few hundred milliseconds of the microphone input, kept while the wake word is detected, so that
+ * the start of the utterance can be fed to the audio processor when listening starts.
+ *
+ * Frames are interleaved with the codec input channels (microphone and reference), at 16 kHz.
+ * Only the audio input task uses it. The storage is in PSRAM when there is some.
+ */
+class PrerollBuffer {
+public:
+    PrerollBuffer(size_t capacity_frames, int channels);
+    ~PrerollBuffer();
+
+    PrerollBuffer(const PrerollBuffer&) = delete;
+    PrerollBuffer& operator=(const PrerollBuffer&) = delete;
+
+    // Appends interleaved samples, the last one captured at end_time_us
+    void Write(const std::vector<int16_t>& data, int64_t end_time_us);
+    // Copies the last frames (at most frames()) in capture order
+    void CopyTail(std::vector<int16_t>& out, size_t frames) const;
+
+    inline size_t frames() const { return frames_; }
+    inline int64_t end_time_us() const { return end_time_us_; }
+
+private:
+    int16_t* data_ = nullptr;
+    size_t capacity_frames_;
+    int channels_;
+    // Next frame to write, and the frames held
+    size_t head_ = 0;
+    size_t frames_ = 0;
+    int64_t end_time_us_ = 0;
+};
+
+#endif // PREROLL_BUFFER_H
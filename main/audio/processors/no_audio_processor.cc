@@ -1,43 +1,134 @@
 #include "no_audio_processor.h"
+#include "sample_kernels.h"
 #include <esp_log.h>
+#include <algorithm>
 
 #define TAG "NoAudioProcessor"
 
 void NoAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms, srmodel_list_t* models_list) {
     codec_ = codec;
     frame_samples_ = frame_duration_ms * 16000 / 1000;
+    mono_buffer_.reserve(frame_samples_);
 }
 
-void NoAudioProcessor::Feed(std::vector<int16_t>&& data) {
+void NoAudioProcessor::SetFrameDuration(int frame_duration_ms) {
+    frame_samples_ = frame_duration_ms * 16000 / 1000;
+}
+
+void NoAudioProcessor::Feed(const std::vector<int16_t>& data) {
     if (!is_running_ || !output_callback_) {
         return;
     }
 
+    const std::vector<int16_t>* frame = &data;
     if (codec_->input_channels() == 2) {
         // If input channels is 2, we need to fetch the left channel data
-        auto mono_data = std::vector<int16_t>(data.size() / 2);
-        for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-            mono_data[i] = data[j];
+        mono_buffer_.resize(data.size() / 2);
+        ExtractChannel(data.data(), mono_buffer_.data(), mono_buffer_.size(), 2, 0);
+        frame = &mono_buffer_;
+    }
+
+    if (!DetectVoice(frame->data(), frame->size())) {
+        mono_buffer_.assign(frame->size(), 0);
+        frame = &mono_buffer_;
+    }
+    output_callback_(*frame);
+}
+
+void NoAudioProcessor::ResetVad() {
+    noise_floor_q4_ = 0;
+    speech_ms_ = 0;
+    silence_ms_ = 0;
+    is_speaking_ = false;
+    is_muted_ = false;
+}
+
+bool NoAudioProcessor::DetectVoice(const int16_t* data, size_t samples) {
+    if (samples == 0) {
+        return true;
+    }
+
+    uint64_t sum = 0;
+    int zero_crossings = 0;
+    bool negative = data[0] < 0;
+    for (size_t i = 0; i < samples; i++) {
+        sum += data[i] * data[i];
+        if ((data[i] < 0) != negative) {
+            negative = !negative;
+            zero_crossings++;
         }
-        output_callback_(std::move(mono_data));
+    }
+    uint32_t energy_q4 = (uint32_t)std::min<uint64_t>((sum << 4) / samples, UINT32_MAX);
+    int zcr_per_mille = zero_crossings * 1000 / samples;
+
+    /* The first frame seeds the floor, then it follows the quiet frames down fast and up slowly */
+    uint32_t min_floor_q4 = NO_AUDIO_VAD_MIN_ENERGY << 4;
+    if (noise_floor_q4_ == 0) {
+        noise_floor_q4_ = std::max(energy_q4, min_floor_q4);
+    }
+    uint64_t threshold_q4 = (uint64_t)noise_floor_q4_ * NO_AUDIO_VAD_SPEECH_RATIO;
+    if (zcr_per_mille > NO_AUDIO_VAD_ZCR_PER_MILLE) {
+        threshold_q4 *= NO_AUDIO_VAD_NOISY_RATIO;
+    }
+    bool speech = energy_q4 > threshold_q4;
+
+    if (energy_q4 < noise_floor_q4_) {
+        noise_floor_q4_ -= (noise_floor_q4_ - energy_q4) >> 2;
+    } else if (!speech) {
+        noise_floor_q4_ += (energy_q4 - noise_floor_q4_) >> 5;
+    } else {
+        /* Creep up during speech too, or a step in the background noise would be speech forever */
+        noise_floor_q4_ += (energy_q4 - noise_floor_q4_) >> 10;
+    }
+    noise_floor_q4_ = std::max(noise_floor_q4_, min_floor_q4);
+
+    int frame_ms = samples * 1000 / 16000;
+    if (speech) {
+        speech_ms_ += frame_ms;
+        silence_ms_ = 0;
+        is_muted_ = false;
     } else {
-        output_callback_(std::move(data));
+        speech_ms_ = 0;
+        silence_ms_ += frame_ms;
     }
+
+    if (!is_speaking_ && speech_ms_ >= NO_AUDIO_VAD_ONSET_MS) {
+        is_speaking_ = true;
+        if (vad_state_change_callback_) {
+            vad_state_change_callback_(true);
+        }
+    } else if (silence_ms_ >= NO_AUDIO_VAD_HANGOVER_MS) {
+        is_muted_ = true;
+        if (is_speaking_) {
+            is_speaking_ = false;
+            if (vad_state_change_callback_) {
+                vad_state_change_callback_(false);
+            }
+        }
+    }
+    return !is_muted_;
 }
 
 void NoAudioProcessor::Start() {
+    ResetVad();
     is_running_ = true;
 }
 
 void NoAudioProcessor::Stop() {
     is_running_ = false;
+    if (is_speaking_) {
+        is_speaking_ = false;
+        if (vad_state_change_callback_) {
+            vad_state_change_callback_(false);
+        }
+    }
 }
 
 bool NoAudioProcessor::IsRunning() {
     return is_running_;
 }
 
-void NoAudioProcessor::OnOutput(std::function<void(std::vector<int16_t>&& data)> callback) {
+void NoAudioProcessor::OnOutput(std::function<void(const std::vector<int16_t>& data)> callback) {
     output_callback_ = callback;
 }
 
@@ -7,17 +7,35 @@
 #include "audio_processor.h"
 #include "audio_codec.h"
 
+// A frame is speech when its mean square energy is this many times the noise floor (~9 dB)
+#define NO_AUDIO_VAD_SPEECH_RATIO 8
+// Frames with many zero crossings (hiss, clicks) need this many times more energy
+#define NO_AUDIO_VAD_NOISY_RATIO 4
+// Zero crossings per 1000 samples, above which a frame counts as noisy
+#define NO_AUDIO_VAD_ZCR_PER_MILLE 350
+// The noise floor never goes below this mean square energy (about -70 dBFS)
+#define NO_AUDIO_VAD_MIN_ENERGY 4
+#define NO_AUDIO_VAD_ONSET_MS 60
+#define NO_AUDIO_VAD_HANGOVER_MS 400
+
+/*
+ * Without the AFE, the voice activity is detected from the frame energy and zero-crossing rate against
+ * an adaptive noise floor, in fixed point. Speech starts after NO_AUDIO_VAD_ONSET_MS of speech frames
+ * and ends after NO_AUDIO_VAD_HANGOVER_MS without any. The frames after the end of speech are zeroed,
+ * so that the Opus encoder (DTX) sends them as a few bytes instead of coding the background noise.
+ */
 class NoAudioProcessor : public AudioProcessor {
 public:
     NoAudioProcessor() = default;
     ~NoAudioProcessor() = default;
 
     void Initialize(AudioCodec* codec, int frame_duration_ms, srmodel_list_t* models_list) override;
-    void Feed(std::vector<int16_t>&& data) override;
+    void SetFrameDuration(int frame_duration_ms) override;
+    void Feed(const std::vector<int16_t>& data) override;
     void Start() override;
     void Stop() override;
     bool IsRunning() override;
-    void OnOutput(std::function<void(std::vector<int16_t>&& data)> callback) override;
+    void OnOutput(std::function<void(const std::vector<int16_t>& data)> callback) override;
     void OnVadStateChange(std::function<void(bool speaking)> callback) override;
     size_t GetFeedSize() override;
     void EnableDeviceAec(bool enable) override;
@@ -25,9 +43,22 @@ public:
 private:
     AudioCodec* codec_ = nullptr;
     int frame_samples_ = 0;
-    std::function<void(std::vector<int16_t>&& data)> output_callback_;
+    // Left channel of a stereo input, reused for every frame
+    std::vector<int16_t> mono_buffer_;
+    std::function<void(const std::vector<int16_t>& data)> output_callback_;
     std::function<void(bool speaking)> vad_state_change_callback_;
     bool is_running_ = false;
+
+    // Mean square energy of the background noise, in Q4
+    uint32_t noise_floor_q4_ = 0;
+    int speech_ms_ = 0;
+    int silence_ms_ = 0;
+    bool is_speaking_ = false;
+    bool is_muted_ = false;
+
+    void ResetVad();
+    // Returns false if the frame is background noise after the hangover
+    bool DetectVoice(const int16_t* data, size_t samples);
 };
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,114 @@
+#include "sample_kernels.h"
+
+#include <cstring>
+
+#if defined(__XTENSA__)
+#include <xtensa/config/core-isa.h>
+#endif
+
+static inline int16_t Saturate16(int32_t value) {
+#if defined(__XTENSA__) && XCHAL_HAVE_CLAMPS
+    int32_t result;
+    __asm__("clamps %0, %1, 15" : "=a"(result) : "a"(value));
+    return (int16_t)result;
+#else
+    return value > INT16_MAX ? INT16_MAX : value < INT16_MIN ? INT16_MIN : (int16_t)value;
+#endif
+}
+
+int32_t VolumeToGainQ16(int volume) {
+    if (volume <= 0) {
+        return 0;
+    }
+    if (volume >= 100) {
+        return 65536;
+    }
+    return volume * volume * 65536 / 10000;
+}
+
+int32_t GainToQ8(float gain) {
+    if (gain <= 0) {
+        return 0;
+    }
+    /* 32767 * 65535 still fits in an int32_t */
+    return gain >= 255.0f ? 65535 : (int32_t)(gain * 256.0f + 0.5f);
+}
+
+void ScaleInt16ToInt32(const int16_t* in, int32_t* out, size_t samples, int32_t gain_q16) {
+    /* |in| <= 32768 and gain_q16 <= 65536, so the product always fits */
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        out[i] = in[i] * gain_q16;
+        out[i + 1] = in[i + 1] * gain_q16;
+        out[i + 2] = in[i + 2] * gain_q16;
+        out[i + 3] = in[i + 3] * gain_q16;
+    }
+    for (; i < samples; i++) {
+        out[i] = in[i] * gain_q16;
+    }
+}
+
+void ShiftInt32ToInt16(const int32_t* in, int16_t* out, size_t samples, int shift) {
+    /* Forward only, so that out may alias in */
+    for (size_t i = 0; i < samples; i++) {
+        out[i] = Saturate16(in[i] >> shift);
+    }
+}
+
+void ApplyGainQ8(int16_t* data, size_t samples, int32_t gain_q8) {
+    if (gain_q8 == 256) {
+        return;
+    }
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        data[i] = Saturate16((data[i] * gain_q8) >> 8);
+        data[i + 1] = Saturate16((data[i + 1] * gain_q8) >> 8);
+        data[i + 2] = Saturate16((data[i + 2] * gain_q8) >> 8);
+        data[i + 3] = Saturate16((data[i + 3] * gain_q8) >> 8);
+    }
+    for (; i < samples; i++) {
+        data[i] = Saturate16((data[i] * gain_q8) >> 8);
+    }
+}
+
+void MixInt16ToInt32(const int16_t* in, int32_t* acc, size_t samples, int32_t gain_q16, int32_t step_q16) {
+    /* Like ScaleInt16ToInt32, the product fits while the gain stays at most 1.0 */
+    if (step_q16 == 0) {
+        if (gain_q16 == 65536) {
+            for (size_t i = 0; i < samples; i++) {
+                acc[i] += in[i];
+            }
+            return;
+        }
+        for (size_t i = 0; i < samples; i++) {
+            acc[i] += (in[i] * gain_q16) >> 16;
+        }
+        return;
+    }
+    for (size_t i = 0; i < samples; i++) {
+        acc[i] += (in[i] * gain_q16) >> 16;
+        gain_q16 += step_q16;
+    }
+}
+
+void ExtractChannel(const int16_t* in, int16_t* out, size_t frames, int channels, int channel) {
+    if (channels == 1) {
+        if (out != in) {
+            memmove(out, in, frames * sizeof(int16_t));
+        }
+        return;
+    }
+    /* Stereo frames are read as one 32-bit word each (little endian: left in the low half) */
+    if (channels == 2) {
+        int shift = channel == 0 ? 0 : 16;
+        for (size_t i = 0; i < frames; i++) {
+            uint32_t frame;
+            memcpy(&frame, in + i * 2, sizeof(frame));
+            out[i] = (int16_t)(frame >> shift);
+        }
+        return;
+    }
+    for (size_t i = 0; i < frames; i++) {
+        out[i] = in[i * channels + channel];
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef SAMPLE_KERNELS_H
+#define SAMPLE_KERNELS_H
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Sample format kernels shared by the codecs, the audio service and the processors.
+ *
+ * Every kernel saturates instead of wrapping around, and works in fixed point: gains are computed
+ * once (e.g. when the volume changes) instead of per sample. On Xtensa targets (ESP32, ESP32-S3) the
+ * saturation is a single CLAMPS instruction, the other targets use the portable C++ version.
+ */
+
+// Output volume (0-100) to a Q16 gain on a square curve, at most 1.0
+int32_t VolumeToGainQ16(int volume);
+// Linear gain to Q8, clamped so that a 16-bit sample times the gain fits in 32 bits
+int32_t GainToQ8(float gain);
+
+// out[i] = in[i] * gain_q16, a 16-bit sample scaled into a 32-bit I2S slot (gain_q16 <= 1.0)
+void ScaleInt16ToInt32(const int16_t* in, int32_t* out, size_t samples, int32_t gain_q16);
+// out[i] = saturate(in[i] >> shift), in and out may overlap at the same start address
+void ShiftInt32ToInt16(const int32_t* in, int16_t* out, size_t samples, int shift);
+// data[i] = saturate(data[i] * gain_q8 >> 8)
+void ApplyGainQ8(int16_t* data, size_t samples, int32_t gain_q8);
+// acc[i] += in[i] * gain >> 16, the Q16 gain (at most 1.0) starting at gain_q16 and moving by step_q16 per sample
+void MixInt16ToInt32(const int16_t* in, int32_t* acc, size_t samples, int32_t gain_q16, int32_t step_q16);
+
+// out[i] = in[i * channels + channel], out may be in
+void ExtractChannel(const int16_t* in, int16_t* out, size_t frames, int channels, int channel);
+
+#endif // SAMPLE_KERNELS_H
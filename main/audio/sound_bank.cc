@@ -0,0 +1,290 @@
+#include "sound_bank.h"
+#include "audio_service.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#define TAG "SoundBank"
+
+SoundBank::SoundBank(int output_sample_rate, size_t capacity_bytes)
+    : output_sample_rate_(output_sample_rate), capacity_bytes_(capacity_bytes) {
+}
+
+SoundBank::~SoundBank() {
+    if (!fill_.ogg.empty()) {
+        FinishFill(false);
+    }
+    for (auto& [key, sound] : sounds_) {
+        if (sound.pcm != nullptr) {
+            heap_caps_free(sound.pcm);
+        }
+    }
+}
+
+const CachedSound* SoundBank::Find(const std::string_view& ogg) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = sounds_.find(ogg.data());
+    return it != sounds_.end() && it->second.pcm != nullptr ? &it->second : nullptr;
+}
+
+const OggPacketIndex* SoundBank::GetIndex(const std::string_view& ogg) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto [it, inserted] = indexes_.try_emplace(ogg.data());
+    auto& index = it->second;
+    if (inserted) {
+        OggOpusInfo info;
+        ParseOgg(ogg, info, [&index, &ogg](const uint8_t* data, size_t size) {
+            index.packets.push_back({(uint32_t)((const char*)data - ogg.data()), (uint32_t)size});
+        });
+        index.sample_rate = info.sample_rate;
+        index.granule_position = info.granule_position;
+        index.packets.shrink_to_fit();
+    }
+    return index.packets.empty() ? nullptr : &index;
+}
+
+void SoundBank::Request(const std::string_view& ogg) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (sounds_.find(ogg.data()) != sounds_.end() ||
+            std::find(requests_.begin(), requests_.end(), ogg) != requests_.end()) {
+        return;
+    }
+    requests_.push_back(ogg);
+}
+
+bool SoundBank::Fill() {
+    if (fill_.ogg.empty()) {
+        /* Take the next clip that is not cached yet, its entry stays without PCM while filling */
+        std::unique_lock<std::mutex> lock(mutex_);
+        std::string_view ogg;
+        while (ogg.empty() && !requests_.empty()) {
+            if (sounds_.try_emplace(requests_.front().data()).second) {
+                ogg = requests_.front();
+            }
+            requests_.pop_front();
+        }
+        lock.unlock();
+        if (ogg.empty()) {
+            return false;
+        }
+        if (!StartFill(ogg)) {
+            /* The entry stays without PCM, so the clip is not tried again */
+            return true;
+        }
+    }
+
+    bool ok = FillFrame();
+    if (!ok || fill_.next_packet == fill_.index->packets.size()) {
+        FinishFill(ok);
+    }
+    return true;
+}
+
+bool SoundBank::StartFill(const std::string_view& ogg) {
+    auto index = GetIndex(ogg);
+    if (index == nullptr) {
+        ESP_LOGW(TAG, "Invalid sound clip at %p", ogg.data());
+        return false;
+    }
+
+    /* Allocate once from the length in the last granule position, plus one frame for the resampler */
+    size_t output_frame_samples = output_sample_rate_ / 1000 * SOUND_FRAME_DURATION_MS;
+    size_t max_samples = index->granule_position > 0 ?
+        (size_t)(index->granule_position * output_sample_rate_ / 48000) :
+        index->packets.size() * output_frame_samples;
+    max_samples += output_frame_samples;
+
+    /* Reserve the room up front, the clip is filled over many decoder task loops */
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (used_bytes_ + max_samples * sizeof(int16_t) > capacity_bytes_) {
+        ESP_LOGW(TAG, "No room for sound clip at %p (%u bytes, %u / %u used)", ogg.data(),
+            max_samples * sizeof(int16_t), used_bytes_, capacity_bytes_);
+        return false;
+    }
+    used_bytes_ += max_samples * sizeof(int16_t);
+    lock.unlock();
+
+    fill_.ogg = ogg;
+    fill_.index = index;
+    fill_.next_packet = 0;
+    fill_.samples = 0;
+    fill_.max_samples = max_samples;
+    fill_.pcm = (int16_t*)heap_caps_malloc(max_samples * sizeof(int16_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+
+    /* A private decoder, so that the stream decoder state is left alone */
+    esp_opus_dec_cfg_t opus_dec_cfg = OPUS_DEC_CFG(index->sample_rate, SOUND_FRAME_DURATION_MS);
+    esp_opus_dec_open(&opus_dec_cfg, sizeof(esp_opus_dec_cfg_t), &fill_.decoder);
+    if (index->sample_rate != output_sample_rate_) {
+        esp_ae_rate_cvt_cfg_t resampler_cfg = RATE_CVT_CFG(index->sample_rate, output_sample_rate_, ESP_AUDIO_MONO);
+        esp_ae_rate_cvt_open(&resampler_cfg, &fill_.resampler);
+    }
+    if (fill_.pcm == nullptr || fill_.decoder == nullptr ||
+            (index->sample_rate != output_sample_rate_ && fill_.resampler == nullptr)) {
+        FinishFill(false);
+        return false;
+    }
+    fill_.frame.resize(index->sample_rate / 1000 * SOUND_FRAME_DURATION_MS);
+    return true;
+}
+
+bool SoundBank::FillFrame() {
+    auto& packet = fill_.index->packets[fill_.next_packet++];
+    esp_audio_dec_in_raw_t raw = {
+        .buffer = (uint8_t *)(fill_.ogg.data() + packet.offset),
+        .len = packet.size,
+        .consumed = 0,
+        .frame_recover = ESP_AUDIO_DEC_RECOVERY_NONE,
+    };
+    esp_audio_dec_out_frame_t out_frame = {
+        .buffer = (uint8_t *)fill_.frame.data(),
+        .len = (uint32_t)(fill_.frame.size() * sizeof(int16_t)),
+        .decoded_size = 0,
+    };
+    esp_audio_dec_info_t dec_info = {};
+    auto ret = esp_opus_dec_decode(fill_.decoder, &raw, &out_frame, &dec_info);
+    if (ret != ESP_AUDIO_ERR_OK) {
+        ESP_LOGE(TAG, "Failed to decode sound clip at %p, error code: %d", raw.buffer, ret);
+        return false;
+    }
+
+    uint32_t decoded = out_frame.decoded_size / sizeof(int16_t);
+    if (fill_.resampler != nullptr) {
+        uint32_t target_size = 0;
+        esp_ae_rate_cvt_get_max_out_sample_num(fill_.resampler, decoded, &target_size);
+        if (fill_.samples + target_size > fill_.max_samples) {
+            return true;
+        }
+        uint32_t actual_output = target_size;
+        esp_ae_rate_cvt_process(fill_.resampler, (esp_ae_sample_t)fill_.frame.data(), decoded,
+                                (esp_ae_sample_t)(fill_.pcm + fill_.samples), &actual_output);
+        fill_.samples += actual_output;
+    } else {
+        decoded = std::min<uint32_t>(decoded, fill_.max_samples - fill_.samples);
+        memcpy(fill_.pcm + fill_.samples, fill_.frame.data(), decoded * sizeof(int16_t));
+        fill_.samples += decoded;
+    }
+    return true;
+}
+
+void SoundBank::FinishFill(bool ok) {
+    if (fill_.decoder != nullptr) {
+        esp_opus_dec_close(fill_.decoder);
+    }
+    if (fill_.resampler != nullptr) {
+        esp_ae_rate_cvt_close(fill_.resampler);
+    }
+
+    CachedSound sound;
+    if (ok && fill_.samples > 0) {
+        /* Give back the spare room */
+        auto shrunk = (int16_t*)heap_caps_realloc(fill_.pcm, fill_.samples * sizeof(int16_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        sound.pcm = shrunk != nullptr ? shrunk : fill_.pcm;
+        sound.samples = fill_.samples;
+        sound.sample_rate = output_sample_rate_;
+    } else if (fill_.pcm != nullptr) {
+        heap_caps_free(fill_.pcm);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    used_bytes_ -= (fill_.max_samples - sound.samples) * sizeof(int16_t);
+    if (sound.pcm != nullptr) {
+        /* Map entries do not move, Find() sees the clip from now on */
+        sounds_[fill_.ogg.data()] = sound;
+        ESP_LOGI(TAG, "Cached sound clip at %p: %u ms, %u bytes (%u / %u used)", fill_.ogg.data(),
+            sound.samples * 1000 / output_sample_rate_, sound.samples * sizeof(int16_t), used_bytes_, capacity_bytes_);
+    }
+    fill_ = FillState();
+}
+
+bool SoundBank::ParseOgg(const std::string_view& ogg, OggOpusInfo& info,
+        const std::function<void(const uint8_t* data, size_t size)>& on_packet) {
+    const uint8_t* buf = reinterpret_cast<const uint8_t*>(ogg.data());
+    size_t size = ogg.size();
+    size_t offset = 0;
+
+    auto find_page = [&](size_t start)->size_t {
+        for (size_t i = start; i + 4 <= size; ++i) {
+            if (buf[i] == 'O' && buf[i+1] == 'g' && buf[i+2] == 'g' && buf[i+3] == 'S') return i;
+        }
+        return static_cast<size_t>(-1);
+    };
+
+    bool seen_head = false;
+    bool seen_tags = false;
+    info.packets = 0;
+
+    while (true) {
+        size_t pos = find_page(offset);
+        if (pos == static_cast<size_t>(-1)) break;
+        offset = pos;
+        if (offset + 27 > size) break;
+
+        const uint8_t* page = buf + offset;
+        uint8_t page_segments = page[26];
+        size_t seg_table_off = offset + 27;
+        if (seg_table_off + page_segments > size) break;
+
+        size_t body_size = 0;
+        for (size_t i = 0; i < page_segments; ++i) body_size += page[27 + i];
+
+        size_t body_off = seg_table_off + page_segments;
+        if (body_off + body_size > size) break;
+
+        // Granule position (little-endian), -1 when no packet ends on this page
+        uint64_t granule = 0;
+        for (int i = 7; i >= 0; --i) granule = (granule << 8) | page[6 + i];
+        if (seen_tags && granule != UINT64_MAX) {
+            info.granule_position = granule;
+        }
+
+        // Parse packets using lacing
+        size_t cur = body_off;
+        size_t seg_idx = 0;
+        while (seg_idx < page_segments) {
+            size_t pkt_len = 0;
+            size_t pkt_start = cur;
+            bool continued = false;
+            do {
+                uint8_t l = page[27 + seg_idx++];
+                pkt_len += l;
+                cur += l;
+                continued = (l == 255);
+            } while (continued && seg_idx < page_segments);
+
+            if (pkt_len == 0) continue;
+            const uint8_t* pkt_ptr = buf + pkt_start;
+
+            if (!seen_head) {
+                // 解析OpusHead包
+                if (pkt_len >= 19 && std::memcmp(pkt_ptr, "OpusHead", 8) == 0) {
+                    seen_head = true;
+                    // OpusHead结构：[0-7] "OpusHead", [8] version, [9] channel_count, [10-11] pre_skip
+                    // [12-15] input_sample_rate, [16-17] output_gain, [18] mapping_family
+                    // 读取输入采样率 (little-endian)
+                    info.sample_rate = pkt_ptr[12] | (pkt_ptr[13] << 8) |
+                                       (pkt_ptr[14] << 16) | (pkt_ptr[15] << 24);
+                }
+                continue;
+            }
+            if (!seen_tags) {
+                // Expect OpusTags in second packet
+                if (pkt_len >= 8 && std::memcmp(pkt_ptr, "OpusTags", 8) == 0) {
+                    seen_tags = true;
+                }
+                continue;
+            }
+
+            // Audio packet (Opus)
+            info.packets++;
+            if (on_packet) {
+                on_packet(pkt_ptr, pkt_len);
+            }
+        }
+
+        offset = body_off + body_size;
+    }
+    return seen_head;
+}
@@ -0,0 +1,110 @@
+#ifndef SOUND_BANK_H
+#define SOUND_BANK_H
+
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <functional>
+#include <string_view>
+#include <vector>
+
+#include "esp_ae_rate_cvt.h"
+
+// The sound clips are encoded with 60 ms frames
+#define SOUND_FRAME_DURATION_MS 60
+
+// What the Ogg pages tell about an Opus stream
+struct OggOpusInfo {
+    int sample_rate = 16000;
+    size_t packets = 0;
+    // Granule position of the last page, i.e. the stream length in 48 kHz samples (pre-skip included)
+    uint64_t granule_position = 0;
+};
+
+// A sound clip decoded at the codec output sample rate
+struct CachedSound {
+    int16_t* pcm = nullptr;
+    size_t samples = 0;
+    int sample_rate = 0;
+};
+
+// Where the Opus packets of a clip are, so that it can be played without walking the Ogg pages again
+struct OggPacketIndex {
+    struct Packet {
+        uint32_t offset;
+        uint32_t size;
+    };
+    int sample_rate = 16000;
+    // As in OggOpusInfo, 0 if no page told it
+    uint64_t granule_position = 0;
+    std::vector<Packet> packets;
+};
+
+/*
+ * Decodes the Ogg Opus sound clips once into PSRAM, at the codec output sample rate, so that
+ * a clip can be played again without going through the Opus decoder.
+ *
+ * Clips are keyed by their address, so they must outlive the bank (Lang::Sounds are embedded in
+ * the firmware). A clip that can not be cached (no PSRAM, capacity exceeded, broken stream) is
+ * remembered as such, and Request() ignores it from then on, so it is never decoded again.
+ * Such clips are streamed through the decoder instead, with a packet index built once by GetIndex().
+ *
+ * Clips are queued with Request(), at preload or after a streamed play, and the decoder task caches
+ * them with Fill(), one frame at a time while it is idle. PlaySound() uses Find(), which never decodes.
+ * The bank mutex is not held while decoding.
+ */
+class SoundBank {
+public:
+    SoundBank(int output_sample_rate, size_t capacity_bytes);
+    ~SoundBank();
+
+    SoundBank(const SoundBank&) = delete;
+    SoundBank& operator=(const SoundBank&) = delete;
+
+    // Any task, nullptr unless the clip is already decoded
+    const CachedSound* Find(const std::string_view& ogg);
+    // Any task, nullptr if the clip is not an Ogg Opus stream
+    const OggPacketIndex* GetIndex(const std::string_view& ogg);
+    // Any task, queues the clip for Fill() unless it is already cached or failed
+    void Request(const std::string_view& ogg);
+    // Decoder task, decodes one frame of the requested clips, false when there is nothing left to fill
+    bool Fill();
+
+    size_t used_bytes() const { return used_bytes_; }
+
+    // Walks the Ogg pages, calling on_packet (if any) for every audio packet after OpusHead / OpusTags
+    static bool ParseOgg(const std::string_view& ogg, OggOpusInfo& info,
+        const std::function<void(const uint8_t* data, size_t size)>& on_packet = nullptr);
+
+private:
+    const int output_sample_rate_;
+    const size_t capacity_bytes_;
+    size_t used_bytes_ = 0;
+    std::mutex mutex_;
+    std::map<const char*, CachedSound> sounds_;
+    std::map<const char*, OggPacketIndex> indexes_;
+    std::deque<std::string_view> requests_;
+
+    // The clip being cached by Fill(), only used by the decoder task
+    struct FillState {
+        std::string_view ogg;
+        const OggPacketIndex* index = nullptr;
+        size_t next_packet = 0;
+        void* decoder = nullptr;
+        esp_ae_rate_cvt_handle_t resampler = nullptr;
+        int16_t* pcm = nullptr;
+        size_t samples = 0;
+        // Samples reserved in used_bytes_ for the clip
+        size_t max_samples = 0;
+        std::vector<int16_t> frame;
+    };
+    FillState fill_;
+
+    bool StartFill(const std::string_view& ogg);
+    bool FillFrame();
+    void FinishFill(bool ok);
+};
+
+#endif // SOUND_BANK_H
@@ -0,0 +1,136 @@
+#ifndef SPSC_RING_BUFFER_H
+#define SPSC_RING_BUFFER_H
+
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+/*
+ * Bounded single-producer / single-consumer ring buffer.
+ *
+ * Push() may only be called from one producer task and Pop() from one consumer task at a time;
+ * neither side takes a lock. Waking up the other side is left to the owner (see AudioService),
+ * so every hop can notify exactly the task that is waiting on it.
+ *
+ * Clear() may be called from any task. It does not touch the slots itself, it only marks
+ * everything pushed so far as discarded. Pop() returns nothing while a discard is pending, so the
+ * caller of Clear() must wake the consumer, which then calls DropDiscarded() to release the slots.
+ *
+ * SetLimit() lowers the number of items Push() accepts without reallocating, e.g. to keep a queue
+ * bounded in milliseconds when the frame duration changes.
+ */
+template <typename T>
+class SpscRingBuffer {
+public:
+    explicit SpscRingBuffer(size_t capacity)
+        : capacity_(capacity), mask_(RoundUpToPowerOfTwo(capacity) - 1), slots_(new T[mask_ + 1]), limit_(capacity) {
+    }
+
+    SpscRingBuffer(const SpscRingBuffer&) = delete;
+    SpscRingBuffer& operator=(const SpscRingBuffer&) = delete;
+
+    inline size_t capacity() const { return capacity_; }
+    inline size_t limit() const { return limit_.load(std::memory_order_relaxed); }
+
+    // Any task, clamped to the capacity given at construction
+    void SetLimit(size_t limit) {
+        limit_.store(std::min(limit, capacity_), std::memory_order_relaxed);
+    }
+
+    // Producer side
+    bool Push(T&& item) {
+        uint32_t write = write_.load(std::memory_order_relaxed);
+        uint32_t read = read_.load(std::memory_order_acquire);
+        if (write - read >= limit()) {
+            return false;
+        }
+        slots_[write & mask_] = std::move(item);
+        write_.store(write + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side
+    bool Pop(T& item) {
+        uint32_t read = read_.load(std::memory_order_relaxed);
+        uint32_t write = write_.load(std::memory_order_acquire);
+        if (read == write || IsPending(read, write, discard_until_.load(std::memory_order_acquire))) {
+            return false;
+        }
+        item = std::move(slots_[read & mask_]);
+        read_.store(read + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side, returns the number of items released since the last Clear()
+    size_t DropDiscarded() {
+        return DropDiscarded([](T&&) {});
+    }
+
+    // Same as above, but hands every discarded item to release() (e.g. to recycle it into a pool)
+    template <typename Release>
+    size_t DropDiscarded(Release&& release) {
+        uint32_t read = read_.load(std::memory_order_relaxed);
+        uint32_t discard = discard_until_.load(std::memory_order_acquire);
+        if (!IsPending(read, write_.load(std::memory_order_acquire), discard)) {
+            return 0;
+        }
+        size_t dropped = discard - read;
+        while (read != discard) {
+            release(std::move(slots_[read & mask_]));
+            slots_[read & mask_] = T();
+            read++;
+        }
+        read_.store(read, std::memory_order_release);
+        return dropped;
+    }
+
+    // Any task
+    void Clear() {
+        discard_until_.store(write_.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+    size_t Size() const {
+        uint32_t read = read_.load(std::memory_order_acquire);
+        uint32_t write = write_.load(std::memory_order_acquire);
+        uint32_t discard = discard_until_.load(std::memory_order_acquire);
+        if (IsPending(read, write, discard)) {
+            read = discard;
+        }
+        return write - read;
+    }
+
+    inline bool Empty() const { return Size() == 0; }
+
+    // Only the producer's view is exact: items pending discard still occupy their slots
+    inline bool Full() const {
+        return write_.load(std::memory_order_acquire) - read_.load(std::memory_order_acquire) >= limit();
+    }
+
+private:
+    const size_t capacity_;
+    // Slots are rounded up to a power of two so that indices stay consistent when the counters wrap
+    const uint32_t mask_;
+    std::unique_ptr<T[]> slots_;
+    std::atomic<size_t> limit_;
+    std::atomic<uint32_t> write_{0};
+    std::atomic<uint32_t> read_{0};
+    std::atomic<uint32_t> discard_until_{0};
+
+    static uint32_t RoundUpToPowerOfTwo(size_t value) {
+        uint32_t result = 1;
+        while (result < value) {
+            result <<= 1;
+        }
+        return result;
+    }
+
+    // A discard mark is pending if it lies in (read, write]; older marks are ignored
+    static inline bool IsPending(uint32_t read, uint32_t write, uint32_t discard) {
+        uint32_t distance = discard - read;
+        return distance != 0 && distance <= write - read;
+    }
+};
+
+#endif // SPSC_RING_BUFFER_H
@@ -1,4 +1,5 @@
 #include "esp_wake_word.h"
+#include "sample_kernels.h"
 #include <esp_log.h>
 
 
@@ -41,6 +42,10 @@ bool EspWakeWord::Initialize(AudioCodec* codec, srmodel_list_t* models_list) {
     int audio_chunksize = wakenet_iface_->get_samp_chunksize(wakenet_data_);
     ESP_LOGI(TAG, "Wake word(%s),freq: %d, chunksize: %d", model_name, frequency, audio_chunksize);
 
+#if CONFIG_SEND_WAKE_WORD_DATA
+    mono_buffer_.reserve(audio_chunksize);
+    wake_word_encoder_.Initialize();
+#endif
     return true;
 }
 
@@ -49,6 +54,7 @@ void EspWakeWord::OnWakeWordDetected(std::function<void(const std::string& wake_
 }
 
 void EspWakeWord::Start() {
+    wake_word_encoder_.Clear();
     running_ = true;
 }
 
@@ -61,6 +67,16 @@ void EspWakeWord::Feed(const std::vector<int16_t>& data) {
         return;
     }
 
+#if CONFIG_SEND_WAKE_WORD_DATA
+    if (codec_->input_channels() == 2) {
+        mono_buffer_.resize(data.size() / 2);
+        ExtractChannel(data.data(), mono_buffer_.data(), mono_buffer_.size(), 2, 0);
+        wake_word_encoder_.Feed(mono_buffer_.data(), mono_buffer_.size());
+    } else {
+        wake_word_encoder_.Feed(data.data(), data.size());
+    }
+#endif
+
     int res = wakenet_iface_->detect(wakenet_data_, (int16_t *)data.data());
     if (res > 0) {
         last_detected_wake_word_ = wakenet_iface_->get_word_name(wakenet_data_, res);
@@ -80,8 +96,9 @@ size_t EspWakeWord::GetFeedSize() {
 }
 
 void EspWakeWord::EncodeWakeWordData() {
+    wake_word_encoder_.Snapshot();
 }
 
 bool EspWakeWord::GetWakeWordOpus(std::vector<uint8_t>& opus) {
-    return false;
+    return wake_word_encoder_.GetOpus(opus);
 }
@@ -12,6 +12,7 @@
 
 #include "audio_codec.h"
 #include "wake_word.h"
+#include "wake_word_encoder.h"
 
 class EspWakeWord : public WakeWord {
 public:
@@ -37,6 +38,10 @@ private:
 
     std::function<void(const std::string& wake_word)> wake_word_detected_callback_;
     std::string last_detected_wake_word_;
+    // Left channel of a stereo input, only used by the audio input task
+    std::vector<int16_t> mono_buffer_;
+    // Keeps the detected audio encoded, for the server
+    WakeWordEncoder wake_word_encoder_;
 };
 
 #endif
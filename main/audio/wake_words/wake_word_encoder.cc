@@ -0,0 +1,247 @@
+#include "wake_word_encoder.h"
+#include "audio_service.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <cstring>
+#include <algorithm>
+
+#define TAG "WakeWordEncoder"
+
+WakeWordEncoder::WakeWordEncoder() {
+    event_group_ = xEventGroupCreate();
+}
+
+WakeWordEncoder::~WakeWordEncoder() {
+    if (encode_task_ != nullptr) {
+        running_ = false;
+        xTaskNotifyGive(encode_task_);
+        xEventGroupWaitBits(event_group_, WAKE_WORD_ENCODER_EXITED_EVENT, pdFALSE, pdTRUE, portMAX_DELAY);
+    }
+    if (encode_task_stack_ != nullptr) {
+        heap_caps_free(encode_task_stack_);
+    }
+    if (encode_task_buffer_ != nullptr) {
+        heap_caps_free(encode_task_buffer_);
+    }
+    heap_caps_free(history_);
+    vEventGroupDelete(event_group_);
+}
+
+bool WakeWordEncoder::Initialize() {
+    if (encode_task_ != nullptr) {
+        return true;
+    }
+    frame_samples_ = 16000 / 1000 * OPUS_FRAME_DURATION_MS;
+    pending_pcm_.reserve(frame_samples_ * WAKE_WORD_ENCODER_MAX_PENDING_FRAMES);
+
+    /* PSRAM first, boards without it (ESP wake word) fall back to the internal RAM */
+    history_max_packets_ = CONFIG_WAKE_WORD_HISTORY_MS / OPUS_FRAME_DURATION_MS;
+    history_capacity_ = (size_t)CONFIG_WAKE_WORD_HISTORY_MS * WAKE_WORD_HISTORY_MAX_BITRATE / 8000 +
+        history_max_packets_ * WAKE_WORD_HISTORY_HEADER_SIZE;
+    history_ = (uint8_t*)heap_caps_malloc(history_capacity_, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (history_ == nullptr) {
+        history_ = (uint8_t*)heap_caps_malloc(history_capacity_, MALLOC_CAP_8BIT);
+    }
+    encode_task_stack_ = (StackType_t*)heap_caps_malloc(WAKE_WORD_ENCODER_STACK_SIZE, MALLOC_CAP_SPIRAM);
+    if (encode_task_stack_ == nullptr) {
+        encode_task_stack_ = (StackType_t*)heap_caps_malloc(WAKE_WORD_ENCODER_STACK_SIZE, MALLOC_CAP_INTERNAL);
+    }
+    encode_task_buffer_ = (StaticTask_t*)heap_caps_malloc(sizeof(StaticTask_t), MALLOC_CAP_INTERNAL);
+    if (history_ == nullptr || encode_task_stack_ == nullptr || encode_task_buffer_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate the encoder task and the history");
+        return false;
+    }
+    encode_task_ = xTaskCreateStatic([](void* arg) {
+        auto this_ = (WakeWordEncoder*)arg;
+        this_->EncodeTask();
+        xEventGroupSetBits(this_->event_group_, WAKE_WORD_ENCODER_EXITED_EVENT);
+        vTaskDelete(NULL);
+    }, "encode_wake_word", WAKE_WORD_ENCODER_STACK_SIZE, this, 2, encode_task_stack_, encode_task_buffer_);
+    return true;
+}
+
+void WakeWordEncoder::Feed(const int16_t* data, size_t samples) {
+    if (encode_task_ == nullptr) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(pcm_mutex_);
+        size_t capacity = pending_pcm_.capacity();
+        if (samples > capacity) {
+            data += samples - capacity;
+            samples = capacity;
+        }
+        if (pending_pcm_.size() + samples > capacity) {
+            /* The encoder fell behind, the history gets a gap instead of the detection waiting */
+            pending_pcm_.erase(pending_pcm_.begin(), pending_pcm_.begin() + (pending_pcm_.size() + samples - capacity));
+        }
+        pending_pcm_.insert(pending_pcm_.end(), data, data + samples);
+        if (pending_pcm_.size() < frame_samples_) {
+            return;
+        }
+    }
+    xTaskNotifyGive(encode_task_);
+}
+
+void WakeWordEncoder::Clear() {
+    {
+        std::lock_guard<std::mutex> lock(pcm_mutex_);
+        pending_pcm_.clear();
+        generation_++;
+    }
+    std::lock_guard<std::mutex> lock(opus_mutex_);
+    ClearHistory();
+    snapshot_.clear();
+}
+
+void WakeWordEncoder::Snapshot() {
+    {
+        std::lock_guard<std::mutex> lock(opus_mutex_);
+        snapshot_.clear();
+        snapshot_time_us_ = esp_timer_get_time();
+    }
+    snapshot_requested_ = true;
+    if (encode_task_ != nullptr) {
+        xTaskNotifyGive(encode_task_);
+    } else {
+        std::lock_guard<std::mutex> lock(opus_mutex_);
+        snapshot_.emplace_back();
+        opus_cv_.notify_all();
+    }
+}
+
+bool WakeWordEncoder::GetOpus(std::vector<uint8_t>& opus) {
+    std::unique_lock<std::mutex> lock(opus_mutex_);
+    opus_cv_.wait(lock, [this]() {
+        return !snapshot_.empty();
+    });
+    opus.swap(snapshot_.front());
+    snapshot_.pop_front();
+    return !opus.empty();
+}
+
+void WakeWordEncoder::EncodeTask() {
+    esp_opus_enc_config_t opus_enc_cfg = AS_OPUS_ENC_CONFIG();
+    void* encoder_handle = nullptr;
+    auto ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &encoder_handle);
+    if (encoder_handle == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", ret);
+    }
+    int frame_size = 0;
+    int outbuf_size = 0;
+    if (encoder_handle != nullptr) {
+        esp_opus_enc_get_frame_size(encoder_handle, &frame_size, &outbuf_size);
+    }
+    std::vector<int16_t> frame(frame_samples_);
+    std::vector<uint8_t> packet(outbuf_size);
+
+    while (running_) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        /* Encode every whole frame fed so far, the snapshot must hold the end of the wake word */
+        while (running_) {
+            uint32_t generation;
+            {
+                std::lock_guard<std::mutex> lock(pcm_mutex_);
+                if (pending_pcm_.size() < frame_samples_) {
+                    break;
+                }
+                memcpy(frame.data(), pending_pcm_.data(), frame_samples_ * sizeof(int16_t));
+                pending_pcm_.erase(pending_pcm_.begin(), pending_pcm_.begin() + frame_samples_);
+                generation = generation_;
+            }
+            if (encoder_handle == nullptr) {
+                continue;
+            }
+
+            esp_audio_enc_in_frame_t in = {
+                .buffer = (uint8_t*)frame.data(),
+                .len = (uint32_t)frame_size,
+            };
+            esp_audio_enc_out_frame_t out = {
+                .buffer = packet.data(),
+                .len = (uint32_t)outbuf_size,
+            };
+            ret = esp_opus_enc_process(encoder_handle, &in, &out);
+            if (ret != ESP_AUDIO_ERR_OK) {
+                ESP_LOGE(TAG, "Failed to encode audio, error code: %d", ret);
+                continue;
+            }
+
+            std::lock_guard<std::mutex> pcm_lock(pcm_mutex_);
+            if (generation == generation_) {
+                std::lock_guard<std::mutex> lock(opus_mutex_);
+                PushHistory(packet.data(), out.encoded_bytes);
+            }
+        }
+
+        if (snapshot_requested_.exchange(false)) {
+            std::lock_guard<std::mutex> lock(opus_mutex_);
+            while (history_packets_ > 0) {
+                size_t size = OldestSize();
+                auto& snapshot_packet = snapshot_.emplace_back(size);
+                CopyFromHistory(history_head_ + WAKE_WORD_HISTORY_HEADER_SIZE, snapshot_packet.data(), size);
+                DropOldest();
+            }
+            ESP_LOGI(TAG, "Wake word opus: %u packets ready in %ld ms", snapshot_.size(),
+                (long)((esp_timer_get_time() - snapshot_time_us_) / 1000));
+            snapshot_.emplace_back();
+            opus_cv_.notify_all();
+        }
+    }
+
+    if (encoder_handle != nullptr) {
+        esp_opus_enc_close(encoder_handle);
+    }
+}
+
+void WakeWordEncoder::PushHistory(const uint8_t* packet, size_t size) {
+    size_t needed = WAKE_WORD_HISTORY_HEADER_SIZE + size;
+    if (history_ == nullptr || needed > history_capacity_) {
+        return;
+    }
+    while (history_packets_ >= history_max_packets_ || history_bytes_ + needed > history_capacity_) {
+        DropOldest();
+    }
+    size_t tail = history_head_ + history_bytes_;
+    uint8_t header[WAKE_WORD_HISTORY_HEADER_SIZE] = { (uint8_t)(size & 0xFF), (uint8_t)(size >> 8) };
+    CopyToHistory(tail, header, sizeof(header));
+    CopyToHistory(tail + sizeof(header), packet, size);
+    history_bytes_ += needed;
+    history_packets_++;
+}
+
+size_t WakeWordEncoder::OldestSize() const {
+    uint8_t header[WAKE_WORD_HISTORY_HEADER_SIZE];
+    CopyFromHistory(history_head_, header, sizeof(header));
+    return header[0] | (header[1] << 8);
+}
+
+void WakeWordEncoder::DropOldest() {
+    size_t size = WAKE_WORD_HISTORY_HEADER_SIZE + OldestSize();
+    history_head_ = (history_head_ + size) % history_capacity_;
+    history_bytes_ -= size;
+    history_packets_--;
+}
+
+void WakeWordEncoder::CopyToHistory(size_t offset, const uint8_t* data, size_t size) {
+    offset %= history_capacity_;
+    size_t first = std::min(size, history_capacity_ - offset);
+    memcpy(history_ + offset, data, first);
+    memcpy(history_, data + first, size - first);
+}
+
+void WakeWordEncoder::CopyFromHistory(size_t offset, uint8_t* out, size_t size) const {
+    offset %= history_capacity_;
+    size_t first = std::min(size, history_capacity_ - offset);
+    memcpy(out, history_ + offset, first);
+    memcpy(out + first, history_, size - first);
+}
+
+void WakeWordEncoder::ClearHistory() {
+    history_head_ = 0;
+    history_bytes_ = 0;
+    history_packets_ = 0;
+}
@@ -0,0 +1,88 @@
+#ifndef WAKE_WORD_ENCODER_H
+#define WAKE_WORD_ENCODER_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/event_groups.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#define WAKE_WORD_ENCODER_EXITED_EVENT (1 << 0)
+#define WAKE_WORD_ENCODER_STACK_SIZE (4096 * 7)
+// The history ring is sized for this bitrate, older packets are dropped early if it is exceeded
+#define WAKE_WORD_HISTORY_MAX_BITRATE 32000
+// Every packet in the history ring is prefixed with its 16-bit length
+#define WAKE_WORD_HISTORY_HEADER_SIZE 2
+// PCM waiting for the encoder task, the oldest is dropped if it falls behind
+#define WAKE_WORD_ENCODER_MAX_PENDING_FRAMES 4
+
+/*
+ * Encodes the wake word input to Opus while the detection runs, one frame at a time in a low priority task,
+ * and keeps the last CONFIG_WAKE_WORD_HISTORY_MS of packets. When the wake word is detected, Snapshot() hands
+ * over the history as it is, so the packets can be sent at once instead of after encoding two seconds of PCM.
+ * Used by every wake word implementation.
+ *
+ * Feed() is called by the detection, the other methods by the application. The history is a ring of
+ * length-prefixed packets allocated once (in PSRAM when there is some), so the idle detection does not
+ * allocate: only the snapshot copies the packets out.
+ */
+class WakeWordEncoder {
+public:
+    WakeWordEncoder();
+    ~WakeWordEncoder();
+
+    // Opens the encoder and starts its task
+    bool Initialize();
+    // 16 kHz mono
+    void Feed(const int16_t* data, size_t samples);
+    // Drops the history, when the detection starts again
+    void Clear();
+    // The history up to the last fed sample becomes the wake word packets
+    void Snapshot();
+    // Waits for the next wake word packet, false after the last one
+    bool GetOpus(std::vector<uint8_t>& opus);
+
+private:
+    EventGroupHandle_t event_group_;
+    TaskHandle_t encode_task_ = nullptr;
+    StaticTask_t* encode_task_buffer_ = nullptr;
+    StackType_t* encode_task_stack_ = nullptr;
+    std::atomic<bool> running_ = true;
+
+    std::mutex pcm_mutex_;
+    std::vector<int16_t> pending_pcm_;
+    // Bumped by Clear(), a frame taken before is not kept
+    uint32_t generation_ = 0;
+    size_t frame_samples_ = 0;
+
+    std::mutex opus_mutex_;
+    std::condition_variable opus_cv_;
+    uint8_t* history_ = nullptr;
+    size_t history_capacity_ = 0;
+    // Oldest packet, bytes and packets held
+    size_t history_head_ = 0;
+    size_t history_bytes_ = 0;
+    size_t history_packets_ = 0;
+    size_t history_max_packets_ = 0;
+    // The snapshot, ended by an empty packet
+    std::deque<std::vector<uint8_t>> snapshot_;
+    std::atomic<bool> snapshot_requested_ = false;
+    int64_t snapshot_time_us_ = 0;
+
+    void EncodeTask();
+    // Called with opus_mutex_ held
+    void PushHistory(const uint8_t* packet, size_t size);
+    // Size of the oldest packet
+    size_t OldestSize() const;
+    void DropOldest();
+    void CopyToHistory(size_t offset, const uint8_t* data, size_t size);
+    void CopyFromHistory(size_t offset, uint8_t* out, size_t size) const;
+    void ClearHistory();
+};
+
+#endif // WAKE_WORD_ENCODER_H
@@ -148,6 +148,37 @@ void McpServer::AddUserOnlyTools() {
             return true;
         });
 
+    // Audio
+    AddUserOnlyTool("self.audio.set_frame_duration",
+        "Set the Opus frame duration of the uplink audio in milliseconds (20, 40 or 60). "
+        "Shorter frames reduce latency but use more bandwidth. The current conversation is closed to apply it.",
+        PropertyList({
+            Property("frame_duration", kPropertyTypeInteger, 20, 60)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& app = Application::GetInstance();
+            if (!app.SetFrameDuration(properties["frame_duration"].value<int>())) {
+                throw std::runtime_error("Frame duration must be 20, 40 or 60");
+            }
+            return true;
+        });
+
+    AddUserOnlyTool("self.audio.get_latency",
+        "Get the audio latency percentiles (p50 / p90 / p99 / max, in milliseconds) of every pipeline stage, "
+        "measured from the time a frame was captured (uplink) or received from the server (downlink). "
+        "Set `reset` to start a new measurement after reading.",
+        PropertyList({
+            Property("reset", kPropertyTypeBoolean, false)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& tracer = Application::GetInstance().GetAudioService().latency_tracer();
+            cJSON* json = tracer.ToJson();
+            if (properties["reset"].value<bool>()) {
+                tracer.Reset();
+            }
+            return json;
+        });
+
     // Firmware upgrade
     AddUserOnlyTool("self.upgrade_firmware", "Upgrade firmware from a specific URL. This will download and install the firmware, then reboot the device.",
         PropertyList({
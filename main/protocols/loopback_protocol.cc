@@ -0,0 +1,234 @@
+#include "loopback_protocol.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_random.h>
+#include <cstring>
+#include <algorithm>
+
+#define TAG "Loopback"
+
+LoopbackProtocol::LoopbackProtocol() {
+    event_group_handle_ = xEventGroupCreate();
+    server_sample_rate_ = LOOPBACK_SAMPLE_RATE;
+
+    xTaskCreate([](void* arg) {
+        auto protocol = (LoopbackProtocol*)arg;
+        protocol->ResponseTask();
+        xEventGroupSetBits(protocol->event_group_handle_, LOOPBACK_PROTOCOL_TASK_EXITED_EVENT);
+        vTaskDelete(NULL);
+    }, "loopback_response", 4096, this, 4, &response_task_);
+}
+
+LoopbackProtocol::~LoopbackProtocol() {
+    running_ = false;
+    response_generation_++;
+    xTaskNotifyGive(response_task_);
+    xEventGroupWaitBits(event_group_handle_, LOOPBACK_PROTOCOL_TASK_EXITED_EVENT, pdFALSE, pdTRUE, portMAX_DELAY);
+    vEventGroupDelete(event_group_handle_);
+}
+
+bool LoopbackProtocol::Start() {
+    ESP_LOGI(TAG, "Loopback protocol: delay %d ms, jitter %d ms, loss %d%%", CONFIG_LOOPBACK_RESPONSE_DELAY_MS,
+        CONFIG_LOOPBACK_JITTER_MS, CONFIG_LOOPBACK_LOSS_PERCENT);
+    if (on_connected_ != nullptr) {
+        on_connected_();
+    }
+    return true;
+}
+
+bool LoopbackProtocol::OpenAudioChannel() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        error_occurred_ = false;
+        session_id_ = "loopback";
+        multi_frame_ = false;
+        utterance_.clear();
+        utterance_ms_ = 0;
+        listening_ = false;
+        response_generation_++;
+    }
+    xTaskNotifyGive(response_task_);
+    last_incoming_time_ = std::chrono::steady_clock::now();
+    channel_opened_ = true;
+
+    if (on_audio_channel_opened_ != nullptr) {
+        on_audio_channel_opened_();
+    }
+    return true;
+}
+
+void LoopbackProtocol::CloseAudioChannel() {
+    channel_opened_ = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        utterance_.clear();
+        utterance_ms_ = 0;
+        listening_ = false;
+        response_generation_++;
+    }
+    xTaskNotifyGive(response_task_);
+
+    if (on_audio_channel_closed_ != nullptr) {
+        on_audio_channel_closed_();
+    }
+}
+
+bool LoopbackProtocol::IsAudioChannelOpened() const {
+    return channel_opened_ && !error_occurred_;
+}
+
+bool LoopbackProtocol::SendAudio(AudioStreamPacket& packet) {
+    if (!channel_opened_) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    /* The realtime mode keeps sending while the response plays, that is not a new utterance */
+    if (responding_ || utterance_ms_ + packet.frame_duration > LOOPBACK_MAX_UTTERANCE_MS) {
+        return true;
+    }
+    frame_duration_ = packet.frame_duration;
+    utterance_.emplace_back(packet.payload(), packet.payload() + packet.payload_size());
+    utterance_ms_ += packet.frame_duration;
+
+    /* Where a server would detect the end of speech */
+    if (listening_ && listening_mode_ != kListeningModeManualStop && utterance_ms_ >= CONFIG_LOOPBACK_UTTERANCE_MS) {
+        StartResponse();
+    }
+    return true;
+}
+
+bool LoopbackProtocol::SendText(const std::string& text) {
+    if (!channel_opened_) {
+        return false;
+    }
+
+    cJSON* root = cJSON_Parse(text.c_str());
+    if (root == nullptr) {
+        ESP_LOGE(TAG, "Failed to parse message: %s", text.c_str());
+        return false;
+    }
+    auto type = cJSON_GetObjectItem(root, "type");
+    auto state = cJSON_GetObjectItem(root, "state");
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (cJSON_IsString(type) && strcmp(type->valuestring, "listen") == 0 && cJSON_IsString(state)) {
+        if (strcmp(state->valuestring, "start") == 0) {
+            auto mode = cJSON_GetObjectItem(root, "mode");
+            if (cJSON_IsString(mode) && strcmp(mode->valuestring, "realtime") == 0) {
+                listening_mode_ = kListeningModeRealtime;
+            } else if (cJSON_IsString(mode) && strcmp(mode->valuestring, "manual") == 0) {
+                listening_mode_ = kListeningModeManualStop;
+            } else {
+                listening_mode_ = kListeningModeAutoStop;
+            }
+            listening_ = true;
+        } else if (strcmp(state->valuestring, "stop") == 0 || strcmp(state->valuestring, "detect") == 0) {
+            /* The end of an utterance, or the wake word audio sent before the detection */
+            listening_ = false;
+            if (!responding_ && !utterance_.empty()) {
+                StartResponse();
+            }
+        }
+    } else if (cJSON_IsString(type) && strcmp(type->valuestring, "abort") == 0) {
+        response_generation_++;
+        xTaskNotifyGive(response_task_);
+    }
+    cJSON_Delete(root);
+    return true;
+}
+
+// Called with mutex_ held
+void LoopbackProtocol::StartResponse() {
+    response_.swap(utterance_);
+    utterance_.clear();
+    utterance_ms_ = 0;
+    responding_ = true;
+    xTaskNotifyGive(response_task_);
+}
+
+void LoopbackProtocol::SendJson(const std::string& json) {
+    last_incoming_time_ = std::chrono::steady_clock::now();
+    cJSON* root = cJSON_Parse(json.c_str());
+    if (root != nullptr && on_incoming_json_ != nullptr) {
+        on_incoming_json_(root);
+    }
+    cJSON_Delete(root);
+}
+
+bool LoopbackProtocol::WaitUntil(int64_t time_us, uint32_t generation) {
+    while (running_ && response_generation_ == generation) {
+        int64_t wait_us = time_us - esp_timer_get_time();
+        if (wait_us <= 0) {
+            return true;
+        }
+        ulTaskNotifyTake(pdTRUE, std::max<TickType_t>(1, pdMS_TO_TICKS(wait_us / 1000)));
+    }
+    return false;
+}
+
+void LoopbackProtocol::ResponseTask() {
+    /* The timestamps keep running across responses, like those of a server stream */
+    uint32_t timestamp = 0;
+    std::vector<std::vector<uint8_t>> frames;
+    struct ScheduledFrame {
+        int64_t due_us;
+        uint32_t index;
+    };
+    std::vector<ScheduledFrame> schedule;
+
+    while (running_) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!responding_) {
+            continue;
+        }
+        frames.swap(response_);
+        response_.clear();
+        int frame_duration = frame_duration_;
+        uint32_t generation = response_generation_;
+        lock.unlock();
+
+        int64_t start_time = esp_timer_get_time() + CONFIG_LOOPBACK_RESPONSE_DELAY_MS * 1000LL;
+        if (WaitUntil(start_time, generation)) {
+            SendJson("{\"session_id\":\"" + session_id_ + "\",\"type\":\"stt\",\"text\":\"Loopback " +
+                std::to_string(frames.size() * frame_duration) + " ms\"}");
+            SendJson("{\"session_id\":\"" + session_id_ + "\",\"type\":\"tts\",\"state\":\"start\"}");
+
+            /* Lost frames are never sent, the others are sent in the order of their jittered send time */
+            schedule.clear();
+            for (uint32_t i = 0; i < frames.size(); i++) {
+                if (CONFIG_LOOPBACK_LOSS_PERCENT > 0 && esp_random() % 100 < CONFIG_LOOPBACK_LOSS_PERCENT) {
+                    continue;
+                }
+                int64_t jitter_us = CONFIG_LOOPBACK_JITTER_MS > 0 ? esp_random() % (CONFIG_LOOPBACK_JITTER_MS * 1000 + 1) : 0;
+                schedule.push_back({start_time + (int64_t)i * frame_duration * 1000 + jitter_us, i});
+            }
+            std::stable_sort(schedule.begin(), schedule.end(), [](const ScheduledFrame& a, const ScheduledFrame& b) {
+                return a.due_us < b.due_us;
+            });
+
+            for (auto& scheduled : schedule) {
+                if (!WaitUntil(scheduled.due_us, generation)) {
+                    break;
+                }
+                auto& frame = frames[scheduled.index];
+                auto packet = AllocateAudioPacket();
+                packet->sample_rate = LOOPBACK_SAMPLE_RATE;
+                packet->frame_duration = frame_duration;
+                packet->timestamp = timestamp + (scheduled.index + 1) * frame_duration;
+                packet->lost_frames = 0;
+                packet->AssignPayload(frame.data(), frame.size());
+                last_incoming_time_ = std::chrono::steady_clock::now();
+                DispatchIncomingAudio(std::move(packet));
+            }
+            /* An aborted response is stopped too */
+            SendJson("{\"session_id\":\"" + session_id_ + "\",\"type\":\"tts\",\"state\":\"stop\"}");
+        }
+        timestamp += frames.size() * frame_duration;
+        frames.clear();
+
+        lock.lock();
+        responding_ = false;
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef _LOOPBACK_PROTOCOL_H_
+#define _LOOPBACK_PROTOCOL_H_
+
+
+#include "protocol.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/event_groups.h>
+
+#include <mutex>
+#include <atomic>
+#include <vector>
+
+#define LOOPBACK_PROTOCOL_TASK_EXITED_EVENT (1 << 0)
+
+// The uplink audio kept for one response, more is dropped
+#define LOOPBACK_MAX_UTTERANCE_MS 10000
+#define LOOPBACK_SAMPLE_RATE 16000
+
+/*
+ * A stand-in for the server that runs in the device, to exercise whole conversations without a network,
+ * e.g. with FileAudioCodec under the linux target.
+ *
+ * The uplink audio of an utterance is echoed back as the TTS response, framed like a server would:
+ * stt, tts start, the Opus frames paced in real time, tts stop. An utterance ends when the device stops
+ * listening, or after LOOPBACK_UTTERANCE_MS in the auto / realtime modes, where the server would run VAD.
+ * A wake word detection is answered with an echo of the wake word audio sent before it.
+ *
+ * The response starts after LOOPBACK_RESPONSE_DELAY_MS, and every frame may be delayed by up to
+ * LOOPBACK_JITTER_MS (frames may be reordered) or dropped with LOOPBACK_LOSS_PERCENT, to exercise the
+ * jitter buffer and the loss concealment. Frames carry timestamps, as with protocol version 2.
+ */
+class LoopbackProtocol : public Protocol {
+public:
+    LoopbackProtocol();
+    ~LoopbackProtocol();
+
+    bool Start() override;
+    bool SendAudio(AudioStreamPacket& packet) override;
+    bool OpenAudioChannel() override;
+    void CloseAudioChannel() override;
+    bool IsAudioChannelOpened() const override;
+
+private:
+    EventGroupHandle_t event_group_handle_;
+    TaskHandle_t response_task_ = nullptr;
+    std::atomic<bool> running_ = true;
+    std::atomic<bool> channel_opened_ = false;
+
+    std::mutex mutex_;
+    ListeningMode listening_mode_ = kListeningModeAutoStop;
+    // The frames of the current utterance, and of the one being answered
+    std::vector<std::vector<uint8_t>> utterance_;
+    std::vector<std::vector<uint8_t>> response_;
+    int utterance_ms_ = 0;
+    int frame_duration_ = 0;
+    bool listening_ = false;
+    bool responding_ = false;
+    // Bumped to stop the response being sent (abort, new session)
+    std::atomic<uint32_t> response_generation_ = 0;
+
+    bool SendText(const std::string& text) override;
+    // Called with mutex_ held
+    void StartResponse();
+    void ResponseTask();
+    void SendJson(const std::string& json);
+    // Sleeps until the time, false if the response was stopped meanwhile
+    bool WaitUntil(int64_t time_us, uint32_t generation);
+};
+
+#endif
@@ -5,6 +5,7 @@
 
 #include <esp_log.h>
 #include <cstring>
+#include <algorithm>
 #include <arpa/inet.h>
 #include "assets/lang_config.h"
 
@@ -31,6 +32,18 @@ MqttProtocol::MqttProtocol() {
         .arg = this,
     };
     esp_timer_create(&reconnect_timer_args, &reconnect_timer_);
+
+    // Releases the held UDP packets once the missing one is given up
+    esp_timer_create_args_t reorder_timer_args = {
+        .callback = [](void* arg) {
+            MqttProtocol* protocol = (MqttProtocol*)arg;
+            std::lock_guard<std::mutex> lock(protocol->reorder_mutex_);
+            protocol->FlushReorderWindow(true);
+        },
+        .arg = this,
+        .name = "udp_reorder",
+    };
+    esp_timer_create(&reorder_timer_args, &reorder_timer_);
 }
 
 MqttProtocol::~MqttProtocol() {
@@ -43,6 +56,10 @@ MqttProtocol::~MqttProtocol() {
         esp_timer_stop(reconnect_timer_);
         esp_timer_delete(reconnect_timer_);
     }
+    if (reorder_timer_ != nullptr) {
+        esp_timer_stop(reorder_timer_);
+        esp_timer_delete(reorder_timer_);
+    }
 
     udp_.reset();
     mqtt_.reset();
@@ -162,30 +179,20 @@ bool MqttProtocol::SendText(const std::string& text) {
     return true;
 }
 
-bool MqttProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
+bool MqttProtocol::SendAudio(AudioStreamPacket& packet) {
     std::lock_guard<std::mutex> lock(channel_mutex_);
     if (udp_ == nullptr) {
         return false;
     }
 
-    std::string nonce(aes_nonce_);
-    *(uint16_t*)&nonce[2] = htons(packet->payload.size());
-    *(uint32_t*)&nonce[8] = htonl(packet->timestamp);
-    *(uint32_t*)&nonce[12] = htonl(++local_sequence_);
-
-    std::string encrypted;
-    encrypted.resize(aes_nonce_.size() + packet->payload.size());
-    memcpy(encrypted.data(), nonce.data(), nonce.size());
-
-    size_t nc_off = 0;
-    uint8_t stream_block[16] = {0};
-    if (mbedtls_aes_crypt_ctr(&aes_ctx_, packet->payload.size(), &nc_off, (uint8_t*)nonce.c_str(), stream_block,
-        (uint8_t*)packet->payload.data(), (uint8_t*)&encrypted[nonce.size()]) != 0) {
+    /* Build the datagram in the reused TX buffer: header, then the payload encrypted straight behind it */
+    if (!EncryptUdpAudio(aes_ctx_, aes_nonce_, packet.timestamp, ++local_sequence_, packet.payload(),
+            packet.payload_size(), udp_tx_buffer_)) {
         ESP_LOGE(TAG, "Failed to encrypt audio data");
         return false;
     }
 
-    return udp_->Send(encrypted) > 0;
+    return udp_->Send(udp_tx_buffer_) > 0;
 }
 
 void MqttProtocol::CloseAudioChannel() {
@@ -193,6 +200,7 @@ void MqttProtocol::CloseAudioChannel() {
         std::lock_guard<std::mutex> lock(channel_mutex_);
         udp_.reset();
     }
+    ResetReorderWindow();
 
     std::string message = "{";
     message += "\"session_id\":\"" + session_id_ + "\",";
@@ -239,7 +247,7 @@ bool MqttProtocol::OpenAudioChannel() {
          * |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|
          * |payload payload_len|
          */
-        if (data.size() < sizeof(aes_nonce_)) {
+        if (data.size() < MQTT_UDP_HEADER_SIZE) {
             ESP_LOGE(TAG, "Invalid audio packet size: %u", data.size());
             return;
         }
@@ -249,33 +257,19 @@ bool MqttProtocol::OpenAudioChannel() {
         }
         uint32_t timestamp = ntohl(*(uint32_t*)&data[8]);
         uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
-        if (sequence < remote_sequence_) {
-            ESP_LOGW(TAG, "Received audio packet with old sequence: %lu, expected: %lu", sequence, remote_sequence_);
-            return;
-        }
-        if (sequence != remote_sequence_ + 1) {
-            ESP_LOGW(TAG, "Received audio packet with wrong sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
-        }
 
-        size_t decrypted_size = data.size() - aes_nonce_.size();
-        size_t nc_off = 0;
-        uint8_t stream_block[16] = {0};
-        auto nonce = (uint8_t*)data.data();
-        auto encrypted = (uint8_t*)data.data() + aes_nonce_.size();
-        auto packet = std::make_unique<AudioStreamPacket>();
+        /* Decrypt straight into the pooled packet */
+        auto packet = AllocateAudioPacket();
         packet->sample_rate = server_sample_rate_;
         packet->frame_duration = server_frame_duration_;
         packet->timestamp = timestamp;
-        packet->payload.resize(decrypted_size);
-        int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, nonce, stream_block, encrypted, (uint8_t*)packet->payload.data());
-        if (ret != 0) {
-            ESP_LOGE(TAG, "Failed to decrypt audio data, ret: %d", ret);
+        packet->ResizePayload(data.size() - MQTT_UDP_HEADER_SIZE);
+        if (!DecryptUdpAudio(aes_ctx_, (const uint8_t*)data.data(), data.size(), packet->payload())) {
+            ESP_LOGE(TAG, "Failed to decrypt audio data");
+            ReleaseAudioPacket(std::move(packet));
             return;
         }
-        if (on_incoming_audio_ != nullptr) {
-            on_incoming_audio_(std::move(packet));
-        }
-        remote_sequence_ = sequence;
+        ReceiveAudioPacket(sequence, std::move(packet));
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
@@ -294,16 +288,14 @@ std::string MqttProtocol::GetHelloMessage() {
     cJSON_AddNumberToObject(root, "version", 3);
     cJSON_AddStringToObject(root, "transport", "udp");
     cJSON* features = cJSON_CreateObject();
-#if CONFIG_USE_SERVER_AEC
-    cJSON_AddBoolToObject(features, "aec", true);
-#endif
-    cJSON_AddBoolToObject(features, "mcp", true);
+    AddClientFeatures(features);
     cJSON_AddItemToObject(root, "features", features);
     cJSON* audio_params = cJSON_CreateObject();
     cJSON_AddStringToObject(audio_params, "format", "opus");
     cJSON_AddNumberToObject(audio_params, "sample_rate", 16000);
     cJSON_AddNumberToObject(audio_params, "channels", 1);
-    cJSON_AddNumberToObject(audio_params, "frame_duration", OPUS_FRAME_DURATION_MS);
+    cJSON_AddNumberToObject(audio_params, "frame_duration", Application::GetInstance().GetAudioService().frame_duration());
+    AddOutputSampleRates(audio_params);
     cJSON_AddItemToObject(root, "audio_params", audio_params);
     auto json_str = cJSON_PrintUnformatted(root);
     std::string message(json_str);
@@ -330,13 +322,14 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
     if (cJSON_IsObject(audio_params)) {
         auto sample_rate = cJSON_GetObjectItem(audio_params, "sample_rate");
         if (cJSON_IsNumber(sample_rate)) {
-            server_sample_rate_ = sample_rate->valueint;
+            SetServerSampleRate(sample_rate->valueint);
         }
         auto frame_duration = cJSON_GetObjectItem(audio_params, "frame_duration");
         if (cJSON_IsNumber(frame_duration)) {
             server_frame_duration_ = frame_duration->valueint;
         }
     }
+    ParseServerFeatures(root);
 
     auto udp = cJSON_GetObjectItem(root, "udp");
     if (!cJSON_IsObject(udp)) {
@@ -354,10 +347,103 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
     mbedtls_aes_init(&aes_ctx_);
     mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)DecodeHexString(key).c_str(), 128);
     local_sequence_ = 0;
-    remote_sequence_ = 0;
+    ResetReorderWindow();
     xEventGroupSetBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 }
 
+void MqttProtocol::ReceiveAudioPacket(uint32_t sequence, std::unique_ptr<AudioStreamPacket> packet) {
+    std::lock_guard<std::mutex> lock(reorder_mutex_);
+    udp_statistics_.received++;
+    if (remote_sequence_ == 0) {
+        // The first packet of the channel opens the window
+        remote_sequence_ = sequence - 1;
+    }
+
+    int32_t distance = (int32_t)(sequence - remote_sequence_);
+    if (distance <= 0) {
+        udp_statistics_.duplicates++;
+        ReleaseAudioPacket(std::move(packet));
+        return;
+    }
+    if (distance == 1) {
+        if (reorder_pending_ > 0) {
+            udp_statistics_.reordered++;
+        }
+        DeliverAudioPacket(sequence, std::move(packet));
+        FlushReorderWindow(false);
+        return;
+    }
+    if (distance > MQTT_UDP_REORDER_WINDOW) {
+        // Too far ahead to keep waiting for the missing packets
+        ESP_LOGW(TAG, "Audio packet sequence jumped from %lu to %lu", remote_sequence_, sequence);
+        FlushReorderWindow(true);
+        DeliverAudioPacket(sequence, std::move(packet));
+        return;
+    }
+
+    auto& slot = reorder_slots_[sequence % MQTT_UDP_REORDER_WINDOW];
+    if (slot != nullptr) {
+        udp_statistics_.duplicates++;
+        ReleaseAudioPacket(std::move(packet));
+        return;
+    }
+    slot = std::move(packet);
+    if (reorder_pending_++ == 0) {
+        esp_timer_start_once(reorder_timer_, MQTT_UDP_REORDER_HOLD_MS * 1000);
+    }
+}
+
+// Called with reorder_mutex_ held
+void MqttProtocol::FlushReorderWindow(bool skip_gaps) {
+    while (reorder_pending_ > 0) {
+        uint32_t sequence = remote_sequence_ + 1;
+        if (reorder_slots_[sequence % MQTT_UDP_REORDER_WINDOW] == nullptr) {
+            if (!skip_gaps) {
+                break;
+            }
+            while (reorder_slots_[sequence % MQTT_UDP_REORDER_WINDOW] == nullptr) {
+                sequence++;
+            }
+        }
+        auto packet = std::move(reorder_slots_[sequence % MQTT_UDP_REORDER_WINDOW]);
+        reorder_pending_--;
+        DeliverAudioPacket(sequence, std::move(packet));
+    }
+
+    // The hold time restarts for the next gap
+    esp_timer_stop(reorder_timer_);
+    if (reorder_pending_ > 0) {
+        esp_timer_start_once(reorder_timer_, MQTT_UDP_REORDER_HOLD_MS * 1000);
+    }
+}
+
+// Called with reorder_mutex_ held
+void MqttProtocol::DeliverAudioPacket(uint32_t sequence, std::unique_ptr<AudioStreamPacket> packet) {
+    uint32_t lost = sequence - remote_sequence_ - 1;
+    udp_statistics_.lost += lost;
+    remote_sequence_ = sequence;
+    packet->lost_frames = (uint16_t)std::min<uint32_t>(lost, UINT16_MAX);
+    /* Released back to the pool there when nobody listens */
+    DispatchIncomingAudio(std::move(packet));
+}
+
+void MqttProtocol::ResetReorderWindow() {
+    std::lock_guard<std::mutex> lock(reorder_mutex_);
+    esp_timer_stop(reorder_timer_);
+    for (auto& slot : reorder_slots_) {
+        if (slot != nullptr) {
+            ReleaseAudioPacket(std::move(slot));
+        }
+    }
+    reorder_pending_ = 0;
+    remote_sequence_ = 0;
+    if (udp_statistics_.received > 0) {
+        ESP_LOGI(TAG, "UDP audio: received %lu, lost %lu, reordered %lu, duplicates %lu", udp_statistics_.received,
+            udp_statistics_.lost, udp_statistics_.reordered, udp_statistics_.duplicates);
+    }
+    udp_statistics_ = UdpAudioStatistics();
+}
+
 static const char hex_chars[] = "0123456789ABCDEF";
 // 辅助函数，将单个十六进制字符转换为对应的数值
 static inline uint8_t CharToHex(char c) {
@@ -3,6 +3,7 @@
 
 
 #include "protocol.h"
+#include "udp_audio_crypto.h"
 #include <mqtt.h>
 #include <udp.h>
 #include <cJSON.h>
@@ -17,19 +18,32 @@
 #include <mutex>
 #include <memory>
 #include <atomic>
+#include <array>
 
 #define MQTT_PING_INTERVAL_SECONDS 90
 #define MQTT_RECONNECT_INTERVAL_MS 60000
 
 #define MQTT_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
 
+// Out-of-order UDP audio packets are held for at most this long while a missing one is awaited
+#define MQTT_UDP_REORDER_WINDOW 8
+#define MQTT_UDP_REORDER_HOLD_MS 60
+
+struct UdpAudioStatistics {
+    uint32_t received = 0;
+    uint32_t lost = 0;
+    uint32_t reordered = 0;
+    // Also counts the packets that arrived after they were given up as lost
+    uint32_t duplicates = 0;
+};
+
 class MqttProtocol : public Protocol {
 public:
     MqttProtocol();
     ~MqttProtocol();
 
     bool Start() override;
-    bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) override;
+    bool SendAudio(AudioStreamPacket& packet) override;
     bool OpenAudioChannel() override;
     void CloseAudioChannel() override;
     bool IsAudioChannelOpened() const override;
@@ -47,15 +61,28 @@ private:
     std::unique_ptr<Udp> udp_;
     mbedtls_aes_context aes_ctx_;
     std::string aes_nonce_;
+    // Reused for every outgoing datagram, guarded by channel_mutex_
+    std::string udp_tx_buffer_;
     std::string udp_server_;
     int udp_port_;
     uint32_t local_sequence_;
     uint32_t remote_sequence_;
     esp_timer_handle_t reconnect_timer_;
 
+    // Receive window keyed on the sequence number, slot = sequence % MQTT_UDP_REORDER_WINDOW
+    std::mutex reorder_mutex_;
+    std::array<std::unique_ptr<AudioStreamPacket>, MQTT_UDP_REORDER_WINDOW> reorder_slots_;
+    size_t reorder_pending_ = 0;
+    esp_timer_handle_t reorder_timer_ = nullptr;
+    UdpAudioStatistics udp_statistics_;
+
     bool StartMqttClient(bool report_error=false);
     void ParseServerHello(const cJSON* root);
     std::string DecodeHexString(const std::string& hex_string);
+    void ReceiveAudioPacket(uint32_t sequence, std::unique_ptr<AudioStreamPacket> packet);
+    void FlushReorderWindow(bool skip_gaps);
+    void DeliverAudioPacket(uint32_t sequence, std::unique_ptr<AudioStreamPacket> packet);
+    void ResetReorderWindow();
 
     bool SendText(const std::string& text) override;
     std::string GetHelloMessage();
@@ -1,6 +1,9 @@
 #include "protocol.h"
 
 #include <esp_log.h>
+#include <cstring>
+#include <algorithm>
+#include <arpa/inet.h>
 
 #define TAG "Protocol"
 
@@ -12,6 +15,14 @@ void Protocol::OnIncomingAudio(std::function<void(std::unique_ptr<AudioStreamPac
     on_incoming_audio_ = callback;
 }
 
+void Protocol::OnAllocateAudioPacket(std::function<std::unique_ptr<AudioStreamPacket>()> callback) {
+    on_allocate_audio_packet_ = callback;
+}
+
+void Protocol::OnReleaseAudioPacket(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> callback) {
+    on_release_audio_packet_ = callback;
+}
+
 void Protocol::OnAudioChannelOpened(std::function<void()> callback) {
     on_audio_channel_opened_ = callback;
 }
@@ -32,6 +43,154 @@ void Protocol::OnDisconnected(std::function<void()> callback) {
     on_disconnected_ = callback;
 }
 
+std::unique_ptr<AudioStreamPacket> Protocol::AllocateAudioPacket() {
+    if (on_allocate_audio_packet_ != nullptr) {
+        return on_allocate_audio_packet_();
+    }
+    return std::make_unique<AudioStreamPacket>();
+}
+
+void Protocol::ReleaseAudioPacket(std::unique_ptr<AudioStreamPacket> packet) {
+    if (on_release_audio_packet_ != nullptr) {
+        on_release_audio_packet_(std::move(packet));
+    }
+}
+
+void Protocol::AddClientFeatures(cJSON* features) {
+#if CONFIG_USE_SERVER_AEC
+    cJSON_AddBoolToObject(features, "aec", true);
+#endif
+    cJSON_AddBoolToObject(features, "mcp", true);
+#if CONFIG_AUDIO_FRAME_AGGREGATION_MS > 0
+    cJSON_AddBoolToObject(features, "multi_frame", true);
+#endif
+}
+
+void Protocol::ParseServerFeatures(const cJSON* root) {
+    multi_frame_ = false;
+#if CONFIG_AUDIO_FRAME_AGGREGATION_MS > 0
+    auto features = cJSON_GetObjectItem(root, "features");
+    if (cJSON_IsObject(features)) {
+        multi_frame_ = cJSON_IsTrue(cJSON_GetObjectItem(features, "multi_frame"));
+    }
+#endif
+    ESP_LOGI(TAG, "Multi-frame audio messages: %s", multi_frame_ ? "enabled" : "disabled");
+}
+
+void Protocol::SetOutputSampleRates(const std::vector<int>& rates) {
+    output_sample_rates_ = rates;
+}
+
+void Protocol::AddOutputSampleRates(cJSON* audio_params) {
+    if (output_sample_rates_.empty()) {
+        return;
+    }
+    cJSON_AddItemToObject(audio_params, "output_sample_rates",
+        cJSON_CreateIntArray(output_sample_rates_.data(), (int)output_sample_rates_.size()));
+}
+
+void Protocol::SetServerSampleRate(int sample_rate) {
+    if (!IS_OPUS_SAMPLE_RATE(sample_rate)) {
+        ESP_LOGW(TAG, "Unsupported server sample rate %d, keeping %d", sample_rate, server_sample_rate_);
+        return;
+    }
+    server_sample_rate_ = sample_rate;
+}
+
+/*
+ * Multi-frame message payload: |length 2u|opus length|length 2u|opus length|...
+ * The message header (timestamp) describes the first frame.
+ */
+bool Protocol::SendAudioFrames(std::vector<std::unique_ptr<AudioStreamPacket>>& packets) {
+    if (packets.empty()) {
+        return true;
+    }
+    if (!multi_frame_) {
+        for (auto& packet : packets) {
+            if (!SendAudio(*packet)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    auto& message = multi_frame_packet_;
+    message.sample_rate = packets.front()->sample_rate;
+    message.timestamp = packets.front()->timestamp;
+    message.frame_duration = 0;
+    message.lost_frames = 0;
+    message.ResizePayload(0);
+    for (auto& packet : packets) {
+        uint16_t length = htons(packet->payload_size());
+        message.buffer.insert(message.buffer.end(), (uint8_t*)&length, (uint8_t*)&length + sizeof(length));
+        message.buffer.insert(message.buffer.end(), packet->payload(), packet->payload() + packet->payload_size());
+        message.frame_duration += packet->frame_duration;
+    }
+    return SendAudio(message);
+}
+
+void Protocol::DispatchIncomingAudio(std::unique_ptr<AudioStreamPacket> packet) {
+    if (on_incoming_audio_ == nullptr) {
+        ReleaseAudioPacket(std::move(packet));
+        return;
+    }
+    if (!multi_frame_) {
+        on_incoming_audio_(std::move(packet));
+        return;
+    }
+
+    /*
+     * Copy out the frames after the first one, then shrink the message packet to its first frame.
+     * The length prefixes are read byte by byte: after an odd frame length they are not 16-bit aligned.
+     */
+    const uint8_t* data = packet->payload();
+    size_t size = packet->payload_size();
+    if (size < sizeof(uint16_t)) {
+        ESP_LOGE(TAG, "Invalid multi-frame message size: %u", size);
+        ReleaseAudioPacket(std::move(packet));
+        return;
+    }
+    size_t first_length = (data[0] << 8) | data[1];
+    size_t offset = sizeof(uint16_t) + first_length;
+    if (offset > size) {
+        ESP_LOGE(TAG, "Invalid multi-frame length: %u, message size: %u", first_length, size);
+        ReleaseAudioPacket(std::move(packet));
+        return;
+    }
+
+    auto& frames = incoming_frames_;
+    uint32_t timestamp = packet->timestamp;
+    while (offset + sizeof(uint16_t) <= size) {
+        size_t length = (data[offset] << 8) | data[offset + 1];
+        offset += sizeof(uint16_t);
+        if (offset + length > size) {
+            ESP_LOGE(TAG, "Invalid multi-frame length: %u, message size: %u", length, size);
+            break;
+        }
+        auto frame = AllocateAudioPacket();
+        frame->sample_rate = packet->sample_rate;
+        frame->frame_duration = packet->frame_duration;
+        if (timestamp != 0) {
+            timestamp += packet->frame_duration;
+        }
+        frame->timestamp = timestamp;
+        frame->lost_frames = 0;
+        frame->AssignPayload(data + offset, length);
+        frames.push_back(std::move(frame));
+        offset += length;
+    }
+
+    /* A lost message held as many frames as this one */
+    packet->lost_frames = std::min<uint32_t>(packet->lost_frames * (frames.size() + 1), UINT16_MAX);
+    memmove(packet->payload(), data + sizeof(uint16_t), first_length);
+    packet->ResizePayload(first_length);
+    on_incoming_audio_(std::move(packet));
+    for (auto& frame : frames) {
+        on_incoming_audio_(std::move(frame));
+    }
+    frames.clear();
+}
+
 void Protocol::SetError(const std::string& message) {
     error_occurred_ = true;
     if (on_network_error_ != nullptr) {
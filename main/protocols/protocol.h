@@ -6,12 +6,33 @@
 #include <functional>
 #include <chrono>
 #include <vector>
+#include <memory>
+
+// Spare bytes in front of every audio payload, so that transports can write their header in place
+#define AUDIO_PACKET_HEADROOM 16
+// The Opus decoder outputs any stream at these rates
+#define IS_OPUS_SAMPLE_RATE(rate) ((rate) == 8000 || (rate) == 12000 || (rate) == 16000 || (rate) == 24000 || (rate) == 48000)
 
 struct AudioStreamPacket {
     int sample_rate = 0;
     int frame_duration = 0;
     uint32_t timestamp = 0;
-    std::vector<uint8_t> payload;
+    // Packets lost right before this one, as detected by the transport
+    uint16_t lost_frames = 0;
+    // When the frame entered the device (esp_timer), for the audio latency tracer, 0 if not traced
+    int64_t trace_time_us = 0;
+    // AUDIO_PACKET_HEADROOM bytes followed by the Opus payload, use the accessors below
+    std::vector<uint8_t> buffer = std::vector<uint8_t>(AUDIO_PACKET_HEADROOM);
+
+    inline uint8_t* payload() { return buffer.data() + AUDIO_PACKET_HEADROOM; }
+    inline const uint8_t* payload() const { return buffer.data() + AUDIO_PACKET_HEADROOM; }
+    inline size_t payload_size() const { return buffer.size() - AUDIO_PACKET_HEADROOM; }
+    inline void ResizePayload(size_t size) { buffer.resize(AUDIO_PACKET_HEADROOM + size); }
+    inline void ReservePayload(size_t size) { buffer.reserve(AUDIO_PACKET_HEADROOM + size); }
+    inline void AssignPayload(const uint8_t* data, size_t size) {
+        buffer.resize(AUDIO_PACKET_HEADROOM);
+        buffer.insert(buffer.end(), data, data + size);
+    }
 };
 
 struct BinaryProtocol2 {
@@ -54,20 +75,31 @@ public:
     inline const std::string& session_id() const {
         return session_id_;
     }
+    // True when the server accepted multi-frame audio messages in its hello
+    inline bool multi_frame() const {
+        return multi_frame_;
+    }
 
     void OnIncomingAudio(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> callback);
+    void OnAllocateAudioPacket(std::function<std::unique_ptr<AudioStreamPacket>()> callback);
+    void OnReleaseAudioPacket(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> callback);
     void OnIncomingJson(std::function<void(const cJSON* root)> callback);
     void OnAudioChannelOpened(std::function<void()> callback);
     void OnAudioChannelClosed(std::function<void()> callback);
     void OnNetworkError(std::function<void(const std::string& message)> callback);
     void OnConnected(std::function<void()> callback);
     void OnDisconnected(std::function<void()> callback);
+    // The downlink sample rates the device prefers, best first, offered in the hello. Set before Start()
+    void SetOutputSampleRates(const std::vector<int>& rates);
 
     virtual bool Start() = 0;
     virtual bool OpenAudioChannel() = 0;
     virtual void CloseAudioChannel() = 0;
     virtual bool IsAudioChannelOpened() const = 0;
-    virtual bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) = 0;
+    // The transport may write its header into the headroom of the packet
+    virtual bool SendAudio(AudioStreamPacket& packet) = 0;
+    // Sends the packets as one message in multi-frame mode, one by one otherwise
+    bool SendAudioFrames(std::vector<std::unique_ptr<AudioStreamPacket>>& packets);
     virtual void SendWakeWordDetected(const std::string& wake_word);
     virtual void SendStartListening(ListeningMode mode);
     virtual void SendStopListening();
@@ -77,6 +109,8 @@ public:
 protected:
     std::function<void(const cJSON* root)> on_incoming_json_;
     std::function<void(std::unique_ptr<AudioStreamPacket> packet)> on_incoming_audio_;
+    std::function<std::unique_ptr<AudioStreamPacket>()> on_allocate_audio_packet_;
+    std::function<void(std::unique_ptr<AudioStreamPacket> packet)> on_release_audio_packet_;
     std::function<void()> on_audio_channel_opened_;
     std::function<void()> on_audio_channel_closed_;
     std::function<void(const std::string& message)> on_network_error_;
@@ -85,13 +119,29 @@ protected:
 
     int server_sample_rate_ = 24000;
     int server_frame_duration_ = 60;
+    std::vector<int> output_sample_rates_;
     bool error_occurred_ = false;
+    bool multi_frame_ = false;
+    // Reused to pack the frames of a multi-frame message, only used by the sending task
+    AudioStreamPacket multi_frame_packet_;
+    // Frames split from an incoming multi-frame message, only used by the receiving task
+    std::vector<std::unique_ptr<AudioStreamPacket>> incoming_frames_;
     std::string session_id_;
     std::chrono::time_point<std::chrono::steady_clock> last_incoming_time_;
 
     virtual bool SendText(const std::string& text) = 0;
     virtual void SetError(const std::string& message);
     virtual bool IsTimeout() const;
+    std::unique_ptr<AudioStreamPacket> AllocateAudioPacket();
+    // Returns a dropped packet to the pool it was allocated from
+    void ReleaseAudioPacket(std::unique_ptr<AudioStreamPacket> packet);
+    void AddClientFeatures(cJSON* features);
+    void ParseServerFeatures(const cJSON* root);
+    // Adds output_sample_rates_ if set, the server picks one of them in its hello
+    void AddOutputSampleRates(cJSON* audio_params);
+    void SetServerSampleRate(int sample_rate);
+    // Splits multi-frame messages, then hands the packets to on_incoming_audio_
+    void DispatchIncomingAudio(std::unique_ptr<AudioStreamPacket> packet);
 };
 
 #endif // PROTOCOL_H
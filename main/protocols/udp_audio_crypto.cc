@@ -0,0 +1,31 @@
+#include "udp_audio_crypto.h"
+
+#include <cstring>
+#include <arpa/inet.h>
+
+static bool CryptCtr(mbedtls_aes_context& aes, const uint8_t* header, const uint8_t* in, uint8_t* out, size_t size) {
+    // mbedtls advances the counter block, so it must not be the header itself
+    uint8_t nonce_counter[MQTT_UDP_HEADER_SIZE];
+    memcpy(nonce_counter, header, MQTT_UDP_HEADER_SIZE);
+    size_t nc_off = 0;
+    uint8_t stream_block[16] = {0};
+    return mbedtls_aes_crypt_ctr(&aes, size, &nc_off, nonce_counter, stream_block, in, out) == 0;
+}
+
+bool EncryptUdpAudio(mbedtls_aes_context& aes, const std::string& nonce, uint32_t timestamp, uint32_t sequence,
+        const uint8_t* payload, size_t payload_size, std::string& datagram) {
+    datagram.resize(MQTT_UDP_HEADER_SIZE + payload_size);
+    auto data = (uint8_t*)datagram.data();
+    memcpy(data, nonce.data(), MQTT_UDP_HEADER_SIZE);
+    *(uint16_t*)&data[2] = htons(payload_size);
+    *(uint32_t*)&data[8] = htonl(timestamp);
+    *(uint32_t*)&data[12] = htonl(sequence);
+    return CryptCtr(aes, data, payload, data + MQTT_UDP_HEADER_SIZE, payload_size);
+}
+
+bool DecryptUdpAudio(mbedtls_aes_context& aes, const uint8_t* datagram, size_t size, uint8_t* out) {
+    if (size < MQTT_UDP_HEADER_SIZE) {
+        return false;
+    }
+    return CryptCtr(aes, datagram, datagram + MQTT_UDP_HEADER_SIZE, out, size - MQTT_UDP_HEADER_SIZE);
+}
@@ -0,0 +1,26 @@
+#ifndef UDP_AUDIO_CRYPTO_H
+#define UDP_AUDIO_CRYPTO_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <mbedtls/aes.h>
+
+// |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|, also the AES-CTR nonce
+#define MQTT_UDP_HEADER_SIZE 16
+
+/*
+ * The AES-CTR framing of the MQTT+UDP audio datagrams. The header is the session nonce with the payload
+ * length, timestamp and sequence written in, and it is also the initial counter block of the payload.
+ *
+ * Neither function allocates once the datagram buffer has grown to the largest payload: the payload is
+ * encrypted straight behind the header, and decrypted straight into the caller's buffer.
+ */
+
+// Builds the datagram in datagram (reusing its capacity), false if the cipher failed
+bool EncryptUdpAudio(mbedtls_aes_context& aes, const std::string& nonce, uint32_t timestamp, uint32_t sequence,
+    const uint8_t* payload, size_t payload_size, std::string& datagram);
+// Decrypts the size - MQTT_UDP_HEADER_SIZE payload bytes of a datagram into out
+bool DecryptUdpAudio(mbedtls_aes_context& aes, const uint8_t* datagram, size_t size, uint8_t* out);
+
+#endif // UDP_AUDIO_CRYPTO_H
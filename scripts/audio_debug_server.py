@@ -1,6 +1,14 @@
 import socket
 import wave
 import argparse
+import asyncio
+import json
+import os
+import random
+import struct
+import sys
+import time
+import uuid
 
 
 '''
@@ -8,7 +16,7 @@ import argparse
   Listen for incoming messages and print them to the console.
   Save the audio to a WAV file.
 '''
-def main(samplerate, channels):
+def record(samplerate, channels):
     # Create a UDP socket
     server_socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
     server_socket.bind(('0.0.0.0', 8000))
@@ -26,16 +34,16 @@ def main(samplerate, channels):
         while True:
             # Receive a message from the client
             message, address = server_socket.recvfrom(8000)
-            
+
             # Write PCM data to WAV file
             wav_file.writeframes(message)
 
             # Print length of the message
             print(f"Received {len(message)} bytes from {address}")
-    
+
     except KeyboardInterrupt:
         print("\nStopping recording...")
-    
+
     finally:
         # Close files and socket
         wav_file.close()
@@ -43,12 +51,350 @@ def main(samplerate, channels):
         print(f"WAV file '{filename}' saved successfully")
 
 
+'''
+  A loopback conversation server, the same as LoopbackProtocol in the firmware but over the network:
+  every utterance is echoed back as the TTS response (stt, tts start, Opus frames paced in real time,
+  tts stop), after --delay ms, with up to --jitter ms per frame and --loss percent of the frames dropped.
+
+  It speaks the WebSocket protocol (binary protocol version 1, 2 or 3, from the Protocol-Version header),
+  or MQTT + UDP through an existing MQTT broker (see docs/websocket.md and docs/mqtt-udp.md).
+
+  Every turn is timed on the server: wake word detection to the first response frame, and the end of
+  speech (listen stop, or --utterance ms of audio in the auto / realtime modes) to the first response frame.
+  With --device-latency, the device latency percentiles (self.audio.get_latency) are fetched after every
+  turn. The report is printed when the session ends, and appended to --report as JSON lines.
+'''
+SAMPLE_RATE = 16000
+MAX_UTTERANCE_MS = 10000
+
+
+class LoopbackSession:
+    def __init__(self, args, transport, name):
+        self.args = args
+        self.transport = transport
+        self.name = name
+        self.session_id = uuid.uuid4().hex[:16]
+        self.frame_duration = 60
+        self.mode = "auto"
+        self.listening = False
+        self.utterance = []
+        self.response_task = None
+        self.turns = []
+        self.turn = None
+        self.timestamp = 0
+        self.sequence = 0
+        self.mcp_id = 0
+
+    def log(self, message):
+        print(f"[{time.strftime('%H:%M:%S')}] {self.name}: {message}")
+
+    def hello(self, message):
+        audio_params = message.get("audio_params", {})
+        self.frame_duration = audio_params.get("frame_duration", self.frame_duration)
+        self.log(f"hello, version {message.get('version')}, frame duration {self.frame_duration} ms")
+        # The multi_frame feature is not accepted, every message carries one frame
+        return {
+            "type": "hello",
+            "session_id": self.session_id,
+            "audio_params": {
+                "format": "opus",
+                "sample_rate": SAMPLE_RATE,
+                "channels": 1,
+                "frame_duration": self.frame_duration,
+            },
+        }
+
+    def on_json(self, message):
+        msg_type = message.get("type")
+        if msg_type == "listen":
+            state = message.get("state")
+            if state == "start":
+                self.mode = message.get("mode", "auto")
+                self.listening = True
+            elif state == "detect":
+                self.log(f"wake word detected: {message.get('text')}")
+                self.listening = False
+                self.start_turn("wake")
+            elif state == "stop":
+                self.listening = False
+                self.start_turn("speech")
+        elif msg_type == "abort":
+            self.log("abort")
+            self.cancel_response()
+            self.send_json({"type": "tts", "state": "stop"})
+        elif msg_type == "mcp":
+            result = message.get("payload", {}).get("result", {})
+            for content in result.get("content", []):
+                if content.get("type") == "text" and self.turns:
+                    self.turns[-1]["device"] = json.loads(content["text"])
+
+    def on_audio(self, payload):
+        # The realtime mode keeps sending while the response plays, that is not a new utterance
+        if self.response_task is not None and not self.response_task.done():
+            return
+        if len(self.utterance) * self.frame_duration >= MAX_UTTERANCE_MS:
+            return
+        self.utterance.append(payload)
+        if self.listening and self.mode != "manual" and len(self.utterance) * self.frame_duration >= self.args.utterance:
+            self.start_turn("speech")
+
+    def start_turn(self, kind):
+        if not self.utterance or (self.response_task is not None and not self.response_task.done()):
+            return
+        frames, self.utterance = self.utterance, []
+        self.turn = {"kind": kind, "frames": len(frames), "start": time.monotonic()}
+        self.response_task = asyncio.ensure_future(self.respond(frames, self.turn))
+
+    def cancel_response(self):
+        if self.response_task is not None:
+            self.response_task.cancel()
+            self.response_task = None
+
+    async def respond(self, frames, turn):
+        start = turn["start"] + self.args.delay / 1000
+        await asyncio.sleep(max(0, start - time.monotonic()))
+        self.send_json({"type": "stt", "text": f"Loopback {len(frames) * self.frame_duration} ms"})
+        self.send_json({"type": "tts", "state": "start"})
+
+        # Lost frames are never sent, the others are sent in the order of their jittered send time
+        schedule = []
+        for i in range(len(frames)):
+            if random.uniform(0, 100) < self.args.loss:
+                continue
+            due = start + i * self.frame_duration / 1000 + random.uniform(0, self.args.jitter) / 1000
+            schedule.append((due, i))
+        schedule.sort()
+        for due, i in schedule:
+            await asyncio.sleep(max(0, due - time.monotonic()))
+            if "first_frame" not in turn:
+                turn["first_frame"] = time.monotonic()
+            self.transport.send_audio(frames[i], self.timestamp + (i + 1) * self.frame_duration, self.sequence + i + 1)
+        self.timestamp += len(frames) * self.frame_duration
+        self.sequence += len(frames)
+        self.send_json({"type": "tts", "state": "stop"})
+
+        latency = (turn.get("first_frame", time.monotonic()) - turn["start"]) * 1000
+        self.log(f"{turn['kind']} turn, {turn['frames']} frames, {latency:.0f} ms to the first response frame")
+        self.turns.append({"kind": turn["kind"], "frames": turn["frames"], "latency_ms": round(latency, 1)})
+        if self.args.device_latency:
+            self.mcp_id += 1
+            self.send_json({"type": "mcp", "payload": {
+                "jsonrpc": "2.0", "id": self.mcp_id, "method": "tools/call",
+                "params": {"name": "self.audio.get_latency", "arguments": {"reset": True}},
+            }})
+
+    def send_json(self, message):
+        self.transport.send_json(dict(message, session_id=self.session_id))
+
+    def close(self):
+        self.cancel_response()
+        if not self.turns:
+            return
+        self.log("latency report")
+        for kind in ("wake", "speech"):
+            values = sorted(turn["latency_ms"] for turn in self.turns if turn["kind"] == kind)
+            if values:
+                p90 = values[min(len(values) - 1, len(values) * 9 // 10)]
+                print(f"  {kind} end to first response frame: {len(values)} turns, "
+                      f"p50 {values[len(values) // 2]:.0f} ms, p90 {p90:.0f} ms, max {values[-1]:.0f} ms")
+        for turn in self.turns:
+            for stage, value in turn.get("device", {}).items():
+                if value.get("count"):
+                    print(f"  device {turn['kind']} {stage}: p50 {value['p50']} ms, p90 {value['p90']} ms, "
+                          f"p99 {value['p99']} ms, max {value['max']} ms")
+        if self.args.report:
+            with open(self.args.report, "a") as f:
+                f.write(json.dumps({
+                    "time": time.strftime("%Y-%m-%d %H:%M:%S"),
+                    "transport": self.name,
+                    "delay": self.args.delay,
+                    "jitter": self.args.jitter,
+                    "loss": self.args.loss,
+                    "turns": self.turns,
+                }) + "\n")
+
+
+class WebsocketTransport:
+    def __init__(self, websocket, version):
+        self.websocket = websocket
+        self.version = version
+
+    def send_json(self, message):
+        asyncio.ensure_future(self.websocket.send(json.dumps(message)))
+
+    def send_audio(self, payload, timestamp, sequence):
+        if self.version == 2:
+            payload = struct.pack(">HHIII", 2, 0, 0, timestamp, len(payload)) + payload
+        elif self.version == 3:
+            payload = struct.pack(">BBH", 0, 0, len(payload)) + payload
+        asyncio.ensure_future(self.websocket.send(payload))
+
+    def parse_audio(self, data):
+        if self.version == 2:
+            _, msg_type, _, _, size = struct.unpack(">HHIII", data[:16])
+            return data[16:16 + size] if msg_type == 0 else None
+        if self.version == 3:
+            msg_type, _, size = struct.unpack(">BBH", data[:4])
+            return data[4:4 + size] if msg_type == 0 else None
+        return data
+
+
+async def websocket_handler(args, websocket, path=None):
+    headers = websocket.request.headers if hasattr(websocket, "request") else websocket.request_headers
+    version = int(headers.get("Protocol-Version", "1"))
+    transport = WebsocketTransport(websocket, version)
+    session = LoopbackSession(args, transport, f"websocket v{version} {headers.get('Device-Id', '')}")
+    try:
+        async for message in websocket:
+            if isinstance(message, bytes):
+                payload = transport.parse_audio(message)
+                if payload:
+                    session.on_audio(payload)
+                continue
+            message = json.loads(message)
+            if message.get("type") == "hello":
+                await websocket.send(json.dumps(dict(session.hello(message), transport="websocket")))
+            else:
+                session.on_json(message)
+    except Exception as e:
+        session.log(f"connection closed: {e}")
+    finally:
+        session.close()
+
+
+async def serve_websocket(args):
+    import websockets
+    async with websockets.serve(lambda ws, path=None: websocket_handler(args, ws, path), "0.0.0.0", args.port):
+        print(f"Loopback WebSocket server on ws://0.0.0.0:{args.port}")
+        await asyncio.Future()
+
+
+class MqttUdpTransport(asyncio.DatagramProtocol):
+    '''
+      |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|payload|, the payload encrypted
+      with AES-128-CTR and the header as the counter block
+    '''
+    def __init__(self, args, mqtt):
+        from cryptography.hazmat.primitives.ciphers import Cipher, algorithms, modes
+        self.cipher = lambda counter: Cipher(algorithms.AES(self.key), modes.CTR(counter))
+        self.args = args
+        self.mqtt = mqtt
+        self.key = os.urandom(16)
+        self.nonce = bytes([1, 0, 0, 0]) + os.urandom(4) + bytes(8)
+        self.udp = None
+        self.address = None
+        self.session = None
+
+    def connection_made(self, udp):
+        self.udp = udp
+
+    def datagram_received(self, data, address):
+        if len(data) < 16 or data[0] != 0x01 or self.session is None:
+            return
+        self.address = address
+        decryptor = self.cipher(data[:16]).decryptor()
+        self.session.on_audio(decryptor.update(data[16:]) + decryptor.finalize())
+
+    def send_audio(self, payload, timestamp, sequence):
+        if self.address is None:
+            return
+        header = self.nonce[:2] + struct.pack(">H", len(payload)) + self.nonce[4:8] + struct.pack(">II", timestamp, sequence)
+        encryptor = self.cipher(header).encryptor()
+        self.udp.sendto(header + encryptor.update(payload) + encryptor.finalize(), self.address)
+
+    def send_json(self, message):
+        self.mqtt.publish(self.args.mqtt_reply_topic, json.dumps(message))
+
+    def on_message(self, message):
+        if message.get("type") == "hello":
+            if self.session is not None:
+                self.session.close()
+            self.session = LoopbackSession(self.args, self, "mqtt+udp")
+            self.address = None
+            self.send_json(dict(self.session.hello(message), transport="udp", udp={
+                "server": self.args.udp_host, "port": self.args.port,
+                "key": self.key.hex().upper(), "nonce": self.nonce.hex().upper(),
+            }))
+        elif message.get("type") == "goodbye":
+            if self.session is not None:
+                self.session.close()
+                self.session = None
+        elif self.session is not None:
+            self.session.on_json(message)
+
+
+async def serve_mqtt(args):
+    import paho.mqtt.client as paho
+    loop = asyncio.get_running_loop()
+    mqtt = paho.Client()
+    if args.mqtt_username:
+        mqtt.username_pw_set(args.mqtt_username, args.mqtt_password)
+    _, transport = await loop.create_datagram_endpoint(lambda: MqttUdpTransport(args, mqtt), local_addr=("0.0.0.0", args.port))
+    mqtt.on_connect = lambda client, userdata, flags, rc, *rest: client.subscribe(args.mqtt_topic)
+    mqtt.on_message = lambda client, userdata, msg: loop.call_soon_threadsafe(transport.on_message, json.loads(msg.payload))
+    host, _, port = args.mqtt_broker.partition(":")
+    mqtt.connect(host, int(port or 1883))
+    mqtt.loop_start()
+    print(f"Loopback MQTT server on {args.mqtt_broker} ({args.mqtt_topic}), UDP {args.udp_host}:{args.port}")
+    try:
+        await asyncio.Future()
+    finally:
+        if transport.session is not None:
+            transport.session.close()
+        mqtt.loop_stop()
+
+
+def loopback(args):
+    try:
+        asyncio.run(serve_mqtt(args) if args.transport == "mqtt" else serve_websocket(args))
+    except KeyboardInterrupt:
+        print("\nStopping loopback server...")
+
+
 if __name__ == "__main__":
-    parser = argparse.ArgumentParser(description='UDP音频数据接收器，保存为WAV文件')
-    parser.add_argument('--samplerate', '-s', type=int, default=16000, 
+    parser = argparse.ArgumentParser(description='音频调试服务器')
+    subparsers = parser.add_subparsers(dest='command')
+
+    record_parser = subparsers.add_parser('record', help='UDP音频数据接收器，保存为WAV文件（默认）')
+    record_parser.add_argument('--samplerate', '-s', type=int, default=16000,
                         help='采样率 (默认: 16000)')
-    parser.add_argument('--channels', '-c', type=int, default=2, 
+    record_parser.add_argument('--channels', '-c', type=int, default=2,
                         help='声道数 (默认: 2)')
-    
-    args = parser.parse_args()
-    main(args.samplerate, args.channels)
+
+    loopback_parser = subparsers.add_parser('loopback', help='回环对话服务器，把每句话作为TTS回放，并统计延迟')
+    loopback_parser.add_argument('--transport', choices=['websocket', 'mqtt'], default='websocket',
+                        help='协议 (默认: websocket)')
+    loopback_parser.add_argument('--port', '-p', type=int, default=8765,
+                        help='WebSocket 或 UDP 端口 (默认: 8765)')
+    loopback_parser.add_argument('--delay', type=int, default=300,
+                        help='从说话结束到回复的延迟，毫秒 (默认: 300)')
+    loopback_parser.add_argument('--jitter', type=int, default=0,
+                        help='每帧随机延迟的上限，毫秒 (默认: 0)')
+    loopback_parser.add_argument('--loss', type=float, default=0,
+                        help='丢帧率，百分比 (默认: 0)')
+    loopback_parser.add_argument('--utterance', type=int, default=3000,
+                        help='自动/实时模式下每句话的长度，毫秒 (默认: 3000)')
+    loopback_parser.add_argument('--device-latency', action='store_true',
+                        help='每轮对话后通过 MCP 读取设备端延迟 (self.audio.get_latency)')
+    loopback_parser.add_argument('--report',
+                        help='延迟报告追加写入的文件 (JSON lines)')
+    loopback_parser.add_argument('--mqtt-broker', default='127.0.0.1:1883',
+                        help='MQTT broker 地址 (默认: 127.0.0.1:1883)')
+    loopback_parser.add_argument('--mqtt-username')
+    loopback_parser.add_argument('--mqtt-password')
+    loopback_parser.add_argument('--mqtt-topic', default='device-server',
+                        help='设备发布消息的主题 (默认: device-server)')
+    loopback_parser.add_argument('--mqtt-reply-topic', default='devices/p2p/loopback',
+                        help='设备订阅的主题 (默认: devices/p2p/loopback)')
+    loopback_parser.add_argument('--udp-host', default='127.0.0.1',
+                        help='下发给设备的 UDP 服务器地址 (默认: 127.0.0.1)')
+
+    # Without a command, the arguments are those of the UDP recorder as before
+    argv = sys.argv[1:]
+    if not argv or argv[0] not in ('record', 'loopback', '-h', '--help'):
+        argv = ['record'] + argv
+    args = parser.parse_args(argv)
+    if args.command == 'loopback':
+        loopback(args)
+    else:
+        record(args.samplerate, args.channels)
@@ -0,0 +1,187 @@
+/*
+ * Replays downlink packet traces with loss, jitter and reordering through the JitterBuffer, with the
+ * decoder task and the playback queue modelled at a 1 ms tick, and reports the underruns and the latency
+ * the buffer adds. Exits with 1 if a trace breaks one of the expectations below.
+ */
+#include "jitter_buffer.h"
+
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#define FRAME_MS 60
+#define NETWORK_DELAY_MS 40
+// MAX_PLAYBACK_TASKS_IN_QUEUE frames of PCM may wait for the output task
+#define PLAYBACK_QUEUE_FRAMES 2
+
+struct TraceConfig {
+    const char* name;
+    int frames;
+    int jitter_ms;          // Uniform extra delay of every packet
+    double loss;            // Random loss probability
+    int burst_start;        // First frame of a burst loss, -1 for none
+    int burst_length;
+    double reorder;         // Probability that a packet is held one frame behind the next one
+    int min_depth_ms;       // Playout depth floor, the hold for a missing packet is at least that long
+};
+
+struct TracePacket {
+    uint32_t timestamp;
+    int64_t arrival_us;
+};
+
+struct TraceResult {
+    int output_frames = 0;
+    int underruns = 0;
+    int starved_ms = 0;
+    int max_stall_ms = 0;
+    // Longest stall with a packet buffered: time spent holding for a missing packet, not the outage itself
+    int max_held_ms = 0;
+    double mean_latency_ms = 0;
+    int max_latency_ms = 0;
+    JitterBuffer::Statistics statistics;
+    int target_depth_ms = 0;
+};
+
+static std::vector<TracePacket> MakeTrace(const TraceConfig& config) {
+    std::mt19937 random(1234);
+    std::uniform_real_distribution<double> chance(0, 1);
+    std::uniform_int_distribution<int> jitter(0, std::max(config.jitter_ms, 0));
+    std::vector<TracePacket> packets;
+    for (int i = 0; i < config.frames; i++) {
+        bool burst = config.burst_start >= 0 && i >= config.burst_start && i < config.burst_start + config.burst_length;
+        /* The last frame is never lost, a loss at the very end can not be told from the end of the stream */
+        bool lost = i < config.frames - 1 && (burst || chance(random) < config.loss);
+        int64_t arrival_us = (int64_t)(i * FRAME_MS + NETWORK_DELAY_MS + jitter(random)) * 1000;
+        if (chance(random) < config.reorder) {
+            arrival_us += FRAME_MS * 1000 + 1000;
+        }
+        if (!lost) {
+            packets.push_back({(uint32_t)(1000 + i * FRAME_MS), arrival_us});
+        }
+    }
+    std::stable_sort(packets.begin(), packets.end(), [](const TracePacket& a, const TracePacket& b) {
+        return a.arrival_us < b.arrival_us;
+    });
+    return packets;
+}
+
+static TraceResult Replay(const TraceConfig& config) {
+    auto trace = MakeTrace(config);
+    JitterBuffer jitter_buffer(16, config.min_depth_ms, 480);
+    TraceResult result;
+    size_t next_packet = 0;
+    int buffered_ms = 0;     // PCM waiting in the playback queue and the codec
+    bool started = false;
+    int stall_ms = 0;
+    int held_ms = 0;
+    int64_t latency_sum_ms = 0;
+    int latency_count = 0;
+    int64_t end_us = trace.back().arrival_us + 2000 * 1000;
+
+    for (int64_t now_us = 0; now_us < end_us; now_us += 1000) {
+        while (next_packet < trace.size() && trace[next_packet].arrival_us <= now_us) {
+            auto packet = std::make_unique<AudioStreamPacket>();
+            packet->sample_rate = 24000;
+            packet->frame_duration = FRAME_MS;
+            packet->timestamp = trace[next_packet].timestamp;
+            packet->trace_time_us = trace[next_packet].arrival_us;
+            jitter_buffer.Push(std::move(packet), now_us);
+            next_packet++;
+        }
+
+        /* The decoder task runs while the playback queue has room */
+        while (buffered_ms < PLAYBACK_QUEUE_FRAMES * FRAME_MS) {
+            int wait_ms = 0;
+            auto action = jitter_buffer.Next(now_us, wait_ms);
+            if (action == JitterBuffer::kJitterWait) {
+                break;
+            }
+            if (action == JitterBuffer::kJitterDecode) {
+                auto packet = jitter_buffer.Pop();
+                /* Played once the PCM queued ahead of it is out */
+                int latency_ms = (int)((now_us - packet->trace_time_us) / 1000) + buffered_ms;
+                latency_sum_ms += latency_ms;
+                latency_count++;
+                result.max_latency_ms = std::max(result.max_latency_ms, latency_ms);
+            }
+            buffered_ms += FRAME_MS;
+            result.output_frames++;
+            started = true;
+        }
+
+        /* The output task plays 1 ms per tick, a dry queue before the end of the stream is an underrun */
+        if (buffered_ms > 0) {
+            buffered_ms--;
+            if (stall_ms > 0) {
+                result.max_stall_ms = std::max(result.max_stall_ms, stall_ms);
+                result.max_held_ms = std::max(result.max_held_ms, held_ms);
+                stall_ms = 0;
+                held_ms = 0;
+            }
+        } else if (started && result.output_frames < config.frames) {
+            if (stall_ms++ == 0) {
+                result.underruns++;
+            }
+            if (!jitter_buffer.empty()) {
+                held_ms++;
+            }
+            result.starved_ms++;
+        }
+    }
+
+    result.mean_latency_ms = latency_count > 0 ? (double)latency_sum_ms / latency_count : 0;
+    result.statistics = jitter_buffer.statistics();
+    result.target_depth_ms = jitter_buffer.target_depth_ms();
+    return result;
+}
+
+static int failures = 0;
+
+static void Expect(bool condition, const char* trace, const char* what) {
+    if (!condition) {
+        printf("FAIL %s: %s\n", trace, what);
+        failures++;
+    }
+}
+
+int main() {
+    const TraceConfig configs[] = {
+        { "clean",         500, 0,   0.0,  -1,  0, 0.0,  0 },
+        { "jitter 40 ms",  500, 40,  0.0,  -1,  0, 0.0,  0 },
+        { "jitter 120 ms", 500, 120, 0.0,  -1,  0, 0.0,  0 },
+        { "loss 5%",       500, 20,  0.05, -1,  0, 0.0,  0 },
+        { "burst 6",       500, 0,   0.0,  200, 6, 0.0,  0 },
+        { "burst 6 deep",  500, 0,   0.0,  200, 6, 0.0,  240 },
+        { "burst 6 tail",  500, 0,   0.0,  493, 6, 0.0,  240 },
+        { "reorder 5%",    500, 10,  0.0,  -1,  0, 0.05, 0 },
+        { "cellular",      500, 80,  0.03, 300, 4, 0.03, 0 },
+    };
+
+    printf("%-14s %6s %9s %8s %9s %8s %9s %9s %5s %12s %11s %7s\n", "trace", "frames", "underruns", "starved",
+        "max stall", "max held", "concealed", "recovered", "late", "latency mean", "latency max", "target");
+    for (const auto& config : configs) {
+        auto result = Replay(config);
+        auto& statistics = result.statistics;
+        printf("%-14s %6d %9d %6d ms %6d ms %5d ms %9u %9u %5u %9.1f ms %8d ms %4d ms\n", config.name,
+            result.output_frames, result.underruns, result.starved_ms, result.max_stall_ms, result.max_held_ms,
+            (unsigned)statistics.concealed,
+            (unsigned)statistics.recovered, (unsigned)statistics.late, result.mean_latency_ms, result.max_latency_ms,
+            result.target_depth_ms);
+
+        /* Every frame of the stream is played once, decoded or concealed */
+        Expect(result.output_frames == config.frames, config.name, "frames played or concealed != frames sent");
+        if (config.jitter_ms == 0 && config.loss == 0 && config.reorder == 0 && config.burst_start < 0) {
+            Expect(result.underruns == 0, config.name, "underrun on a clean link");
+            Expect(result.max_latency_ms <= PLAYBACK_QUEUE_FRAMES * FRAME_MS, config.name, "latency added on a clean link");
+        }
+        if (config.burst_start >= 0 && config.jitter_ms == 0) {
+            /* Once the packet after the burst is in, one hold for the whole gap, not one per lost frame */
+            Expect(result.underruns <= 1, config.name, "a burst loss starves playback more than once");
+            Expect(result.max_held_ms <= std::max(config.min_depth_ms, FRAME_MS), config.name, "a burst loss is held for more than one hold");
+        }
+    }
+    return failures > 0 ? 1 : 0;
+}
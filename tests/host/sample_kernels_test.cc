@@ -0,0 +1,221 @@
+/*
+ * Checks the sample kernels against plain per-sample references, including the saturation edges, then
+ * times them against the loops they replaced in NoAudioCodec (vector per call, pow() and 64-bit products).
+ * This builds the portable C++ kernels: the timings compare code shapes on the host, they are not ESP32 figures.
+ * Exits with 1 on a mismatch, the timings never fail.
+ */
+#include "sample_kernels.h"
+
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <functional>
+
+// 60 ms at 16 kHz, a typical codec read or write
+#define FRAME_SAMPLES 960
+#define BENCH_FRAMES 20000
+
+static int failures = 0;
+
+static void Expect(bool condition, const char* kernel, size_t index) {
+    if (!condition && failures++ < 20) {
+        printf("FAIL %s at sample %zu\n", kernel, index);
+    }
+}
+
+static int16_t Saturate16(int64_t value) {
+    return value > INT16_MAX ? INT16_MAX : value < INT16_MIN ? INT16_MIN : (int16_t)value;
+}
+
+static std::vector<int16_t> TestSignal(size_t samples, uint32_t seed) {
+    std::mt19937 random(seed);
+    std::uniform_int_distribution<int> sample(INT16_MIN, INT16_MAX);
+    std::vector<int16_t> data(samples);
+    for (auto& value : data) {
+        value = (int16_t)sample(random);
+    }
+    /* The edges, and a tail that is not a multiple of the unrolled loops */
+    data[0] = INT16_MIN;
+    data[1] = INT16_MAX;
+    data[2] = 0;
+    data[3] = -1;
+    return data;
+}
+
+static void CheckGains() {
+    Expect(VolumeToGainQ16(0) == 0 && VolumeToGainQ16(-5) == 0, "VolumeToGainQ16", 0);
+    Expect(VolumeToGainQ16(100) == 65536 && VolumeToGainQ16(120) == 65536, "VolumeToGainQ16", 100);
+    for (int volume = 1; volume < 100; volume++) {
+        /* Within one step of the former pow() curve */
+        int32_t expected = (int32_t)(pow(volume / 100.0, 2) * 65536);
+        Expect(std::abs(VolumeToGainQ16(volume) - expected) <= 1, "VolumeToGainQ16", volume);
+    }
+    Expect(GainToQ8(0) == 0 && GainToQ8(-1.0f) == 0, "GainToQ8", 0);
+    Expect(GainToQ8(1.0f) == 256 && GainToQ8(2.5f) == 640, "GainToQ8", 1);
+    Expect(GainToQ8(1000.0f) == 65535, "GainToQ8", 2);
+}
+
+static void CheckKernels() {
+    const size_t samples = FRAME_SAMPLES + 3;
+    auto in = TestSignal(samples, 1);
+
+    for (int32_t gain : { 0, 1, 6554, 32768, 65535, 65536 }) {
+        std::vector<int32_t> out(samples);
+        ScaleInt16ToInt32(in.data(), out.data(), samples, gain);
+        for (size_t i = 0; i < samples; i++) {
+            Expect(out[i] == (int64_t)in[i] * gain, "ScaleInt16ToInt32", i);
+        }
+    }
+
+    std::vector<int32_t> wide(samples);
+    for (size_t i = 0; i < samples; i++) {
+        wide[i] = (int32_t)in[i] << 14;
+    }
+    wide[4] = INT32_MAX;
+    wide[5] = INT32_MIN;
+    for (int shift : { 0, 8, 12, 16 }) {
+        std::vector<int16_t> out(samples);
+        ShiftInt32ToInt16(wide.data(), out.data(), samples, shift);
+        for (size_t i = 0; i < samples; i++) {
+            Expect(out[i] == Saturate16(wide[i] >> shift), "ShiftInt32ToInt16", i);
+        }
+    }
+    /* In place, as NoAudioCodec::Read does it */
+    auto aliased = wide;
+    ShiftInt32ToInt16(aliased.data(), (int16_t*)aliased.data(), samples, 12);
+    for (size_t i = 0; i < samples; i++) {
+        Expect(((int16_t*)aliased.data())[i] == Saturate16(wide[i] >> 12), "ShiftInt32ToInt16 in place", i);
+    }
+
+    for (int32_t gain : { 0, 128, 256, 300, 2560, 65535 }) {
+        auto data = in;
+        ApplyGainQ8(data.data(), samples, gain);
+        for (size_t i = 0; i < samples; i++) {
+            Expect(data[i] == Saturate16(((int64_t)in[i] * gain) >> 8), "ApplyGainQ8", i);
+        }
+    }
+
+    /* Ramps that stay within [0, 1.0] over the frame, as the mixer's fades do */
+    for (int32_t step : { 0, -64, 32 }) {
+        for (int32_t gain : { 65536, 32768 }) {
+            if (step > 0 && gain == 65536) {
+                continue;
+            }
+            std::vector<int32_t> acc(samples, 1000);
+            MixInt16ToInt32(in.data(), acc.data(), samples, gain, step);
+            int32_t g = gain;
+            for (size_t i = 0; i < samples; i++) {
+                Expect(acc[i] == 1000 + (int32_t)(((int64_t)in[i] * g) >> 16), "MixInt16ToInt32", i);
+                g += step;
+            }
+        }
+    }
+
+    for (int channels : { 1, 2, 4 }) {
+        size_t frames = samples / channels;
+        for (int channel = 0; channel < channels; channel++) {
+            std::vector<int16_t> out(frames);
+            ExtractChannel(in.data(), out.data(), frames, channels, channel);
+            for (size_t i = 0; i < frames; i++) {
+                Expect(out[i] == in[i * channels + channel], "ExtractChannel", i);
+            }
+            auto data = in;
+            ExtractChannel(data.data(), data.data(), frames, channels, channel);
+            for (size_t i = 0; i < frames; i++) {
+                Expect(data[i] == in[i * channels + channel], "ExtractChannel in place", i);
+            }
+        }
+    }
+}
+
+/* The loops the kernels replaced, as they were in NoAudioCodec */
+static int LegacyWrite(const int16_t* data, int samples, int output_volume, int32_t* sink) {
+    std::vector<int32_t> buffer(samples);
+    int32_t volume_factor = pow(double(output_volume) / 100.0, 2) * 65536;
+    for (int i = 0; i < samples; i++) {
+        int64_t temp = int64_t(data[i]) * volume_factor;
+        if (temp > INT32_MAX) {
+            buffer[i] = INT32_MAX;
+        } else if (temp < INT32_MIN) {
+            buffer[i] = INT32_MIN;
+        } else {
+            buffer[i] = static_cast<int32_t>(temp);
+        }
+    }
+    sink[0] += buffer[samples - 1];
+    return samples;
+}
+
+static int LegacyRead(const int32_t* i2s, int16_t* dest, int samples) {
+    std::vector<int32_t> bit32_buffer(i2s, i2s + samples);
+    for (int i = 0; i < samples; i++) {
+        int32_t value = bit32_buffer[i] >> 12;
+        dest[i] = (value > INT16_MAX) ? INT16_MAX : (value < -INT16_MAX) ? -INT16_MAX : (int16_t)value;
+    }
+    return samples;
+}
+
+static double NsPerSample(const std::function<void()>& frame) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_FRAMES; i++) {
+        frame();
+    }
+    auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    return elapsed / ((double)BENCH_FRAMES * FRAME_SAMPLES);
+}
+
+static void Benchmark() {
+    auto pcm = TestSignal(FRAME_SAMPLES * 2, 2);
+    std::vector<int32_t> wide(FRAME_SAMPLES);
+    std::vector<int32_t> i2s(FRAME_SAMPLES);
+    for (size_t i = 0; i < FRAME_SAMPLES; i++) {
+        i2s[i] = (int32_t)pcm[i] << 14;
+    }
+    std::vector<int16_t> narrow(FRAME_SAMPLES);
+    int32_t sink = 0;
+    volatile int volume = 70;
+
+    printf("%-36s %10s\n", "kernel (host, portable C++)", "ns/sample");
+    auto report = [](const char* name, double ns) {
+        printf("%-36s %10.3f\n", name, ns);
+    };
+    report("write: legacy vector + pow + int64", NsPerSample([&]() {
+        LegacyWrite(pcm.data(), FRAME_SAMPLES, volume, &sink);
+    }));
+    report("write: ScaleInt16ToInt32", NsPerSample([&]() {
+        ScaleInt16ToInt32(pcm.data(), wide.data(), FRAME_SAMPLES, VolumeToGainQ16(volume));
+        sink += wide[FRAME_SAMPLES - 1];
+    }));
+    report("read: legacy vector + shift", NsPerSample([&]() {
+        LegacyRead(i2s.data(), narrow.data(), FRAME_SAMPLES);
+        sink += narrow[FRAME_SAMPLES - 1];
+    }));
+    report("read: ShiftInt32ToInt16", NsPerSample([&]() {
+        ShiftInt32ToInt16(i2s.data(), narrow.data(), FRAME_SAMPLES, 12);
+        sink += narrow[FRAME_SAMPLES - 1];
+    }));
+    report("ApplyGainQ8", NsPerSample([&]() {
+        ApplyGainQ8(narrow.data(), FRAME_SAMPLES, 300);
+        sink += narrow[0];
+    }));
+    report("MixInt16ToInt32 ramp", NsPerSample([&]() {
+        MixInt16ToInt32(pcm.data(), wide.data(), FRAME_SAMPLES, 65536, -8);
+        sink += wide[0];
+    }));
+    report("ExtractChannel stereo", NsPerSample([&]() {
+        ExtractChannel(pcm.data(), narrow.data(), FRAME_SAMPLES, 2, 0);
+        sink += narrow[0];
+    }));
+    /* Keeps the loops from being optimized away */
+    printf("(checksum %d)\n", (int)sink);
+}
+
+int main() {
+    CheckGains();
+    CheckKernels();
+    Benchmark();
+    return failures > 0 ? 1 : 0;
+}
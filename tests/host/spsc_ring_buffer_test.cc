@@ -0,0 +1,481 @@
+/*
+ * Checks the SpscRingBuffer (limits, wrap-around, Clear() / DropDiscarded(), one producer and one consumer
+ * thread), then runs the audio pipeline of AudioService with both queue designs and compares them:
+ *
+ *   input   -> encode queue   -> codec task -> send queue -> sender
+ *   network -> decode queue   -> codec task -> playback queue -> output
+ *
+ * "shared lock" is the former design: every queue under one mutex, one condition variable and notify_all()
+ * on every push and pop. "spsc" is one ring per hop, each push waking only the consumer and each pop only
+ * the producer, as AudioService does with task notifications (modelled here by an atomic wait).
+ *
+ * Frames are 1 ms apart instead of 60 ms so that the run is short, the codec work is a busy loop. The
+ * figures are host thread figures: they show the wakeups and the contention the design causes, not the
+ * latency on an ESP32. Exits with 1 if a functional check fails or a frame is lost, the timings never fail.
+ */
+#include "spsc_ring_buffer.h"
+
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define FRAME_COUNT 2000
+#define FRAME_PERIOD_US 1000
+#define ENCODE_WORK_US 250
+#define DECODE_WORK_US 120
+// As MAX_ENCODE_TASKS_IN_QUEUE, MAX_SEND_PACKETS_IN_QUEUE, MAX_DECODE_PACKETS_IN_QUEUE, MAX_PLAYBACK_TASKS_IN_QUEUE
+static const size_t kLimits[] = { 2, 40, 40, 2 };
+
+enum Hop { kHopEncode, kHopSend, kHopDecode, kHopPlayback, kHopCount };
+enum Thread { kThreadInput, kThreadNetwork, kThreadCodec, kThreadSender, kThreadOutput, kThreadCount };
+static const Thread kProducers[] = { kThreadInput, kThreadCodec, kThreadNetwork, kThreadCodec };
+static const Thread kConsumers[] = { kThreadCodec, kThreadSender, kThreadCodec, kThreadOutput };
+
+static int failures = 0;
+
+static void Expect(bool condition, const char* what) {
+    if (!condition) {
+        printf("FAIL %s\n", what);
+        failures++;
+    }
+}
+
+static int64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void Spin(int us) {
+    int64_t end = NowNs() + us * 1000LL;
+    while (NowNs() < end) {
+    }
+}
+
+struct Frame {
+    int64_t created_ns = 0;
+};
+
+struct Statistics {
+    std::atomic<uint64_t> wakeups{0};
+    // Woken, but the queue it waits on was not ready
+    std::atomic<uint64_t> idle_wakeups{0};
+    uint64_t lock_sections = 0;
+    int64_t lock_wait_ns = 0;
+    int64_t lock_wait_max_ns = 0;
+    int64_t lock_hold_ns = 0;
+    int64_t lock_hold_max_ns = 0;
+};
+
+class Queues {
+public:
+    virtual ~Queues() = default;
+    // Waits for room, like the tasks do for their output queue
+    virtual void Push(Hop hop, const Frame& frame) = 0;
+    virtual bool Pop(Hop hop, Frame& frame) = 0;
+    virtual bool Full(Hop hop) = 0;
+    // Waits until the thread has something to do
+    virtual void Wait(Thread thread) = 0;
+    virtual void Stop() = 0;
+};
+
+/* The former AudioService queues */
+class SharedLockQueues : public Queues {
+public:
+    explicit SharedLockQueues(Statistics& statistics) : statistics_(statistics) {}
+
+    void Push(Hop hop, const Frame& frame) override {
+        auto lock = Lock();
+        while (queues_[hop].size() >= kLimits[hop] && !stopped_) {
+            WaitLocked(lock);
+        }
+        queues_[hop].push_back(frame);
+        cv_.notify_all();
+        Unlock(lock);
+    }
+
+    bool Pop(Hop hop, Frame& frame) override {
+        auto lock = Lock();
+        bool popped = !queues_[hop].empty();
+        if (popped) {
+            frame = queues_[hop].front();
+            queues_[hop].pop_front();
+            cv_.notify_all();
+        }
+        Unlock(lock);
+        return popped;
+    }
+
+    bool Full(Hop hop) override {
+        auto lock = Lock();
+        bool full = queues_[hop].size() >= kLimits[hop];
+        Unlock(lock);
+        return full;
+    }
+
+    void Wait(Thread thread) override {
+        auto lock = Lock();
+        while (!Ready(thread) && !stopped_) {
+            WaitLocked(lock);
+            if (!Ready(thread) && !stopped_) {
+                statistics_.idle_wakeups++;
+            }
+        }
+        Unlock(lock);
+    }
+
+    void Stop() override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopped_ = true;
+        cv_.notify_all();
+    }
+
+private:
+    Statistics& statistics_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Frame> queues_[kHopCount];
+    bool stopped_ = false;
+    // When the lock was last taken, written with the lock held
+    int64_t locked_ns_ = 0;
+
+    bool Ready(Thread thread) {
+        switch (thread) {
+        case kThreadCodec:
+            return !queues_[kHopEncode].empty() ||
+                (!queues_[kHopDecode].empty() && queues_[kHopPlayback].size() < kLimits[kHopPlayback]);
+        case kThreadSender:
+            return !queues_[kHopSend].empty();
+        case kThreadOutput:
+            return !queues_[kHopPlayback].empty();
+        default:
+            return true;
+        }
+    }
+
+    std::unique_lock<std::mutex> Lock() {
+        int64_t start = NowNs();
+        std::unique_lock<std::mutex> lock(mutex_);
+        locked_ns_ = NowNs();
+        int64_t wait = locked_ns_ - start;
+        statistics_.lock_wait_ns += wait;
+        statistics_.lock_wait_max_ns = std::max(statistics_.lock_wait_max_ns, wait);
+        return lock;
+    }
+
+    void EndSection() {
+        int64_t hold = NowNs() - locked_ns_;
+        statistics_.lock_sections++;
+        statistics_.lock_hold_ns += hold;
+        statistics_.lock_hold_max_ns = std::max(statistics_.lock_hold_max_ns, hold);
+    }
+
+    void Unlock(std::unique_lock<std::mutex>& lock) {
+        EndSection();
+        lock.unlock();
+    }
+
+    void WaitLocked(std::unique_lock<std::mutex>& lock) {
+        EndSection();
+        cv_.wait(lock);
+        locked_ns_ = NowNs();
+        statistics_.wakeups++;
+    }
+};
+
+/* A task notification: Give() never blocks, Take() clears the pending notification */
+class Notification {
+public:
+    void Give() {
+        if (pending_.exchange(1) == 0) {
+            pending_.notify_one();
+        }
+    }
+
+    void Take() {
+        pending_.wait(0);
+        pending_.store(0);
+    }
+
+private:
+    std::atomic<uint32_t> pending_{0};
+};
+
+/* The AudioService queues now */
+class SpscQueues : public Queues {
+public:
+    explicit SpscQueues(Statistics& statistics) : statistics_(statistics) {
+        for (int hop = 0; hop < kHopCount; hop++) {
+            rings_[hop] = std::make_unique<SpscRingBuffer<Frame>>(kLimits[hop]);
+        }
+    }
+
+    void Push(Hop hop, const Frame& frame) override {
+        while (true) {
+            Frame item = frame;
+            if (rings_[hop]->Push(std::move(item))) {
+                break;
+            }
+            if (stopped_) {
+                return;
+            }
+            Take(kProducers[hop]);
+            if (rings_[hop]->Full() && !stopped_) {
+                statistics_.idle_wakeups++;
+            }
+        }
+        notifications_[kConsumers[hop]].Give();
+    }
+
+    bool Pop(Hop hop, Frame& frame) override {
+        if (!rings_[hop]->Pop(frame)) {
+            return false;
+        }
+        notifications_[kProducers[hop]].Give();
+        return true;
+    }
+
+    bool Full(Hop hop) override {
+        return rings_[hop]->Full();
+    }
+
+    void Wait(Thread thread) override {
+        while (!Ready(thread) && !stopped_) {
+            Take(thread);
+            if (!Ready(thread) && !stopped_) {
+                statistics_.idle_wakeups++;
+            }
+        }
+    }
+
+    void Stop() override {
+        stopped_ = true;
+        for (auto& notification : notifications_) {
+            notification.Give();
+        }
+    }
+
+private:
+    Statistics& statistics_;
+    std::unique_ptr<SpscRingBuffer<Frame>> rings_[kHopCount];
+    Notification notifications_[kThreadCount];
+    std::atomic<bool> stopped_ = false;
+
+    bool Ready(Thread thread) {
+        switch (thread) {
+        case kThreadCodec:
+            return !rings_[kHopEncode]->Empty() || (!rings_[kHopDecode]->Empty() && !rings_[kHopPlayback]->Full());
+        case kThreadSender:
+            return !rings_[kHopSend]->Empty();
+        case kThreadOutput:
+            return !rings_[kHopPlayback]->Empty();
+        default:
+            return true;
+        }
+    }
+
+    void Take(Thread thread) {
+        notifications_[thread].Take();
+        statistics_.wakeups++;
+    }
+};
+
+struct Latency {
+    double mean_us = 0;
+    double stddev_us = 0;
+    double p99_us = 0;
+    double max_us = 0;
+};
+
+static Latency Summarize(std::vector<int64_t> latencies_ns) {
+    Latency latency;
+    if (latencies_ns.empty()) {
+        return latency;
+    }
+    double sum = 0;
+    for (auto ns : latencies_ns) {
+        sum += ns / 1000.0;
+    }
+    latency.mean_us = sum / latencies_ns.size();
+    double variance = 0;
+    for (auto ns : latencies_ns) {
+        variance += (ns / 1000.0 - latency.mean_us) * (ns / 1000.0 - latency.mean_us);
+    }
+    latency.stddev_us = std::sqrt(variance / latencies_ns.size());
+    std::sort(latencies_ns.begin(), latencies_ns.end());
+    latency.p99_us = latencies_ns[latencies_ns.size() * 99 / 100] / 1000.0;
+    latency.max_us = latencies_ns.back() / 1000.0;
+    return latency;
+}
+
+static void RunPipeline(const char* name, Queues& queues, Statistics& statistics) {
+    std::vector<int64_t> uplink_ns;
+    std::vector<int64_t> downlink_ns;
+    uplink_ns.reserve(FRAME_COUNT);
+    downlink_ns.reserve(FRAME_COUNT);
+    std::atomic<bool> done = false;
+    auto start = std::chrono::steady_clock::now();
+
+    auto source = [&](Hop hop, int offset_us) {
+        for (int i = 0; i < FRAME_COUNT; i++) {
+            std::this_thread::sleep_until(start + std::chrono::microseconds(i * FRAME_PERIOD_US + offset_us));
+            queues.Push(hop, Frame{NowNs()});
+        }
+    };
+    std::thread input(source, kHopEncode, 0);
+    std::thread network(source, kHopDecode, FRAME_PERIOD_US / 2);
+
+    std::thread codec([&]() {
+        Frame frame;
+        while (!done) {
+            bool worked = false;
+            if (queues.Pop(kHopEncode, frame)) {
+                Spin(ENCODE_WORK_US);
+                queues.Push(kHopSend, frame);
+                worked = true;
+            }
+            if (!queues.Full(kHopPlayback) && queues.Pop(kHopDecode, frame)) {
+                Spin(DECODE_WORK_US);
+                queues.Push(kHopPlayback, frame);
+                worked = true;
+            }
+            if (!worked) {
+                queues.Wait(kThreadCodec);
+            }
+        }
+    });
+    auto sink = [&](Hop hop, Thread thread, std::vector<int64_t>& latencies) {
+        Frame frame;
+        while (!done) {
+            if (queues.Pop(hop, frame)) {
+                latencies.push_back(NowNs() - frame.created_ns);
+                if (uplink_ns.size() == FRAME_COUNT && downlink_ns.size() == FRAME_COUNT) {
+                    done = true;
+                    queues.Stop();
+                }
+            } else {
+                queues.Wait(thread);
+            }
+        }
+    };
+    std::thread sender(sink, kHopSend, kThreadSender, std::ref(uplink_ns));
+    std::thread output(sink, kHopPlayback, kThreadOutput, std::ref(downlink_ns));
+
+    input.join();
+    network.join();
+    codec.join();
+    sender.join();
+    output.join();
+
+    Expect(uplink_ns.size() == FRAME_COUNT && downlink_ns.size() == FRAME_COUNT, "a pipeline frame was lost");
+    auto uplink = Summarize(uplink_ns);
+    auto downlink = Summarize(downlink_ns);
+    printf("%-12s %8llu %8llu", name, (unsigned long long)statistics.wakeups,
+        (unsigned long long)statistics.idle_wakeups);
+    if (statistics.lock_sections > 0) {
+        printf(" %7.2f %8.1f %7.2f %8.1f", statistics.lock_wait_ns / 1000.0 / statistics.lock_sections,
+            statistics.lock_wait_max_ns / 1000.0, statistics.lock_hold_ns / 1000.0 / statistics.lock_sections,
+            statistics.lock_hold_max_ns / 1000.0);
+    } else {
+        printf(" %7s %8s %7s %8s", "-", "-", "-", "-");
+    }
+    printf(" %7.1f %7.1f %8.1f %7.1f %7.1f %8.1f\n", uplink.mean_us, uplink.stddev_us, uplink.p99_us,
+        downlink.mean_us, downlink.stddev_us, downlink.p99_us);
+}
+
+static void CheckRing() {
+    SpscRingBuffer<int> ring(5);
+    Expect(ring.capacity() == 5 && ring.Empty(), "new ring is empty");
+    for (int i = 0; i < 5; i++) {
+        int item = i;
+        Expect(ring.Push(std::move(item)), "push up to the capacity");
+    }
+    int item = 5;
+    Expect(!ring.Push(std::move(item)) && ring.Full() && ring.Size() == 5, "push beyond the capacity");
+
+    /* Wrap the 32-bit counters' low bits many times, in order */
+    int value = -1;
+    for (int i = 5; i < 1000; i++) {
+        Expect(ring.Pop(value) && value == i - 5, "pop in order");
+        item = i;
+        Expect(ring.Push(std::move(item)), "push after pop");
+    }
+
+    ring.SetLimit(2);
+    Expect(ring.Full(), "a lower limit applies to the items already queued");
+    while (ring.Pop(value)) {
+    }
+    item = 1;
+    ring.Push(std::move(item));
+    item = 2;
+    ring.Push(std::move(item));
+    item = 3;
+    Expect(!ring.Push(std::move(item)), "push beyond the limit");
+    ring.SetLimit(100);
+    Expect(ring.limit() == 5, "the limit is clamped to the capacity");
+
+    /* Clear() hides the items until the consumer drops them, later pushes stay */
+    ring.Clear();
+    item = 4;
+    ring.Push(std::move(item));
+    Expect(ring.Size() == 1, "cleared items are not counted");
+    Expect(!ring.Pop(value), "nothing is popped while a discard is pending");
+    int released = 0;
+    Expect(ring.DropDiscarded([&released](int&&) { released++; }) == 2 && released == 2, "discarded items are released");
+    Expect(ring.Pop(value) && value == 4 && ring.Empty(), "items pushed after Clear() are kept");
+    Expect(ring.DropDiscarded() == 0, "an old discard mark is ignored");
+
+    /* One producer, one consumer thread */
+    SpscRingBuffer<uint32_t> shared(8);
+    const uint32_t count = 200000;
+    std::thread producer([&shared]() {
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t next = i;
+            while (!shared.Push(std::move(next))) {
+                std::this_thread::yield();
+            }
+        }
+    });
+    uint32_t expected = 0;
+    bool ordered = true;
+    while (expected < count) {
+        uint32_t next;
+        if (shared.Pop(next)) {
+            ordered = ordered && next == expected;
+            expected++;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    producer.join();
+    Expect(ordered, "items cross threads in order");
+}
+
+int main() {
+    CheckRing();
+
+    printf("%d frames every %d us, encode %d us, decode %d us per frame (host threads)\n", FRAME_COUNT,
+        FRAME_PERIOD_US, ENCODE_WORK_US, DECODE_WORK_US);
+    printf("%-12s %8s %8s %7s %8s %7s %8s %7s %7s %8s %7s %7s %8s\n", "queues", "wakeups", "idle", "lock", "lock",
+        "hold", "hold", "up", "up", "up", "down", "down", "down");
+    printf("%-12s %8s %8s %7s %8s %7s %8s %7s %7s %8s %7s %7s %8s\n", "", "", "", "wait us", "max us", "us",
+        "max us", "mean us", "jitter", "p99 us", "mean us", "jitter", "p99 us");
+    {
+        Statistics statistics;
+        SharedLockQueues queues(statistics);
+        RunPipeline("shared lock", queues, statistics);
+    }
+    {
+        Statistics statistics;
+        SpscQueues queues(statistics);
+        RunPipeline("spsc", queues, statistics);
+    }
+    return failures > 0 ? 1 : 0;
+}
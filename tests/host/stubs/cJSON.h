@@ -0,0 +1,7 @@
+#ifndef HOST_CJSON_H
+#define HOST_CJSON_H
+
+// Host builds only use the types declared next to the audio packets, never the JSON functions
+typedef struct cJSON cJSON;
+
+#endif // HOST_CJSON_H
@@ -0,0 +1,57 @@
+#ifndef HOST_MBEDTLS_AES_H
+#define HOST_MBEDTLS_AES_H
+
+#include <cstddef>
+#include <openssl/evp.h>
+
+/*
+ * Host builds: the mbedtls AES calls used by the firmware, on OpenSSL. The block cipher is OpenSSL's
+ * AES-128-ECB (AES-NI where the CPU has it), the CTR mode follows mbedtls_aes_crypt_ctr() byte for byte.
+ */
+typedef struct {
+    EVP_CIPHER_CTX* ctx;
+} mbedtls_aes_context;
+
+inline void mbedtls_aes_init(mbedtls_aes_context* aes) {
+    aes->ctx = EVP_CIPHER_CTX_new();
+}
+
+inline void mbedtls_aes_free(mbedtls_aes_context* aes) {
+    EVP_CIPHER_CTX_free(aes->ctx);
+    aes->ctx = nullptr;
+}
+
+inline int mbedtls_aes_setkey_enc(mbedtls_aes_context* aes, const unsigned char* key, unsigned int keybits) {
+    if (keybits != 128 || EVP_EncryptInit_ex(aes->ctx, EVP_aes_128_ecb(), nullptr, key, nullptr) != 1) {
+        return -1;
+    }
+    EVP_CIPHER_CTX_set_padding(aes->ctx, 0);
+    return 0;
+}
+
+inline int mbedtls_aes_crypt_ctr(mbedtls_aes_context* aes, size_t length, size_t* nc_off, unsigned char nonce_counter[16],
+        unsigned char stream_block[16], const unsigned char* input, unsigned char* output) {
+    size_t n = *nc_off;
+    if (n > 0x0F) {
+        return -1;
+    }
+    while (length--) {
+        if (n == 0) {
+            int out_size = 0;
+            if (EVP_EncryptUpdate(aes->ctx, stream_block, &out_size, nonce_counter, 16) != 1) {
+                return -1;
+            }
+            for (int i = 16; i > 0; i--) {
+                if (++nonce_counter[i - 1] != 0) {
+                    break;
+                }
+            }
+        }
+        *output++ = *input++ ^ stream_block[n];
+        n = (n + 1) & 0x0F;
+    }
+    *nc_off = n;
+    return 0;
+}
+
+#endif // HOST_MBEDTLS_AES_H
@@ -0,0 +1,171 @@
+/*
+ * Checks the MQTT+UDP audio framing (EncryptUdpAudio / DecryptUdpAudio) against the NIST AES-128-CTR
+ * vectors and the former SendAudio() code, counts the heap allocations per packet, and times both send
+ * paths. AES comes from OpenSSL through the mbedtls shim in stubs/, so the timings are host figures: they
+ * show what the copies and allocations cost next to the cipher, not the ESP32 software or hardware AES.
+ * Exits with 1 on a mismatch or an allocation on the in-place path, the timings never fail.
+ */
+#include "udp_audio_crypto.h"
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+
+#define BENCH_PACKETS 200000
+
+static size_t allocations = 0;
+
+void* operator new(size_t size) {
+    allocations++;
+    if (void* p = malloc(size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+static int failures = 0;
+
+static void Expect(bool condition, const char* what) {
+    if (!condition) {
+        printf("FAIL %s\n", what);
+        failures++;
+    }
+}
+
+static std::vector<uint8_t> FromHex(const char* hex) {
+    std::vector<uint8_t> bytes;
+    for (size_t i = 0; hex[i] != '\0' && hex[i + 1] != '\0'; i += 2) {
+        bytes.push_back((uint8_t)strtoul(std::string(hex + i, 2).c_str(), nullptr, 16));
+    }
+    return bytes;
+}
+
+/* SendAudio() before the scratch buffer: a nonce copy and a new datagram string for every packet */
+static bool LegacyEncrypt(mbedtls_aes_context& aes, const std::string& aes_nonce, uint32_t timestamp, uint32_t sequence,
+        const std::vector<uint8_t>& payload, std::string& sent) {
+    std::string nonce(aes_nonce);
+    *(uint16_t*)&nonce[2] = htons(payload.size());
+    *(uint32_t*)&nonce[8] = htonl(timestamp);
+    *(uint32_t*)&nonce[12] = htonl(sequence);
+
+    std::string encrypted;
+    encrypted.resize(aes_nonce.size() + payload.size());
+    memcpy(encrypted.data(), nonce.data(), nonce.size());
+
+    size_t nc_off = 0;
+    uint8_t stream_block[16] = {0};
+    if (mbedtls_aes_crypt_ctr(&aes, payload.size(), &nc_off, (uint8_t*)nonce.c_str(), stream_block,
+        payload.data(), (uint8_t*)&encrypted[nonce.size()]) != 0) {
+        return false;
+    }
+    /* Udp::Send() takes the string by reference */
+    sent.swap(encrypted);
+    return true;
+}
+
+static void CheckVectors(mbedtls_aes_context& aes) {
+    /* NIST SP 800-38A F.5.1, the initial counter block is the datagram header */
+    auto datagram = FromHex("f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff"
+        "874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff"
+        "5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee");
+    auto plaintext = FromHex("6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+        "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710");
+    std::vector<uint8_t> out(plaintext.size());
+    Expect(DecryptUdpAudio(aes, datagram.data(), datagram.size(), out.data()) && out == plaintext,
+        "NIST AES-128-CTR vector");
+    /* A partial last block */
+    Expect(DecryptUdpAudio(aes, datagram.data(), datagram.size() - 7, out.data()) &&
+        memcmp(out.data(), plaintext.data(), plaintext.size() - 7) == 0, "NIST vector, partial block");
+    Expect(!DecryptUdpAudio(aes, datagram.data(), MQTT_UDP_HEADER_SIZE - 1, out.data()), "datagram shorter than the header");
+}
+
+static void CheckFraming(mbedtls_aes_context& aes, const std::string& nonce) {
+    std::string datagram;
+    for (size_t size : { 0, 1, 15, 16, 17, 120, 1000, 1500 }) {
+        std::vector<uint8_t> payload(size);
+        for (size_t i = 0; i < size; i++) {
+            payload[i] = (uint8_t)(i * 7 + size);
+        }
+        uint32_t timestamp = 0x12345678 + size;
+        uint32_t sequence = 0xfffffff0 + size;
+        Expect(EncryptUdpAudio(aes, nonce, timestamp, sequence, payload.data(), size, datagram), "encrypt");
+
+        std::string legacy;
+        Expect(LegacyEncrypt(aes, nonce, timestamp, sequence, payload, legacy), "legacy encrypt");
+        Expect(datagram == legacy, "the datagram differs from the former SendAudio()");
+
+        auto data = (const uint8_t*)datagram.data();
+        Expect(datagram.size() == MQTT_UDP_HEADER_SIZE + size && data[0] == (uint8_t)nonce[0], "header type");
+        Expect(ntohs(*(uint16_t*)&data[2]) == size, "header payload length");
+        Expect(ntohl(*(uint32_t*)&data[8]) == timestamp && ntohl(*(uint32_t*)&data[12]) == sequence, "header timestamp and sequence");
+
+        std::vector<uint8_t> decrypted(size);
+        Expect(DecryptUdpAudio(aes, data, datagram.size(), decrypted.data()) && decrypted == payload, "round trip");
+    }
+}
+
+static void Benchmark(mbedtls_aes_context& aes, const std::string& nonce) {
+    printf("%-9s %-30s %12s %10s %12s\n", "payload", "path (host, OpenSSL AES)", "packets/s", "ns/packet", "allocs/packet");
+    for (size_t size : { 120, 1000 }) {
+        std::vector<uint8_t> payload(size, 0x5a);
+        std::vector<uint8_t> received(size);
+        std::string datagram;
+        EncryptUdpAudio(aes, nonce, 0, 0, payload.data(), size, datagram);
+
+        auto run = [&](const char* name, auto&& send) {
+            size_t start_allocations = allocations;
+            auto start = std::chrono::steady_clock::now();
+            for (uint32_t i = 0; i < BENCH_PACKETS; i++) {
+                send(i);
+            }
+            double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            double per_packet = (double)(allocations - start_allocations) / BENCH_PACKETS;
+            printf("%6zu B  %-30s %12.0f %10.1f %12.2f\n", size, name, BENCH_PACKETS / (ns / 1e9), ns / BENCH_PACKETS, per_packet);
+            return per_packet;
+        };
+        run("send: nonce and datagram copies", [&](uint32_t i) {
+            std::string sent;
+            LegacyEncrypt(aes, nonce, i * 60, i, payload, sent);
+        });
+        double send_allocations = run("send: in place", [&](uint32_t i) {
+            EncryptUdpAudio(aes, nonce, i * 60, i, payload.data(), size, datagram);
+        });
+        double receive_allocations = run("receive: into pooled payload", [&](uint32_t) {
+            DecryptUdpAudio(aes, (const uint8_t*)datagram.data(), datagram.size(), received.data());
+        });
+        Expect(send_allocations == 0 && receive_allocations == 0, "the in-place path allocates");
+    }
+}
+
+int main() {
+    mbedtls_aes_context aes;
+    mbedtls_aes_init(&aes);
+    auto key = FromHex("2b7e151628aed2a6abf7158809cf4f3c");
+    Expect(mbedtls_aes_setkey_enc(&aes, key.data(), 128) == 0, "set key");
+
+    /* As sent by the server in the hello: type 1, then the ssrc, the other fields are written per packet */
+    std::string nonce(MQTT_UDP_HEADER_SIZE, '\0');
+    nonce[0] = 0x01;
+    nonce[4] = 0x0a;
+    nonce[7] = 0x0b;
+
+    CheckVectors(aes);
+    CheckFraming(aes, nonce);
+    Benchmark(aes, nonce);
+    mbedtls_aes_free(&aes);
+    return failures > 0 ? 1 : 0;
+}